@@ -0,0 +1,83 @@
+#include <makestack/types.h>
+#include <makestack/logger.h>
+#include <makestack/app_store.h>
+
+// NVS is initialized by initArduino().
+#define NVS_NAMESPACE "makestack"
+#define NVS_KEY_VERSION "app_version"
+#define NVS_KEY_BYTECODE "app_bytecode"
+
+static uint32_t rejected_version = 0;
+
+// Returns 0 if no bytecode is stored.
+uint32_t app_store_version() {
+    nvs_handle handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return 0;
+    }
+
+    uint32_t version = 0;
+    nvs_get_u32(handle, NVS_KEY_VERSION, &version);
+    nvs_close(handle);
+    return version;
+}
+
+// Returns a malloc'ed buffer or NULL if no bytecode is stored.
+uint8_t *app_store_load(size_t *len) {
+    nvs_handle handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return NULL;
+    }
+
+    uint8_t *blob = NULL;
+    if (nvs_get_blob(handle, NVS_KEY_BYTECODE, NULL, len) == ESP_OK) {
+        blob = (uint8_t *) malloc(*len);
+        if (blob && nvs_get_blob(handle, NVS_KEY_BYTECODE, blob, len) != ESP_OK) {
+            free(blob);
+            blob = NULL;
+        }
+    }
+
+    nvs_close(handle);
+    return blob;
+}
+
+bool app_store_save(uint32_t version, const uint8_t *blob, size_t len) {
+    nvs_handle handle;
+    esp_err_t err;
+    if ((err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle)) != ESP_OK) {
+        WARN("nvs_open: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    if ((err = nvs_set_blob(handle, NVS_KEY_BYTECODE, blob, len)) != ESP_OK
+        || (err = nvs_set_u32(handle, NVS_KEY_VERSION, version)) != ESP_OK
+        || (err = nvs_commit(handle)) != ESP_OK) {
+        WARN("failed to save the app: %s", esp_err_to_name(err));
+        nvs_close(handle);
+        return false;
+    }
+
+    nvs_close(handle);
+    return true;
+}
+
+// Makes the firmware run the embedded app again, e.g. on a firmware update.
+void app_store_clear() {
+    nvs_handle handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+
+    nvs_erase_all(handle);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+void app_store_reject(uint32_t version) {
+    rejected_version = version;
+}
+
+bool app_store_is_rejected(uint32_t version) {
+    return version != 0 && version == rejected_version;
+}
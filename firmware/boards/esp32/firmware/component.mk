@@ -9,3 +9,39 @@ endif
 ifneq ($(MAKESTACK_HEARTBEAT_INTERVAL),)
 CXXFLAGS += -DMAKESTACK_HEARTBEAT_INTERVAL=$(MAKESTACK_HEARTBEAT_INTERVAL)
 endif
+
+ifneq ($(MAKESTACK_VM_IC_STATS),)
+CXXFLAGS += -DVM_IC_STATS
+endif
+
+ifneq ($(MAKESTACK_VM_REFCOUNT_STATS),)
+CXXFLAGS += -DVM_REFCOUNT_STATS
+endif
+
+ifneq ($(MAKESTACK_VM_GC_MAX_WORK_PER_SLICE),)
+CXXFLAGS += -DVM_GC_MAX_WORK_PER_SLICE=$(MAKESTACK_VM_GC_MAX_WORK_PER_SLICE)
+endif
+
+ifneq ($(MAKESTACK_VM_MAX_CALL_DEPTH),)
+CXXFLAGS += -DVM_MAX_CALL_DEPTH=$(MAKESTACK_VM_MAX_CALL_DEPTH)
+endif
+
+ifneq ($(MAKESTACK_VM_MAX_STACK_SIZE),)
+CXXFLAGS += -DVM_MAX_STACK_SIZE=$(MAKESTACK_VM_MAX_STACK_SIZE)
+endif
+
+ifneq ($(MAKESTACK_VM_HEAP_BUDGET),)
+CXXFLAGS += -DVM_HEAP_BUDGET=$(MAKESTACK_VM_HEAP_BUDGET)
+endif
+
+ifneq ($(MAKESTACK_SUPERVISOR_HEAP_RESERVE),)
+CXXFLAGS += -DVM_SUPERVISOR_HEAP_RESERVE=$(MAKESTACK_SUPERVISOR_HEAP_RESERVE)
+endif
+
+ifneq ($(MAKESTACK_VM_EXTERNAL_MIN_SIZE),)
+CXXFLAGS += -DVM_EXTERNAL_MIN_SIZE=$(MAKESTACK_VM_EXTERNAL_MIN_SIZE)
+endif
+
+ifneq ($(MAKESTACK_BYTECODE_MAX_SIZE),)
+CXXFLAGS += -DMAKESTACK_BYTECODE_MAX_SIZE=$(MAKESTACK_BYTECODE_MAX_SIZE)
+endif
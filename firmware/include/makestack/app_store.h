@@ -0,0 +1,22 @@
+#ifndef __MAKESTACK_APP_STORE_H__
+#define __MAKESTACK_APP_STORE_H__
+
+#include <makestack/types.h>
+
+// The maximum size of an app bytecode received through the protocol.
+#ifndef MAKESTACK_BYTECODE_MAX_SIZE
+#define MAKESTACK_BYTECODE_MAX_SIZE (16 * 1024)
+#endif
+
+// The app bytecode (see vm_bytecode.h) stored in NVS. It is run instead of
+// the app embedded in the firmware.
+uint32_t app_store_version();
+uint8_t *app_store_load(size_t *len);
+bool app_store_save(uint32_t version, const uint8_t *blob, size_t len);
+void app_store_clear();
+// Remembers an app version which has failed to load so that it is not
+// downloaded again until the device restarts.
+void app_store_reject(uint32_t version);
+bool app_store_is_rejected(uint32_t version);
+
+#endif
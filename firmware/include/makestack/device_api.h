@@ -0,0 +1,20 @@
+#ifndef __MAKESTACK_DEVICE_API_H__
+#define __MAKESTACK_DEVICE_API_H__
+
+#include <makestack/vm.h>
+
+// The device API (`device.*` in app.js) taking arguments in C types. The
+// transpiler calls them directly by VM_NATIVE_CALL when the receiver is the
+// device object passed to the onReady callback. Other calls go through the
+// builtins in the device object, which convert arguments and call these.
+Value vm_device_print(Context *ctx, StringView message);
+Value vm_device_publish(Context *ctx, StringView name, const Value& value);
+Value vm_device_delay(Context *ctx, int ms);
+Value vm_device_delay_seconds(Context *ctx, int secs);
+Value vm_device_delay_minutes(Context *ctx, int mins);
+Value vm_device_pin_mode(Context *ctx, int pin, StringView mode_name);
+Value vm_device_digital_write(Context *ctx, int pin, bool level);
+Value vm_device_digital_read(Context *ctx, int pin);
+Value vm_device_analog_read(Context *ctx, int pin);
+
+#endif
@@ -22,11 +22,43 @@ struct firmware_request {
     uint32_t offset;
 } __attribute__((packed));
 
+// An app bytecode (see vm_bytecode.h) is downloaded in the same way as the
+// firmware: the server advertises it in app_info and the device requests
+// chunks of it until it has received the whole.
+struct app_info {
+    uint32_t version;
+    uint32_t size;
+} __attribute__((packed));
+
+struct app_data_header {
+    uint32_t offset;
+} __attribute__((packed));
+
+struct app_request {
+    uint32_t version;
+    uint32_t offset;
+} __attribute__((packed));
+
+// The kinds of VM objects in device_status.vm_live and device_status.vm_peak.
+#define VM_STATUS_STRING   0
+#define VM_STATUS_FUNCTION 1
+#define VM_STATUS_OBJECT   2
+#define VM_STATUS_ERROR    3
+#define VM_STATUS_SCOPE    4
+#define VM_STATUS_NUM_KINDS 5
+
 struct device_status {
     uint8_t state;
     uint8_t battery_level;
     uint16_t reserved;
     uint32_t ram_free;
+    uint32_t vm_pool_size;
+    uint16_t vm_live[VM_STATUS_NUM_KINDS];
+    uint16_t vm_peak[VM_STATUS_NUM_KINDS];
+    // The VM heap usage in bytes (see HeapBudget).
+    uint32_t vm_heap_used;
+    uint32_t vm_heap_peak;
+    uint32_t vm_heap_budget;
 } __attribute__((packed));
 
 void process_payload(uint8_t *payload, size_t payload_len);
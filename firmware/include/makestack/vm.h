@@ -5,6 +5,8 @@
 #include <vector>
 #include <unordered_map>
 #include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
 
 class Context;
 class ErrorInfo;
@@ -13,8 +15,17 @@ void vm_port_unhandled_error(ErrorInfo &info);
 void vm_port_panic(const char *fmt, ...) __attribute__((noreturn));
 void vm_port_print(const char *fmt, ...);
 void vm_port_debug(const char *fmt, ...);
+// Allocates `size` bytes in the external RAM (e.g. PSRAM). Returns null if
+// the board has no external RAM or it is full.
+void *vm_port_alloc_external(size_t size);
+void vm_port_free_external(void *ptr);
+// Returns true if `ptr` points to the external RAM.
+bool vm_port_is_external(const void *ptr);
+// Returns the largest size allocatable in the external RAM (0 if none).
+size_t vm_port_external_free_size();
 
 #include "port.h"
+#include "vm_alloc.h"
 
 #define VM_GET_BOOL_ARG(nth) vm_get_bool_arg_or_panic(ctx, nargs, args, nth)
 #define VM_GET_INT_ARG(nth) vm_get_int_arg_or_panic(ctx, nargs, args, nth)
@@ -22,12 +33,21 @@ void vm_port_debug(const char *fmt, ...);
 #define VM_GET_ARG(nth) vm_get_arg_or_panic(ctx, nargs, args, nth)
 #define VM_CURRENT_LOC SourceLoc(__FILE__, __func__, __LINE__)
 #define VM_CREATE_ERROR(fmt, ...) Value::Error(VM_CURRENT_LOC, fmt, ## __VA_ARGS__)
+// Returns an "out of memory" error from the function if the VM cannot
+// allocate `size` more bytes (see HeapBudget).
+#define VM_CHECK_HEAP(size)                                      \
+        do {                                                     \
+            if (!vm_heap_has_room(size)) {                       \
+                return VM_CREATE_ERROR("out of memory");         \
+            }                                                    \
+        } while (0)
 #define VM_PANIC(fmt, ...) \
         vm_port_panic("[%s] PANIC: " fmt "\n", __func__, ## __VA_ARGS__)
 #define VM_DEBUG(fmt, ...) \
         vm_port_debug("[%s] DEBUG: " fmt "\n", __func__, ## __VA_ARGS__)
 #define VM_UNREACHABLE(fmt, ...) \
         vm_port_panic("[%s] PANIC: unreachable " fmt "\n", __func__, ## __VA_ARGS__)
+#define VM_NODISCARD __attribute__((warn_unused_result))
 #define VM_ASSERT(expr)  do {                                              \
         if (!(expr)) {                                                     \
             vm_port_panic("[%s] ASSERTION FAILURE: %s", __func__, #expr);  \
@@ -38,74 +58,125 @@ void vm_port_debug(const char *fmt, ...);
 #define VM_NULL Value::Null()
 #define VM_UNDEF Value::Undefined()
 #define VM_STR(value) Value::String(value)
+#define VM_CONST_STR(name, value) static ValueInner name(value, true)
+#define VM_CONST(name) Value::Const(name)
 #define VM_BOOL(value) Value::Bool(value)
 #define VM_INT(value) Value::Int(value)
-#define VM_FUNC(name, closure) ({ closure = __ctx->create_closure_scope(); Value::Function(name); })
+#define VM_DOUBLE(value) Value::Double(value)
+#define VM_FUNC(name, closure) Value::Function(name)
+// Creates a function value which captures variables of outer functions: its
+// closure record holds only the captured ones, listed by VM_CAPTURE_VAR (a
+// copy of the value) and VM_CAPTURE_BOX (the box shared with the outer
+// function).
+#define VM_CLOSURE(name, nvars, nboxes, ...)                             \
+        ({                                                               \
+            Scope *__record = Scope::create(nullptr, nvars, nboxes);     \
+            __VA_ARGS__;                                                 \
+            Value::Function(name, __record);                             \
+        })
+#define VM_CAPTURE_VAR(i, depth, index)                                  \
+        (__record->slots[i] = __ctx->current->lookup(depth, index))
+#define VM_CAPTURE_BOX(i, depth, index)                                  \
+        __record->share_box(i, __ctx->current->lookup_box(depth, index))
 #define VM_ANON_LOC(line) VM_APP_LOC("(anonymous function)", line)
-#define VM_APP_LOC(func, line) SourceLoc("app.js", func, line)
-#define VM_SET(id, value) __ctx->current->set(id, value)
-#define VM_GET(id) __ctx->current->get(id)
-#define VM_MGET(obj, prop) ({ Value __obj = obj; __obj.get(prop); })
+#define VM_APP_LOC(func, line) VM_CALL_SITE("app.js", func, line)
+#define VM_CURRENT_CALL_SITE VM_CALL_SITE(__FILE__, __func__, __LINE__)
+// Returns the id of the call site. It is registered on the first call.
+#define VM_CALL_SITE(file, func, line)                                   \
+        ({ static CallSite __site = { file, func, line, 0 }; __site.id(); })
+#define VM_SET(id, value) __ctx->globals->set(id, value)
+#define VM_GET(id) __ctx->globals->get(id)
+#define VM_SET_VAR(depth, index, value) (__ctx->current->lookup(depth, index) = (value))
+#define VM_GET_VAR(depth, index) __ctx->current->lookup(depth, index)
+// Variables captured by inner functions and mutated are stored in boxes.
+#define VM_SET_BOX(depth, index, value) (__ctx->current->lookup_box(depth, index)->slots[0] = (value))
+#define VM_GET_BOX(depth, index) __ctx->current->lookup_box(depth, index)->slots[0]
+#define VM_MGET(obj, prop) ({ const Value& __obj = obj; __obj.get_element(prop); })
+#define VM_MGET_IC(obj, prop, cache) ({ const Value& __obj = obj; __obj.get(prop, cache); })
+#define VM_MSET(obj, prop, value) ({ const Value& __obj = obj; __obj.set_element(prop, value); })
+#define VM_INLINE_CACHE(name) static PropertyCache name(#name)
 #define VM_CALL(loc, callee, nargs, ...)                         \
         ({                                                       \
             Value __tmp_args[] = { __VA_ARGS__ };                \
-            Value __callee = callee;                             \
+            const Value& __callee = callee;                      \
             __ctx->call(loc, __callee, nargs, __tmp_args);       \
         })
 
+// Calls a method which arrays have (e.g. `queue.push(x)`). Other values call
+// the function stored in the property.
+#define VM_MCALL(loc, obj, prop, nargs, ...)                     \
+        ({                                                       \
+            Value __tmp_args[] = { __VA_ARGS__ };                \
+            const Value& __obj = obj;                            \
+            __ctx->call_method(loc, __obj, prop, nargs, __tmp_args); \
+        })
+
+// Calls a native function which takes arguments in C types (e.g.
+// vm_device_delay) without an array of values. The transpiler emits it when
+// the callee is statically known, converting each argument with VM_*_ARG or
+// in the transpiler if it is a literal.
+#define VM_NATIVE_CALL(loc, func, ...)                           \
+        ({                                                       \
+            NativeFrame __frame(__ctx, loc);                     \
+            func(__ctx, ## __VA_ARGS__);                         \
+        })
+#define VM_INT_ARG(value) vm_to_int_arg(value)
+#define VM_BOOL_ARG(value) ((value).toBool())
+#define VM_STRING_ARG(value) StringArg(value)
+#define VM_STRING_LIT(str) StringView(str, sizeof(str) - 1)
+
+// An array literal: `[a, b, c]`.
+#define VM_ARRAY(nelems, ...)                                    \
+        ({                                                       \
+            Value __elems[] = { __VA_ARGS__ };                   \
+            Value::Array(nelems, __elems);                       \
+        })
+
+#define VM_CONCAT(nparts, ...)                                   \
+        ({                                                       \
+            const Value __parts[] = { __VA_ARGS__ };             \
+            Value::concat(nparts, __parts);                      \
+        })
+
+// Typed arrays. The transpiler uses VM_TA_* for variables known to be a typed
+// array of the element type `type`.
+#define VM_NEW_TYPED_ARRAY(kind, length) Value::TypedArray(PackedArrayKind::kind, length)
+#define VM_TA_GET(type, array, index)                                    \
+        ({ const Value& __array = array; __array.packed_get<type>(index); })
+#define VM_TA_SET(type, array, index, value)                             \
+        ({ const Value& __array = array; __array.packed_set<type>(index, value); })
+#define VM_TA_LENGTH(array)                                              \
+        ({ const Value& __array = array; Value::Int(__array.packed().length); })
+#define VM_TA_CALL(method, array, nargs, ...)                            \
+        ({                                                               \
+            Value __tmp_args[] = { __VA_ARGS__ };                        \
+            vm_typed_array_##method(array, nargs, __tmp_args);           \
+        })
+
 #define VM_FUNC_DEF(name, closure)                                               \
-        Scope *closure = nullptr;                                                \
         static Value name(Context *__ctx, int __nargs, Value *__args)
 
-#define VM_FUNC_ENTER0(closure)                                                  \
-        Closure __closure(__ctx, closure);                                       \
-
-#define VM_FUNC_ENTER1(closure, param1)                                          \
-        VM_ASSERT(__nargs <= 1 && "too few arguments");                          \
-        Closure __closure(__ctx, closure);                                       \
-        VM_SET(param1, __args[0]);
-
-#define VM_FUNC_ENTER2(closure, param1, param2)                                  \
-        VM_ASSERT(__nargs <= 2 && "too few arguments");                          \
-        Closure __closure(__ctx, closure);                                       \
-        VM_SET(param1, __args[0]);                                               \
-        VM_SET(param2, __args[1]);
-
-#define VM_FUNC_ENTER3(closure, param1, param2, param3)                          \
-        VM_ASSERT(__nargs <= 3 && "too few arguments");                          \
-        Closure __closure(__ctx, closure);                                       \
-        VM_SET(param1, __args[0]);                                               \
-        VM_SET(param2, __args[1]);                                               \
-        VM_SET(param3, __args[2]);
-
-#define VM_FUNC_ENTER4(closure, param1, param2, param3, param4)                  \
-        VM_ASSERT(__nargs <= 4 && "too few arguments");                          \
-        Closure __closure(__ctx, closure);                                       \
-        VM_SET(param1, __args[0]);                                               \
-        VM_SET(param2, __args[1]);                                               \
-        VM_SET(param3, __args[2]);                                               \
-        VM_SET(param4, __args[3]);
-
-#define VM_FUNC_ENTER5(closure, param1, param2, param3, param4, param5)          \
-        VM_ASSERT(__nargs <= 5 && "too few arguments");                          \
-        Closure __closure(__ctx, closure);                                       \
-        VM_SET(param1, __args[0]);                                               \
-        VM_SET(param2, __args[1]);                                               \
-        VM_SET(param3, __args[2]);                                               \
-        VM_SET(param4, __args[3]);                                               \
-        VM_SET(param5, __args[4]);
-
-#define VM_FUNC_ENTER6(closure, param1, param2, param3, param4, param5, param6)  \
-        VM_ASSERT(__nargs <= 6 && "too few arguments");                          \
-        Closure __closure(__ctx, closure);                                       \
-        VM_SET(param1, __args[0]);                                               \
-        VM_SET(param2, __args[1]);                                               \
-        VM_SET(param3, __args[2]);                                               \
-        VM_SET(param4, __args[3]);                                               \
-        VM_SET(param5, __args[4]);                                               \
-        VM_SET(param6, __args[5]);
-
-enum class ValueType {
+// Enters a function. Its scope is allocated on the C stack: inner functions
+// never capture it but copy the values they need into their closure records.
+// `closure` is the closure record of the function value being called (see
+// Value::call).
+#define VM_STACK_FUNC_ENTER(closure, nparams, nslots)                            \
+        Scope *closure = __ctx->callee_closure;                                  \
+        Value __slots[nslots];                                                   \
+        StackClosure __closure(__ctx, closure, nslots, __slots);                 \
+        __ctx->current->bind_args(nparams, __nargs, __args);
+
+// Same as VM_STACK_FUNC_ENTER but `nboxes` variables are captured by inner
+// functions and mutated: they are stored in boxes in the heap instead of
+// slots.
+#define VM_BOXED_FUNC_ENTER(closure, nparams, nslots, nboxes)                    \
+        Scope *closure = __ctx->callee_closure;                                  \
+        Value __slots[nslots];                                                   \
+        Scope *__boxes[nboxes];                                                  \
+        StackClosure __closure(__ctx, closure, nslots, __slots, nboxes, __boxes); \
+        __ctx->current->bind_args(nparams, __nargs, __args);
+
+enum class ValueType : uint8_t {
     Invalid = 0, /* We never use it. */
     Undefined = 1,
     Null = 2,
@@ -115,12 +186,234 @@ enum class ValueType {
     String = 6,
     Function = 7,
     Object = 8,
+    Double = 9,
+    TypedArray = 10,
+    Array = 11,
+};
+
+#define VM_NUM_VALUE_TYPES 12
+
+// The operand types of a binary operator. Operators look it up once in
+// vm_operand_types instead of checking each type of the operands.
+enum class Operands : uint8_t {
+    Invalid,
+    IntInt,
+    // Numbers at least one of which is a double.
+    Numbers,
+    // Either is a string: `+` concatenates them.
+    Strings,
+    // Undefined, null, or booleans of the same type (`==` only).
+    Same,
+};
+
+// Indexed by the types of the lhs and the rhs.
+extern const Operands vm_operand_types[VM_NUM_VALUE_TYPES][VM_NUM_VALUE_TYPES];
+
+// The result of comparing two values. Unordered if either is NaN.
+enum class Ordering : uint8_t {
+    Less,
+    Equal,
+    Greater,
+    Unordered,
+};
+
+// The element type of a typed array.
+enum class PackedArrayKind : uint8_t {
+    Int16,
+    Int32,
+    Uint8,
 };
 
 class Scope;
 class Value;
 typedef Value (*NativeFunction)(Context *ctx, int nargs, Value *args);
 
+// The contents of a string value. Long strings are placed by
+// vm_alloc_buffer().
+typedef std::basic_string<char, std::char_traits<char>, BufferAllocator<char>> HeapString;
+
+// A string-keyed hash map whose nodes are allocated from the VM pool.
+template<typename V>
+using StringMap = std::unordered_map<
+    std::string, V, std::hash<std::string>, std::equal_to<std::string>,
+    PoolAllocator<std::pair<const std::string, V>>
+>;
+
+// The number of live heap-allocated VM objects and its peak value.
+class HeapStats {
+public:
+    int live[VM_NUM_VALUE_TYPES];
+    int peak[VM_NUM_VALUE_TYPES];
+    int scopes_live;
+    int scopes_peak;
+
+    void value_allocated(ValueType type) {
+        int i = static_cast<int>(type);
+        live[i]++;
+        if (live[i] > peak[i]) {
+            peak[i] = live[i];
+        }
+    }
+
+    void value_freed(ValueType type) {
+        live[static_cast<int>(type)]--;
+    }
+
+    void scope_allocated() {
+        scopes_live++;
+        if (scopes_live > scopes_peak) {
+            scopes_peak = scopes_live;
+        }
+    }
+
+    void scope_freed() {
+        scopes_live--;
+    }
+};
+
+extern HeapStats vm_heap_stats;
+
+// Concatenating strings longer than this makes a rope instead of copying them.
+#ifndef VM_ROPE_MIN_LENGTH
+#define VM_ROPE_MIN_LENGTH 64
+#endif
+
+// The maximum depth of ropes. A deeper rope is flattened before being
+// concatenated to bound the recursion in flattening and freeing it.
+#ifndef VM_ROPE_MAX_DEPTH
+#define VM_ROPE_MAX_DEPTH 16
+#endif
+
+// The maximum depth of calls, i.e., the size of the shadow call stack.
+// Deeper calls return an error.
+#ifndef VM_MAX_CALL_DEPTH
+#define VM_MAX_CALL_DEPTH 32
+#endif
+
+// The C stack the VM may use below the frame which creates the context. A
+// call which would go deeper returns an error instead of overflowing the
+// stack of the app task (8 KiB). The frame count alone does not bound it: a
+// call of a small transpiled function takes about 450 bytes (measured on a
+// 64-bit host with -Os) and more with more variables. The rest of the stack
+// is left for the frame being entered and native functions called from it.
+#ifndef VM_MAX_STACK_SIZE
+#define VM_MAX_STACK_SIZE (5 * 1024)
+#endif
+
+// The maximum number of steps (references traced and objects freed) the cycle
+// collector does in a slice, i.e., the bound of a pause caused by
+// vm_collect_cycles().
+#ifndef VM_GC_MAX_WORK_PER_SLICE
+#define VM_GC_MAX_WORK_PER_SLICE 256
+#endif
+
+enum class GCColor : uint8_t {
+    Black,  // In use or free.
+    Gray,   // Being traced by the cycle collector.
+    White,  // Member of a garbage cycle being freed.
+    Purple, // Possible root of a cycle.
+};
+
+class HeapObject;
+
+// Records an object whose reference count is decremented to nonzero: it may
+// have become garbage in a cycle.
+void vm_gc_add_candidate(HeapObject *obj);
+void vm_gc_remove_candidate(HeapObject *obj);
+// Records a gray object whose reference count has changed.
+void vm_gc_touch(HeapObject *obj);
+// Collects garbage cycles reachable from the candidates. It stops once it has
+// done `max_work` steps and returns true if work remains. Call it when the app
+// is idle (e.g. in device.delay()).
+bool vm_collect_cycles(int max_work);
+
+// The header of reference-counted heap objects. Objects, functions, and scopes
+// can form reference cycles (e.g. a function stored in the scope it captures)
+// which reference counting never frees: the cycle collector (vm_gc.cpp)
+// reclaims them.
+class HeapObject {
+public:
+    int ref_count;
+    GCColor color;
+    bool is_scope : 1;
+    // True if this is in the candidate list of the cycle collector.
+    bool buffered : 1;
+    // True if the reference count has changed while the cycle collector is
+    // tracing this object: it is kept alive in the collection.
+    bool dirty : 1;
+    // The number of references from outside of the objects traced by the
+    // cycle collector.
+    uint16_t gc_count;
+    HeapObject *prev_candidate;
+    HeapObject *next_candidate;
+
+    HeapObject(bool is_scope)
+        : ref_count(1), color(GCColor::Black), is_scope(is_scope),
+          buffered(false), dirty(false), gc_count(0),
+          prev_candidate(nullptr), next_candidate(nullptr) {}
+    inline ~HeapObject();
+
+    void retain() {
+        ref_count++;
+        if (color == GCColor::Gray) {
+            vm_gc_touch(this);
+        }
+    }
+};
+
+inline HeapObject::~HeapObject() {
+    if (buffered) {
+        vm_gc_remove_candidate(this);
+    }
+}
+
+// A read-only view of a string owned by someone else, like std::string_view
+// (C++17). The contents is NUL-terminated.
+class StringView {
+public:
+    StringView(const char *data, size_t length) : data(data), len(length) {}
+
+    const char *c_str() const {
+        return data;
+    }
+
+    size_t length() const {
+        return len;
+    }
+
+    bool operator==(const char *s) const {
+        return strlen(s) == len && memcmp(data, s, len) == 0;
+    }
+
+    bool operator!=(const char *s) const {
+        return !(*this == s);
+    }
+
+private:
+    const char *data;
+    size_t len;
+};
+
+// Returns the FNV-1a hash of a string.
+uint32_t vm_hash_string(const char *s, size_t length);
+
+// The maximum length of a formatted int: "-2147483648".
+#define VM_INT_STR_MAX 11
+
+// Writes the decimal representation of `value` into `buf`, which must have
+// VM_INT_STR_MAX bytes, and returns its length. It is not NUL-terminated.
+int vm_format_int(char *buf, int value);
+// The maximum length of a formatted double, e.g. "-0.0000012345678901234567".
+#define VM_DOUBLE_STR_MAX 32
+
+// Writes the shortest decimal representation of `value` which reads back as
+// the same double, in the format of JavaScript's Number#toString, into `buf`
+// (VM_DOUBLE_STR_MAX bytes). Returns its length. It is NUL-terminated.
+int vm_format_double(char *buf, double value);
+// Parses a decimal integer with an optional sign. Returns false if `s` is
+// not a decimal integer or it overflows.
+bool vm_parse_int(const char *s, size_t length, int *value);
+
 class SourceLoc {
 public:
     const char *file;
@@ -130,269 +423,441 @@ public:
         file(file), func(func), lineno(lineno) {}
 };
 
-class Frame {
+// A frame of the call stack: the id of the call site.
+typedef uint16_t CallSiteId;
+
+// The location of a call (VM_CALL_SITE). Sites are numbered when called first
+// so that frames of the call stack fit in 16 bits.
+class CallSite {
 public:
-    SourceLoc callee;
+    const char *file;
+    const char *func;
+    int lineno;
+    // 0 if not registered yet.
+    CallSiteId site_id;
+
+    CallSiteId id() {
+        return site_id ? site_id : register_id();
+    }
 
-    Frame(SourceLoc callee) : callee(callee) {}
+private:
+    CallSiteId register_id();
 };
 
+// Returns the call site of `id`.
+const CallSite& vm_get_call_site(CallSiteId id);
+
+// Error messages shorter than this are stored in ErrorInfo itself.
+#ifndef VM_ERROR_INLINE_MESSAGE_LEN
+#define VM_ERROR_INLINE_MESSAGE_LEN 32
+#endif
+
+// The stacktrace of an error is captured lazily: the error records the call
+// depth when it is thrown and stays in the context's pending list. The frames
+// are copied only when the context is about to return from one of them
+// (Context::call) or when the error is printed. Checked errors never copy
+// them.
 class ErrorInfo {
 public:
-    std::string message;
-    // A copy of the stacktrace when the error is thrown.
-    std::vector<Frame> frames;
+    const char *message;
+    // The call stack when the error is thrown. Use stacktrace() instead.
+    std::vector<CallSiteId> frames;
+    // Where the error is thrown.
+    SourceLoc loc;
     bool checked = false;
 
-    ErrorInfo(SourceLoc loc, std::string message);
+    ErrorInfo(SourceLoc loc, const char *message);
     ~ErrorInfo();
 
-    void check() {
-        checked = true;
+    void check();
+    // Returns the call stack when the error is thrown (except `loc`).
+    std::vector<CallSiteId>& stacktrace() {
+        if (ctx) {
+            capture();
+        }
+
+        return frames;
+    }
+
+    // Returns false if the error is thrown outside of the app (no context).
+    bool has_stacktrace() const {
+        return depth >= 0;
     }
+
+private:
+    friend class Context;
+
+    // The context which the error is pending in (or null if the stacktrace
+    // is already captured) and the number of its frames when thrown (-1 if
+    // there is no context).
+    Context *ctx;
+    int depth;
+    ErrorInfo *prev_pending;
+    ErrorInfo *next_pending;
+    char inline_message[VM_ERROR_INLINE_MESSAGE_LEN];
+
+    void capture();
+    void remove_pending();
 };
 
-class ValueInner {
+class ValueInner;
+class Shape;
+class Elements;
+class PackedArray;
+
+// A monomorphic inline cache of a property lookup at a VM_MGET_IC site: the
+// shape of the object seen last time and the slot index of the property.
+class PropertyCache {
 public:
-    ValueType type;
-    int ref_count = 1;
-    union {
-        NativeFunction v_f;
-        std::string v_s;
-        int v_i;
-        bool v_b;
-        ErrorInfo v_e;
-        std::unordered_map<std::string, ValueInner *> v_obj;
-    };
+    Shape *shape;
+    int index;
+
+    PropertyCache(const char *name);
+
+#ifdef VM_IC_STATS
+    const char *name;
+    unsigned hits;
+    unsigned misses;
+    PropertyCache *next;
+
+    void hit() { hits++; }
+    void miss() { misses++; }
+#else
+    void hit() {}
+    void miss() {}
+#endif
+};
 
-    ValueInner(ValueType type) : type(type) {
-        if (type == ValueType::Object) {
-            new (&v_obj) std::unordered_map<std::string, ValueInner *>();
-        }
+// A JavaScript value. Undefined, null, booleans, and numbers are stored
+// inline in the value itself; strings, functions, objects, arrays, and errors
+// are allocated in the heap (ValueInner) and reference counted.
+//
+// Numbers are Int if they are int32 (the fast path) or Double otherwise.
+// Arithmetic widens to Double only if the result is not an int32 (e.g. on
+// overflow or `7 / 2`).
+class Value {
+public:
+    static Value Undefined() {
+        return Value(ValueType::Undefined);
     }
 
-    ValueInner(const char *str)
-        : type(ValueType::String), v_s(str) {}
-    ValueInner(int value)
-        : type(ValueType::Int), v_i(value) {}
-    ValueInner(bool value)
-        : type(ValueType::Bool), v_b(value) {}
-    ValueInner(NativeFunction value)
-        : type(ValueType::Function), v_f(value) {}
-    ValueInner(SourceLoc loc, const char *msg)
-        : type(ValueType::Error), v_e(loc, msg) {}
+    static Value Null() {
+        return Value(ValueType::Null);
+    }
 
-    std::string toString() const {
-        switch (type) {
-        case ValueType::Bool:
-            return v_b ? "true" : "false";
-        case ValueType::Int: {
-            char buf[32];
-            snprintf(buf, sizeof(buf), "%d", v_i);
-            return std::string(buf);
-        }
-        case ValueType::String:
-            return v_s;
-        default:
-            VM_PANIC("TODO: NYI");
-        }
+    static Value Bool(bool b) {
+        Value value(ValueType::Bool);
+        value.v_b = b;
+        return value;
+    }
+
+    static Value Int(int i) {
+        Value value(ValueType::Int);
+        value.v_i = i;
+        return value;
     }
 
+    static Value Double(double d) {
+        Value value(ValueType::Double);
+        value.v_d = d;
+        return value;
+    }
+
+    // Returns Int if `d` is an int32 or Double otherwise.
+    static Value Number(double d);
+
+    static Value String(const char *s);
+    static Value String(HeapString&& s);
+    static Value String(const std::string& s);
+    // Borrows a statically allocated value defined by VM_CONST_STR.
+    static Value Const(ValueInner& inner);
+    static Value Function(NativeFunction f, Scope *closure = nullptr);
+    // Creates a builtin function implemented in C++ (e.g. device.print). It
+    // never refers to its closure so Context::call calls it directly.
+    static Value Builtin(NativeFunction f);
+    static Value Object();
+    // Creates an array of `nelems` values moved from `elems`.
+    static Value Array(int nelems, Value *elems);
+    // Creates a zero-filled typed array (`new Int16Array(length)`).
+    static Value TypedArray(PackedArrayKind kind, const Value& length);
+    // Creates a typed array which shares `length` elements from `begin` with
+    // `array`.
+    static Value TypedArrayView(const Value& array, int begin, int length);
+
+    static Value Error(SourceLoc loc, const char *fmt, ...);
+
+    // Evaluates `parts[0] + parts[1] + ...` (VM_CONCAT). Once the result
+    // becomes a string, the rest is written into a buffer allocated at once.
+    static Value concat(int nparts, const Value *parts);
+
+    ValueType type() const {
+        return tag;
+    }
+
+    bool is_heap() const {
+        return tag == ValueType::String || tag == ValueType::Function
+            || tag == ValueType::Object || tag == ValueType::Error
+            || tag == ValueType::TypedArray || tag == ValueType::Array;
+    }
+
+    // Returns true if this is a heap value which no one else refers to, i.e.,
+    // it can be modified in place.
+    inline bool is_unique() const;
+
+    // Returns the object, the array, or the function if this refers to one,
+    // i.e., a value
+    // which may be a member of a reference cycle. Used by the cycle collector.
+    inline ValueInner *gc_container() const;
+    // Drops the reference without decrementing the reference count. The
+    // cycle collector uses this to free members of a garbage cycle.
+    void gc_forget() {
+        tag = ValueType::Undefined;
+        raw = 0;
+    }
+
+    std::string toString() const;
+    // Returns the contents of the string without copying it. The view is
+    // valid while this value is alive.
+    StringView toStringView() const;
+    bool toBool() const;
+
     int toInt() const {
-        VM_ASSERT(type == ValueType::Int);
+        VM_ASSERT(tag == ValueType::Int);
         return v_i;
     }
 
-    bool toBool() const {
-        switch (type) {
-        case ValueType::Int:
-            return v_i != 0;
-        case ValueType::Bool:
-            return v_b;
-        case ValueType::String:
-            return v_s.length() > 0;
-        case ValueType::Function:
-        case ValueType::Object:
-            return true;
-        case ValueType::Null:
-        case ValueType::Error:
-        case ValueType::Undefined:
-            return false;
-        default:
-            VM_UNREACHABLE();
-        }
-    }
-
-    ValueInner *add(const ValueInner& rhs);
-    ValueInner *sub(const ValueInner& rhs);
-    ValueInner *mul(const ValueInner& rhs);
-    ValueInner *div(const ValueInner& rhs);
-    ValueInner *mod(const ValueInner& rhs);
-    ValueInner *bitwise_and(const ValueInner& rhs);
-    ValueInner *bitwise_or(const ValueInner& rhs);
-    ValueInner *bitwise_xor(const ValueInner& rhs);
-    ValueInner *bitwise_lshift(const ValueInner& rhs);
-    ValueInner *bitwise_rshift(const ValueInner& rhs);
-    ValueInner *bitwise_not();
-    ValueInner *unary_plus();
-    ValueInner *unary_minus();
-    bool eq(const ValueInner& rhs);
-    bool gt(const ValueInner& rhs);
-    bool lt(const ValueInner& rhs);
-    void self_add(const ValueInner& rhs);
-    void self_sub(const ValueInner& rhs);
-    void self_mul(const ValueInner& rhs);
-    void self_div(const ValueInner& rhs);
-    void self_mod(const ValueInner& rhs);
-    void self_bitwise_and(const ValueInner& rhs);
-    void self_bitwise_or(const ValueInner& rhs);
-    void self_bitwise_xor(const ValueInner& rhs);
-    void self_bitwise_lshift(const ValueInner& rhs);
-    void self_bitwise_rshift(const ValueInner& rhs);
-
-    ~ValueInner() {
-        switch (type) {
-        case ValueType::Invalid:
-            VM_PANIC("tried to destruct invalid value");
-        case ValueType::Undefined:
-        case ValueType::Null:
-        case ValueType::Int:
-        case ValueType::Bool:
-        case ValueType::Function:
-            return;
-        case ValueType::String:
-            v_s.~basic_string();
-            break;
-        case ValueType::Object:
-            v_obj.~unordered_map();
-            break;
-        case ValueType::Error:
-            v_e.~ErrorInfo();
-            break;
+    bool is_number() const {
+        return tag == ValueType::Int || tag == ValueType::Double;
+    }
+
+    double toDouble() const {
+        VM_ASSERT(is_number());
+        return (tag == ValueType::Int) ? v_i : v_d;
+    }
+
+    // Converts a number into int32 as JavaScript's bitwise operators do.
+    int toInt32() const;
+
+    Value call(Context *ctx, int nargs, Value *args) const;
+    // Returns the function if this is a builtin or null otherwise.
+    inline ValueInner *builtin_inner() const;
+    Value get(const Value& prop) const;
+    inline Value get(const Value& prop, PropertyCache& cache) const;
+    Value set(const Value& prop, const Value& value) const;
+    // Same as get() and set() but faster for an array element (VM_MGET and
+    // VM_MSET).
+    inline Value get_element(const Value& prop) const;
+    inline Value set_element(const Value& prop, const Value& value) const;
+
+    inline Elements& elements() const;
+    // Accesses an element of a typed array whose elements are `T`.
+    inline PackedArray& packed() const;
+    template<typename T> inline Value packed_get(const Value& index) const;
+    template<typename T> inline Value packed_set(const Value& index, const Value& value) const;
+
+    Value add(const Value& rhs) const;
+    Value sub(const Value& rhs) const;
+    Value mul(const Value& rhs) const;
+    Value div(const Value& rhs) const;
+    Value mod(const Value& rhs) const;
+    Value bitwise_and(const Value& rhs) const;
+    Value bitwise_or(const Value& rhs) const;
+    Value bitwise_xor(const Value& rhs) const;
+    Value bitwise_lshift(const Value& rhs) const;
+    Value bitwise_rshift(const Value& rhs) const;
+    Value bitwise_not() const;
+    Value unary_plus() const;
+    Value unary_minus() const;
+    bool eq(const Value& rhs) const;
+    // Compares numbers or strings for relational operators. `op` is used in
+    // the error message.
+    Ordering compare(const Value& rhs, const char *op) const;
+    void self_add(const Value& rhs);
+    void self_sub(const Value& rhs);
+    void self_mul(const Value& rhs);
+    void self_div(const Value& rhs);
+    void self_mod(const Value& rhs);
+    void self_bitwise_and(const Value& rhs);
+    void self_bitwise_or(const Value& rhs);
+    void self_bitwise_xor(const Value& rhs);
+    void self_bitwise_lshift(const Value& rhs);
+    void self_bitwise_rshift(const Value& rhs);
+
+    operator bool() const {
+        return toBool();
+    }
+
+    Value& operator=(const Value& from) {
+        if (this == &from) {
+            return *this;
+        }
+
+        if (from.is_heap()) {
+            from.ref();
+        }
+
+        deref();
+        tag = from.tag;
+        raw = from.raw;
+        return *this;
+    }
+
+    Value& operator=(Value&& from) {
+        if (this == &from) {
+            return *this;
         }
+
+        // Release the old value after taking `from` in case it is owned by
+        // the old value.
+        Value old(std::move(*this));
+        tag = from.tag;
+        raw = from.raw;
+        from.tag = ValueType::Undefined;
+        from.raw = 0;
+        return *this;
     }
-};
 
-class Value {
-public:
-    static Value Undefined() {
-        return Value(new ValueInner(ValueType::Undefined));
+    // Operators on two ints are inlined here. Others go to the functions
+    // above, which dispatch on vm_operand_types.
+    VM_NODISCARD Value operator+(const Value& rhs) const & {
+        int result;
+        if (both_int(rhs) && !__builtin_add_overflow(v_i, rhs.v_i, &result)) {
+            return Value::Int(result);
+        }
+
+        return add(rhs);
     }
 
-    static Value Null() {
-        return Value(new ValueInner(ValueType::Null));
+    VM_NODISCARD Value operator+(const Value& rhs) && {
+        int result;
+        if (both_int(rhs) && !__builtin_add_overflow(v_i, rhs.v_i, &result)) {
+            return Value::Int(result);
+        }
+
+        return std::move(*this).add_in_place(rhs);
     }
 
-    static Value Bool(bool b) {
-        return Value(new ValueInner(b));
+    VM_NODISCARD Value operator-(const Value& rhs) const {
+        int result;
+        if (both_int(rhs) && !__builtin_sub_overflow(v_i, rhs.v_i, &result)) {
+            return Value::Int(result);
+        }
+
+        return sub(rhs);
     }
 
-    static Value Int(int i) {
-        return Value(new ValueInner(i));
+    VM_NODISCARD Value operator*(const Value& rhs) const {
+        int result;
+        // A zero with a negative operand is -0, which is not an int.
+        if (both_int(rhs) && !__builtin_mul_overflow(v_i, rhs.v_i, &result)
+            && (result != 0 || (v_i >= 0 && rhs.v_i >= 0))) {
+            return Value::Int(result);
+        }
+
+        return mul(rhs);
     }
 
-    static Value String(const char *s) {
-        return Value(new ValueInner(s));
+    VM_NODISCARD Value operator/(const Value& rhs) const { return div(rhs); }
+    VM_NODISCARD Value operator%(const Value& rhs) const { return mod(rhs); }
+
+    VM_NODISCARD Value operator&(const Value& rhs) const {
+        return both_int(rhs) ? Value::Int(v_i & rhs.v_i) : bitwise_and(rhs);
     }
 
-    static Value Function(NativeFunction f) {
-        return Value(new ValueInner(f));
+    VM_NODISCARD Value operator|(const Value& rhs) const {
+        return both_int(rhs) ? Value::Int(v_i | rhs.v_i) : bitwise_or(rhs);
     }
 
-    static Value Object() {
-        return Value(new ValueInner(ValueType::Object));
+    VM_NODISCARD Value operator^(const Value& rhs) const {
+        return both_int(rhs) ? Value::Int(v_i ^ rhs.v_i) : bitwise_xor(rhs);
     }
 
-    static Value Error(SourceLoc loc, const char *fmt, ...) {
-        va_list vargs;
-        va_start(vargs, fmt);
-        char buf[256];
-        vsnprintf((char *) &buf, sizeof(buf), fmt, vargs);
-        Value value(new ValueInner(loc, buf));
-        va_end(vargs);
-        return value;
+    VM_NODISCARD Value operator<<(const Value& rhs) const { return bitwise_lshift(rhs); }
+    VM_NODISCARD Value operator>>(const Value& rhs) const { return bitwise_rshift(rhs); }
+    VM_NODISCARD Value operator~() const { return bitwise_not(); }
+    VM_NODISCARD Value operator+() const { return unary_plus(); }
+    VM_NODISCARD Value operator-() const { return unary_minus(); }
+
+    bool operator==(const Value& rhs) const {
+        return both_int(rhs) ? v_i == rhs.v_i : eq(rhs);
     }
 
-    ValueType type() const {
-        return inner->type;
+    bool operator!=(const Value& rhs) const {
+        return both_int(rhs) ? v_i != rhs.v_i : !eq(rhs);
     }
 
-    std::string toString() const {
-        return inner->toString();
+    bool operator<(const Value& rhs) const {
+        return both_int(rhs) ? v_i < rhs.v_i : compare(rhs, "<") == Ordering::Less;
     }
 
-    bool toBool() const {
-        return inner->toBool();
+    bool operator>(const Value& rhs) const {
+        return both_int(rhs) ? v_i > rhs.v_i : compare(rhs, ">") == Ordering::Greater;
     }
 
-    int toInt() const {
-        return inner->toInt();
+    bool operator<=(const Value& rhs) const {
+        if (both_int(rhs)) {
+            return v_i <= rhs.v_i;
+        }
+
+        Ordering order = compare(rhs, "<=");
+        return order == Ordering::Less || order == Ordering::Equal;
     }
 
-    Value call(Context *ctx, int nargs, Value *args);
-    Value get(Value prop);
-    Value set(Value prop, Value value);
+    bool operator>=(const Value& rhs) const {
+        if (both_int(rhs)) {
+            return v_i >= rhs.v_i;
+        }
 
-    operator bool() {
-        return inner->toBool();
+        Ordering order = compare(rhs, ">=");
+        return order == Ordering::Greater || order == Ordering::Equal;
     }
 
-    Value& operator=(const Value& from) {
-        if (inner == from.inner) {
-            return *this;
+    Value& operator+=(const Value& rhs) {
+        int result;
+        if (both_int(rhs) && !__builtin_add_overflow(v_i, rhs.v_i, &result)) {
+            v_i = result;
+        } else {
+            self_add(rhs);
         }
 
-        deref();
+        return *this;
+    }
+
+    Value& operator-=(const Value& rhs) {
+        int result;
+        if (both_int(rhs) && !__builtin_sub_overflow(v_i, rhs.v_i, &result)) {
+            v_i = result;
+        } else {
+            self_sub(rhs);
+        }
 
-        inner = from.inner;
-        inner->ref_count++;
         return *this;
     }
 
-    Value operator+(const Value& rhs) { return Value(inner->add(*rhs.inner)); }
-    Value operator-(const Value& rhs) { return Value(inner->sub(*rhs.inner)); }
-    Value operator*(const Value& rhs) { return Value(inner->mul(*rhs.inner)); }
-    Value operator/(const Value& rhs) { return Value(inner->div(*rhs.inner)); }
-    Value operator%(const Value& rhs) { return Value(inner->mod(*rhs.inner)); }
-    Value operator&(const Value& rhs) { return Value(inner->bitwise_and(*rhs.inner)); }
-    Value operator|(const Value& rhs) { return Value(inner->bitwise_or(*rhs.inner)); }
-    Value operator^(const Value& rhs) { return Value(inner->bitwise_xor(*rhs.inner)); }
-    Value operator<<(const Value& rhs) { return Value(inner->bitwise_lshift(*rhs.inner)); }
-    Value operator>>(const Value& rhs) { return Value(inner->bitwise_rshift(*rhs.inner)); }
-    Value operator~() { return Value(inner->bitwise_not()); }
-    Value operator+() { return Value(inner->unary_plus()); }
-    Value operator-() { return Value(inner->unary_minus()); }
-    bool operator==(const Value& rhs) { return inner->eq(*rhs.inner); }
-    bool operator!=(const Value& rhs) { return !inner->eq(*rhs.inner); }
-    bool operator>(const Value& rhs)  { return inner->gt(*rhs.inner); }
-    bool operator<(const Value& rhs)  { return inner->lt(*rhs.inner); }
-    bool operator>=(const Value& rhs) { return inner->gt(*rhs.inner) || inner->eq(*rhs.inner); }
-    bool operator<=(const Value& rhs) { return inner->lt(*rhs.inner) || inner->eq(*rhs.inner); }
-    Value operator+=(const Value& rhs) { inner->self_add(*rhs.inner); return *this; }
-    Value operator-=(const Value& rhs) { inner->self_sub(*rhs.inner); return *this; }
-    Value operator*=(const Value& rhs) { inner->self_mul(*rhs.inner); return *this; }
-    Value operator/=(const Value& rhs) { inner->self_div(*rhs.inner); return *this; }
-    Value operator%=(const Value& rhs) { inner->self_mod(*rhs.inner); return *this; }
-    Value operator&=(const Value& rhs) { inner->self_bitwise_and(*rhs.inner); return *this; }
-    Value operator|=(const Value& rhs) { inner->self_bitwise_or(*rhs.inner); return *this; }
-    Value operator^=(const Value& rhs) { inner->self_bitwise_xor(*rhs.inner); return *this; }
-    Value operator<<=(const Value& rhs) { inner->self_bitwise_lshift(*rhs.inner); return *this; }
-    Value operator>>=(const Value& rhs) { inner->self_bitwise_rshift(*rhs.inner); return *this; }
-    Value operator++(int x) { Value prev = *this; inner->self_add(Value::Int(1).inner); return prev; }
-    Value operator--(int x) { Value prev = *this; inner->self_sub(Value::Int(1).inner); return prev; }
-    Value operator++() { inner->self_add(Value::Int(1).inner); return *this; }
-    Value operator--() { inner->self_sub(Value::Int(1).inner); return *this; }
-
-    Value() : inner(nullptr) {}
-
-    Value(Value& from) {
-        inner = from.inner;
-        inner->ref_count++;
-    }
-
-    Value(Value&& from) {
-        inner = from.inner;
-        from.inner = nullptr;
+    Value& operator*=(const Value& rhs) { self_mul(rhs); return *this; }
+    Value& operator/=(const Value& rhs) { self_div(rhs); return *this; }
+    Value& operator%=(const Value& rhs) { self_mod(rhs); return *this; }
+    Value& operator&=(const Value& rhs) { self_bitwise_and(rhs); return *this; }
+    Value& operator|=(const Value& rhs) { self_bitwise_or(rhs); return *this; }
+    Value& operator^=(const Value& rhs) { self_bitwise_xor(rhs); return *this; }
+    Value& operator<<=(const Value& rhs) { self_bitwise_lshift(rhs); return *this; }
+    Value& operator>>=(const Value& rhs) { self_bitwise_rshift(rhs); return *this; }
+    Value operator++(int x) { Value prev = *this; *this += Value::Int(1); return prev; }
+    Value operator--(int x) { Value prev = *this; *this -= Value::Int(1); return prev; }
+    Value& operator++() { return *this += Value::Int(1); }
+    Value& operator--() { return *this -= Value::Int(1); }
+
+    Value() : tag(ValueType::Undefined), raw(0) {}
+
+    Value(const Value& from) : tag(from.tag), raw(from.raw) {
+        if (is_heap()) {
+            ref();
+        }
+    }
+
+    Value(Value&& from) : tag(from.tag), raw(from.raw) {
+        from.tag = ValueType::Undefined;
+        from.raw = 0;
     }
 
     ~Value() {
@@ -400,100 +865,725 @@ public:
     }
 
 private:
-    Value(ValueInner *value) {
-        inner = value;
+    explicit Value(ValueType tag) : tag(tag), raw(0) {}
+    explicit Value(ValueInner *inner);
+
+    Value get_uncached(const Value& prop, PropertyCache& cache) const;
+    Value add_in_place(const Value& rhs);
+    // Appends `rhs` to this string which no one else refers to. Returns false
+    // if it exceeds the heap budget.
+    bool append_in_place(const Value& rhs);
+
+    bool both_int(const Value& rhs) const {
+        return tag == ValueType::Int && rhs.tag == ValueType::Int;
+    }
+
+    Operands operands(const Value& rhs) const {
+        return vm_operand_types[static_cast<int>(tag)][static_cast<int>(rhs.tag)];
+    }
+
+    // Same as toDouble() but the caller has checked that this is a number.
+    double number() const {
+        return (tag == ValueType::Int) ? v_i : v_d;
     }
 
-    void deref() {
-        if (inner) {
-            inner->ref_count--;
-            if (inner->ref_count == 0) {
-                delete inner;
+    // The length of the value converted into a string.
+    size_t string_length() const;
+    // Appends the value converted into a string to `buf`.
+    void append_string_to(HeapString& buf) const;
+
+    ValueInner& heap() const {
+        VM_ASSERT(is_heap());
+        return *inner;
+    }
+
+    inline void ref() const;
+    inline void deref();
+
+    ValueType tag;
+    union {
+        int v_i;
+        bool v_b;
+        double v_d;
+        ValueInner *inner;
+        // Used to copy the whole union.
+        uint64_t raw;
+    };
+};
+
+// A hidden class of objects. A shape maps property names to slot indices and
+// forms a transition tree from the empty shape: objects which have the same
+// properties added in the same order share the shape. Shapes are never freed.
+class Shape {
+public:
+    Shape *parent;
+    // The property added by the transition from the parent.
+    HeapString name;
+    uint32_t hash;
+    int num_props;
+
+    // Returns the empty shape, the root of the transition tree.
+    static Shape *root();
+
+    static void *operator new(size_t size) {
+        return vm_alloc(size);
+    }
+
+    // Only called if the constructor throws: shapes are never freed.
+    static void operator delete(void *ptr, size_t size) {
+        vm_free(ptr, size);
+    }
+
+    // Returns the slot index of `prop` or -1 if it does not exist. `hash` is
+    // the hash of `prop`.
+    int find(const HeapString& prop, uint32_t hash) const {
+        for (const Shape *shape = this; shape->parent; shape = shape->parent) {
+            if (shape->hash == hash && shape->name == prop) {
+                return shape->num_props - 1;
             }
-            inner = nullptr;
         }
+
+        return -1;
     }
 
-    ValueInner *inner;
+    // Returns the shape with `prop` added.
+    Shape *add(const HeapString& prop, uint32_t hash);
+
+private:
+    std::vector<Shape *, PoolAllocator<Shape *>> transitions;
+
+    Shape(Shape *parent, const HeapString& name, uint32_t hash)
+        : parent(parent), name(name), hash(hash),
+          num_props(parent ? parent->num_props + 1 : 0) {}
 };
 
-class Var {
+// The number of slots allocated for the first property of an object.
+#define VM_OBJECT_MIN_SLOTS 4
+
+// Properties of an object: an array of values allocated from the VM pool
+// once the first property is added, which doubles when it fills up. It is
+// not stored in ValueInner itself: the union is as large as its largest
+// member, so inline slots would make every string and function as large as
+// an object.
+class Properties {
 public:
-    Value value;
+    Shape *shape;
+
+    Properties() : shape(Shape::root()), slots(nullptr), capacity(0) {}
+    ~Properties();
+
+    Value& slot(int index) {
+        return slots[index];
+    }
+
+    Value get(const HeapString& prop, uint32_t hash);
+    void set(const HeapString& prop, uint32_t hash, const Value& value);
+
+private:
+    Value *slots;
+    int capacity;
+
+    void grow();
+};
+
+// Elements of an array: values stored contiguously without holes.
+class Elements {
+public:
+    int length;
+    int capacity;
+    Value *slots;
+
+    Elements() : length(0), capacity(0), slots(nullptr) {}
+    ~Elements();
+
+    // Makes room for at least `n` elements.
+    void reserve(int n);
+    // Grows (filling with undefined) or shrinks the array to `n` elements.
+    void resize(int n);
+
+    void push(const Value& value) {
+        if (length == capacity) {
+            reserve((capacity == 0) ? 4 : capacity * 2);
+        }
+
+        new (&slots[length++]) Value(value);
+    }
+
+    Value pop() {
+        if (length == 0) {
+            return Value::Undefined();
+        }
+
+        Value value(std::move(slots[--length]));
+        slots[length].~Value();
+        return value;
+    }
+};
+
+// Elements of a typed array.
+class PackedArray {
+public:
+    PackedArrayKind kind;
+    int length;
+    uint8_t *data;
+    // The typed array which owns `data` if this is a view created by
+    // subarray(). The view holds a reference to it.
+    ValueInner *owner;
+
+    int element_size() const {
+        switch (kind) {
+        case PackedArrayKind::Int16: return sizeof(int16_t);
+        case PackedArrayKind::Int32: return sizeof(int32_t);
+        default:                     return sizeof(uint8_t);
+        }
+    }
 
-    Var() : value(Value::Undefined()) {}
-    Var(Value value) : value(value) {}
+    int get(int index) const {
+        switch (kind) {
+        case PackedArrayKind::Int16: return reinterpret_cast<int16_t *>(data)[index];
+        case PackedArrayKind::Int32: return reinterpret_cast<int32_t *>(data)[index];
+        default:                     return data[index];
+        }
+    }
 
-    Var(const Var& other) : value(Value::Undefined()) {
-        value = other.value;
+    // Stores `value` truncated to the element type.
+    void set(int index, int value) {
+        switch (kind) {
+        case PackedArrayKind::Int16: reinterpret_cast<int16_t *>(data)[index] = value; break;
+        case PackedArrayKind::Int32: reinterpret_cast<int32_t *>(data)[index] = value; break;
+        default:                     data[index] = value;
+        }
     }
 };
 
-class Scope {
+// A heap-allocated value: strings, functions, objects, errors, arrays, and
+// typed arrays.
+class ValueInner : public HeapObject {
+public:
+    ValueType type;
+    // Immortal values (string literals in the constant pool) are never
+    // freed: the reference counting skips them.
+    bool immortal = false;
+    // True if this is a string not yet concatenated (rope_*). It is flattened
+    // into v_s when the contents is needed.
+    bool rope = false;
+    // True if this is a function created by Value::Builtin.
+    bool builtin = false;
+    // The hash of the string or 0 if it is not computed yet.
+    uint32_t hash = 0;
+    union {
+        struct {
+            NativeFunction v_f;
+            // The scope captured by the function (null for native ones). The
+            // function holds a reference to it.
+            Scope *v_closure;
+        };
+        HeapString v_s;
+        struct {
+            ValueInner *rope_left;
+            ValueInner *rope_right;
+            size_t rope_length;
+            int rope_depth;
+        };
+        // Allocated separately for the same reason as Properties.
+        ErrorInfo *v_e;
+        Properties v_obj;
+        Elements v_array;
+        PackedArray v_packed;
+    };
+
+    ValueInner(ValueType type) : HeapObject(false), type(type) {
+        if (type == ValueType::Array) {
+            new (&v_array) Elements();
+        } else {
+            VM_ASSERT(type == ValueType::Object);
+            new (&v_obj) Properties();
+        }
+
+        vm_heap_stats.value_allocated(type);
+    }
+
+    ValueInner(const char *str)
+        : HeapObject(false), type(ValueType::String), v_s(str) {
+        vm_heap_stats.value_allocated(type);
+    }
+    ValueInner(const char *str, bool immortal)
+        : HeapObject(false), type(ValueType::String), immortal(immortal), v_s(str) {}
+    ValueInner(HeapString&& str)
+        : HeapObject(false), type(ValueType::String), v_s(std::move(str)) {
+        vm_heap_stats.value_allocated(type);
+    }
+    // Creates a rope of `left` followed by `right`.
+    ValueInner(ValueInner *left, ValueInner *right);
+    ValueInner(PackedArrayKind kind, int length, uint8_t *data, ValueInner *owner)
+        : HeapObject(false), type(ValueType::TypedArray) {
+        v_packed.kind = kind;
+        v_packed.length = length;
+        v_packed.data = data;
+        v_packed.owner = owner;
+        if (owner) {
+            owner->retain();
+        }
+
+        vm_heap_stats.value_allocated(type);
+    }
+    ValueInner(NativeFunction value, Scope *closure)
+        : HeapObject(false), type(ValueType::Function), v_f(value), v_closure(closure) {
+        vm_heap_stats.value_allocated(type);
+    }
+    ValueInner(SourceLoc loc, const char *msg)
+        : HeapObject(false), type(ValueType::Error),
+          v_e(new (vm_alloc(sizeof(ErrorInfo))) ErrorInfo(loc, msg)) {
+        vm_heap_stats.value_allocated(type);
+    }
+
+    static void *operator new(size_t size) {
+        return vm_alloc(size);
+    }
+
+    static void operator delete(void *ptr, size_t size) {
+        vm_free(ptr, size);
+    }
+
+    ~ValueInner();
+
+    bool is_container() const {
+        return type == ValueType::Object || type == ValueType::Function
+            || type == ValueType::Array;
+    }
+
+    // Returns the contents of the string, flattening the rope if needed.
+    const HeapString& str() {
+        if (rope) {
+            flatten();
+        }
+
+        return v_s;
+    }
+
+    // Same as str() but for modifying the string in place. Only a string
+    // which no one else refers to can be modified (see Value::is_unique).
+    HeapString& mutable_str() {
+        if (rope) {
+            flatten();
+        }
+
+        hash = 0;
+        return v_s;
+    }
+
+    uint32_t str_hash() {
+        if (hash == 0) {
+            const HeapString& s = str();
+            hash = vm_hash_string(s.data(), s.length());
+        }
+
+        return hash;
+    }
+
+    size_t str_length() const {
+        return rope ? rope_length : v_s.length();
+    }
+
+    int str_depth() const {
+        return rope ? rope_depth : 0;
+    }
+
+    // Appends the contents of the string without flattening the rope.
+    void append_to(HeapString& buf) const;
+
 private:
-    std::unordered_map<std::string, Var> vars;
+    void flatten();
+};
+
+// Every heap value is as large as the largest member of the union: keep it
+// within a small size class (see vm_alloc.cpp).
+static_assert(sizeof(ValueInner) <= 64, "ValueInner is too large");
+
+inline Value::Value(ValueInner *inner) : tag(inner->type), inner(inner) {}
+
+inline Value Value::get(const Value& prop, PropertyCache& cache) const {
+    if (tag == ValueType::Object && inner->v_obj.shape == cache.shape) {
+        cache.hit();
+        return inner->v_obj.slot(cache.index);
+    }
+
+    return get_uncached(prop, cache);
+}
+
+inline Value Value::get_element(const Value& prop) const {
+    if (tag == ValueType::Array && prop.tag == ValueType::Int
+        && static_cast<unsigned>(prop.v_i) < static_cast<unsigned>(inner->v_array.length)) {
+        return inner->v_array.slots[prop.v_i];
+    }
+
+    return get(prop);
+}
+
+inline Value Value::set_element(const Value& prop, const Value& value) const {
+    if (tag == ValueType::Array && prop.tag == ValueType::Int
+        && static_cast<unsigned>(prop.v_i) < static_cast<unsigned>(inner->v_array.length)) {
+        inner->v_array.slots[prop.v_i] = value;
+        return value;
+    }
+
+    return set(prop, value);
+}
+
+inline Elements& Value::elements() const {
+    VM_ASSERT(tag == ValueType::Array);
+    return inner->v_array;
+}
+
+inline PackedArray& Value::packed() const {
+    VM_ASSERT(tag == ValueType::TypedArray);
+    return inner->v_packed;
+}
+
+// The fast path of VM_TA_GET: an in-bounds int index. Others (e.g. a double
+// index) are handled by get().
+template<typename T>
+inline Value Value::packed_get(const Value& index) const {
+    const PackedArray& array = packed();
+    if (index.tag == ValueType::Int
+        && static_cast<unsigned>(index.v_i) < static_cast<unsigned>(array.length)) {
+        return Value::Int(reinterpret_cast<T *>(array.data)[index.v_i]);
+    }
+
+    return get(index);
+}
+
+template<typename T>
+inline Value Value::packed_set(const Value& index, const Value& value) const {
+    const PackedArray& array = packed();
+    if (index.tag == ValueType::Int && value.tag == ValueType::Int
+        && static_cast<unsigned>(index.v_i) < static_cast<unsigned>(array.length)) {
+        reinterpret_cast<T *>(array.data)[index.v_i] = value.v_i;
+        return value;
+    }
+
+    return set(index, value);
+}
+
+inline ValueInner *Value::builtin_inner() const {
+    return (tag == ValueType::Function && inner->builtin) ? inner : nullptr;
+}
+
+inline bool Value::is_unique() const {
+    return is_heap() && !inner->immortal && inner->ref_count == 1;
+}
+
+inline ValueInner *Value::gc_container() const {
+    if ((tag == ValueType::Object || tag == ValueType::Function || tag == ValueType::Array)
+        && !inner->immortal) {
+        return inner;
+    }
+
+    return nullptr;
+}
 
+inline Value Value::Const(ValueInner& inner) {
+    VM_ASSERT(inner.immortal);
+    return Value(&inner);
+}
+
+#ifdef VM_REFCOUNT_STATS
+extern unsigned long vm_refcount_ops;
+#define VM_COUNT_REFCOUNT_OP() vm_refcount_ops++
+#else
+#define VM_COUNT_REFCOUNT_OP()
+#endif
+
+inline void Value::ref() const {
+    if (!inner->immortal) {
+        VM_COUNT_REFCOUNT_OP();
+        inner->retain();
+    }
+}
+
+inline void Value::deref() {
+    if (is_heap() && !inner->immortal) {
+        VM_COUNT_REFCOUNT_OP();
+        inner->ref_count--;
+        if (inner->ref_count == 0) {
+            delete inner;
+        } else if (inner->is_container() && inner->color != GCColor::Purple) {
+            vm_gc_add_candidate(inner);
+        }
+    }
+
+    tag = ValueType::Undefined;
+    raw = 0;
+}
+
+// A function scope. The transpiler resolves variables into slot indices so
+// the scope is a flat array of values. A scope holds a reference to its outer
+// scope: the closure record of the function.
+//
+// Scopes are also used as closure records, which hold the values of variables
+// captured by a function value, and as boxes, which hold a mutated variable
+// shared by a function and its closures in the only slot.
+class Scope : public HeapObject {
 public:
     /* TODO: Make these fields private. */
-    int ref_count;
     Scope *prev;
+    int num_slots;
+    Value *slots;
+    int num_boxes;
+    Scope **boxes;
+
+    Scope(Scope *prev, int num_slots, Value *slots, int num_boxes = 0, Scope **boxes = nullptr)
+        : HeapObject(true), prev(prev), num_slots(num_slots), slots(slots),
+          num_boxes(num_boxes), boxes(boxes) {
+        if (prev) {
+            prev->retain();
+        }
+
+        vm_heap_stats.scope_allocated();
+    }
+
+    ~Scope() {
+        for (int i = 0; i < num_boxes; i++) {
+            if (boxes[i]) {
+                boxes[i]->release();
+            }
+        }
+
+        if (prev) {
+            prev->release();
+        }
+
+        vm_heap_stats.scope_freed();
+    }
+
+    // Allocates a scope and its slots and boxes in the heap. Boxes are null.
+    static Scope *create(Scope *prev, int num_slots, int num_boxes = 0);
+    // Decrements the reference count and frees the scope allocated by
+    // create() if it is no longer referenced. Otherwise the scope becomes a
+    // cycle candidate if `may_be_cycle`.
+    void release(bool may_be_cycle = true);
+    // Drops the references from a scope on the C stack to its closure record
+    // and boxes (see StackClosure).
+    void release_stack_refs();
+    // Frees the scope allocated by create() regardless of the reference count.
+    void destroy();
+
+    // Copies arguments into the parameter slots. Missing arguments are left
+    // undefined.
+    void bind_args(int nparams, int nargs, Value *args) {
+        for (int i = 0; i < nparams && i < nargs; i++) {
+            slots[i] = args[i];
+        }
+    }
+
+    // Returns the `index`-th variable in the `depth`-th outer scope.
+    Value& lookup(int depth, int index) {
+        Scope *scope = this;
+        while (depth-- > 0) {
+            scope = scope->prev;
+        }
 
-    Scope(Scope *prev) : ref_count(1), prev(prev) {}
-    Value get(const char *id);
-    Value set(const char *id, Value value);
+        return scope->slots[index];
+    }
+
+    // Returns the `index`-th box in the `depth`-th outer scope.
+    Scope *lookup_box(int depth, int index) {
+        Scope *scope = this;
+        while (depth-- > 0) {
+            scope = scope->prev;
+        }
+
+        return scope->boxes[index];
+    }
+
+    // Stores a reference to `box` as the `index`-th box.
+    void share_box(int index, Scope *box) {
+        box->retain();
+        boxes[index] = box;
+    }
+};
+
+// Global variables registered at runtime (e.g. `__onReady`). Unlike variables
+// in scopes, they are looked up by name.
+class Globals {
+private:
+    StringMap<Value> vars;
+
+public:
+    Value& get(const char *id);
+    Value set(const char *id, const Value& value);
 };
 
 class Context {
 public:
+    Globals *globals;
+    // The scope of the current function. It is null in the top level.
     Scope *current;
-    std::vector<Frame> frames;
-
-    Context(Scope *globals) : current(globals) {}
+    // The closure record of the function being called. VM_STACK_FUNC_ENTER
+    // takes it.
+    Scope *callee_closure;
+    // The shadow call stack. It is allocated at once not to reallocate in
+    // deep recursion.
+    CallSiteId *frames;
+    int num_frames;
+    int max_frames;
+    // Errors whose stacktrace is not captured yet (see ErrorInfo).
+    ErrorInfo *pending_errors;
+    // The lowest address of the C stack calls may use (see
+    // VM_MAX_STACK_SIZE). The stack grows downwards.
+    uintptr_t stack_limit;
+
+    // The last frame is reserved for native functions called by
+    // VM_NATIVE_CALL: they never call back into the VM. The context must be
+    // created by the task which runs the app, near the top of its stack.
+    Context(Globals *globals, int max_frames = VM_MAX_CALL_DEPTH)
+        : globals(globals), current(nullptr), callee_closure(nullptr),
+          frames(static_cast<CallSiteId *>(vm_alloc(sizeof(CallSiteId) * (max_frames + 1)))),
+          num_frames(0), max_frames(max_frames), pending_errors(nullptr),
+          stack_limit(stack_pointer() - VM_MAX_STACK_SIZE) {}
 
     Scope *current_scope() {
         return current;
     }
 
-    void enter_scope(SourceLoc callee);
-    void leave_scope();
-    Scope *create_closure_scope();
-    Value call(SourceLoc called_from, Value func, int nargs, Value *args);
+    // Returns true if `size` more bytes of the C stack can be used.
+    bool has_stack_room(size_t size) const {
+        return stack_pointer() > stack_limit + size;
+    }
+
+    // Captures stacktraces of pending errors which include the `depth`-th
+    // frame before it is popped.
+    void capture_pending_errors(int depth);
+    // Calls `func`. Returns an error if the call stack is full.
+    inline Value call(CallSiteId called_from, const Value& func, int nargs, Value *args);
+    Value call_method(CallSiteId called_from, const Value& obj, const Value& prop,
+                      int nargs, Value *args);
+
+private:
+    Value call_function(CallSiteId called_from, const Value& func, int nargs, Value *args);
+
+    static uintptr_t stack_pointer() {
+        return reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    }
+};
+
+// The fast path for builtins: they need neither a scope nor the closure so
+// the call only records the frame.
+inline Value Context::call(CallSiteId called_from, const Value& func, int nargs, Value *args) {
+    ValueInner *inner = func.builtin_inner();
+    if (!inner || num_frames == max_frames) {
+        return call_function(called_from, func, nargs, args);
+    }
+
+    frames[num_frames++] = called_from;
+    Value ret = inner->v_f(this, nargs, args);
+    if (pending_errors) {
+        capture_pending_errors(num_frames);
+    }
+
+    num_frames--;
+    return ret;
+}
+
+// Records the frame of a native function called by VM_NATIVE_CALL while it
+// is alive.
+class NativeFrame {
+private:
+    Context *ctx;
+
+public:
+    NativeFrame(Context *ctx, CallSiteId called_from) : ctx(ctx) {
+        VM_ASSERT(ctx->num_frames <= ctx->max_frames);
+        ctx->frames[ctx->num_frames++] = called_from;
+    }
+
+    ~NativeFrame() {
+        if (ctx->pending_errors) {
+            ctx->capture_pending_errors(ctx->num_frames);
+        }
+
+        ctx->num_frames--;
+    }
 };
 
-// Saves the caller scope, enter the closure scope, and restore the caller
-// one when this object is destructed, i.e., returned from the closure.
-class Closure {
+// Saves the caller scope, enters a new scope of the function whose parent is
+// the closure record, and restore the caller one when this object is
+// destructed, i.e., returned from the closure. The scope is allocated on the
+// C stack since inner functions never capture it; boxes are allocated in the
+// heap and released with the scope.
+class StackClosure {
 private:
     Context *ctx;
     Scope *caller;
+    Scope scope;
 
 public:
-    Closure(Context *ctx, Scope *closure) : ctx(ctx), caller(ctx->current) {
-        ctx->current = closure;
+    StackClosure(Context *ctx, Scope *closure, int num_slots, Value *slots,
+                 int num_boxes = 0, Scope **boxes = nullptr)
+        : ctx(ctx), caller(ctx->current), scope(closure, num_slots, slots, num_boxes, boxes) {
+        for (int i = 0; i < num_boxes; i++) {
+            boxes[i] = Scope::create(nullptr, 1);
+        }
+
+        ctx->current = &scope;
     }
 
-    ~Closure() {
+    ~StackClosure() {
+        VM_ASSERT(scope.ref_count == 1 && "a stack scope is captured");
+        scope.release_stack_refs();
         ctx->current = caller;
     }
 };
 
 class VM {
 public:
-    Scope globals;
-
-    VM() : globals(nullptr) {}
+    Globals globals;
 
     Context *create_context() {
         return new Context(&globals);
     }
 };
 
+Value vm_array_get_element(const Value& array, const Value& prop);
+Value vm_array_set_element(const Value& array, const Value& prop, const Value& value);
+Value vm_array_call_method(const Value& array, const Value& prop, int nargs, Value *args);
+
+Value vm_typed_array_get_element(const Value& array, const Value& prop);
+Value vm_typed_array_set_element(const Value& array, const Value& prop, const Value& value);
+// Typed array methods called by VM_TA_CALL.
+Value vm_typed_array_fill(const Value& array, int nargs, Value *args);
+Value vm_typed_array_subarray(const Value& array, int nargs, Value *args);
+Value vm_typed_array_set(const Value& array, int nargs, Value *args);
+
+// Converts an argument of a native function. Numeric strings are accepted as
+// integers as JavaScript does.
+int vm_to_int_arg(const Value& arg);
+
+// Converts an argument into a string for a native function (VM_STRING_ARG).
+// A non-string value is converted into a new string which lives as long as
+// this object, i.e., until the native function returns.
+class StringArg {
+public:
+    StringArg(const Value& arg)
+        : str((arg.type() == ValueType::String) ? arg : Value::String(arg.toString())) {}
+
+    operator StringView() const {
+        return str.toStringView();
+    }
+
+private:
+    Value str;
+};
+
 void vm_print_error(ErrorInfo &info);
-void vm_print_stacktrace(std::vector<Frame>& frames);
+#ifdef VM_IC_STATS
+void vm_print_inline_cache_stats();
+#endif
+void vm_print_stacktrace(const CallSiteId *frames, int num_frames);
 void vm_check_nargs_or_panic(Context *ctx, int nargs, int nth);
 bool vm_get_bool_arg_or_panic(Context *ctx, int nargs, Value *args, int nth);
 int vm_get_int_arg_or_panic(Context *ctx, int nargs, Value *args, int nth);
-std::string vm_get_string_arg_or_panic(Context *ctx, int nargs, Value *args, int nth);
+StringView vm_get_string_arg_or_panic(Context *ctx, int nargs, Value *args, int nth);
 Value vm_get_arg_or_panic(Context *ctx, int nargs, Value *args, int nth);
 
 #endif
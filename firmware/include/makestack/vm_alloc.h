@@ -0,0 +1,137 @@
+#ifndef __VM_ALLOC_H__
+#define __VM_ALLOC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The VM allocates small objects (ValueInner, Scope, hash map nodes, and short
+// string buffers) from slabs carved into fixed size classes instead of the
+// general heap to avoid fragmenting it over a long uptime. Freed objects go
+// back to the free list of its size class; slabs are never returned to the
+// system.
+#define VM_ALLOC_NUM_CLASSES 6
+#define VM_ALLOC_SLAB_SIZE 2048
+
+// Buffers (string contents and typed array elements) of this size or larger
+// are placed in the external RAM (PSRAM) if the board has one. The internal
+// RAM is faster and what the Wi-Fi and UART drivers need: small and hot
+// objects such as ValueInner stay there.
+#ifndef VM_EXTERNAL_MIN_SIZE
+#define VM_EXTERNAL_MIN_SIZE 1024
+#endif
+
+// The bytes owned by the VM in the internal RAM (slabs, objects larger than
+// the largest size class, and buffers) and the budget. The VM is not allowed
+// to use the whole heap: the supervisor needs the rest, e.g. to receive an
+// OTA update which fixes a leaking app.
+//
+// The allocator itself never fails on the budget. Instead, allocation sites
+// which grow with the app's data (strings, arrays, and typed arrays) check it
+// with vm_heap_has_room() and return an "out of memory" error
+// (VM_CHECK_HEAP).
+class HeapBudget {
+public:
+    size_t used;
+    // The high-water mark of `used`.
+    size_t peak;
+    // The budget in bytes or 0 if unlimited.
+    size_t limit;
+
+    void allocated(size_t size) {
+        used += size;
+        if (used > peak) {
+            peak = used;
+        }
+    }
+
+    void freed(size_t size) {
+        used -= size;
+    }
+
+    // Returns true if the VM can allocate `size` more bytes.
+    bool has_room(size_t size) const {
+        return limit == 0 || (used <= limit && size <= limit - used);
+    }
+};
+
+extern HeapBudget vm_heap_budget;
+
+// Allocates `size` bytes. Objects larger than the largest size class are
+// allocated by malloc(). Panics on out of memory.
+void *vm_alloc(size_t size);
+// Frees an object allocated by vm_alloc(). `size` must be the same value as
+// passed to vm_alloc().
+void vm_free(void *ptr, size_t size);
+// Returns the total size of slabs in bytes.
+size_t vm_alloc_pool_size();
+
+// Allocates a buffer: in the external RAM if it is VM_EXTERNAL_MIN_SIZE bytes
+// or larger and the external RAM has room, or by vm_alloc() otherwise.
+void *vm_alloc_buffer(size_t size);
+// Frees a buffer allocated by vm_alloc_buffer().
+void vm_free_buffer(void *ptr, size_t size);
+// Returns the total size of buffers in the external RAM in bytes.
+size_t vm_alloc_external_size();
+// Returns true if the VM can allocate a buffer of `size` bytes: in the
+// external RAM or within the budget.
+bool vm_heap_has_room(size_t size);
+
+// An STL allocator backed by vm_alloc().
+template<typename T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    PoolAllocator() {}
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U>& other) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(vm_alloc(n * sizeof(T)));
+    }
+
+    void deallocate(T *ptr, size_t n) {
+        vm_free(ptr, n * sizeof(T));
+    }
+};
+
+template<typename T, typename U>
+static inline bool operator==(const PoolAllocator<T>& a, const PoolAllocator<U>& b) {
+    return true;
+}
+
+template<typename T, typename U>
+static inline bool operator!=(const PoolAllocator<T>& a, const PoolAllocator<U>& b) {
+    return false;
+}
+
+// An STL allocator backed by vm_alloc_buffer().
+template<typename T>
+class BufferAllocator {
+public:
+    typedef T value_type;
+
+    BufferAllocator() {}
+    template<typename U>
+    BufferAllocator(const BufferAllocator<U>& other) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(vm_alloc_buffer(n * sizeof(T)));
+    }
+
+    void deallocate(T *ptr, size_t n) {
+        vm_free_buffer(ptr, n * sizeof(T));
+    }
+};
+
+template<typename T, typename U>
+static inline bool operator==(const BufferAllocator<T>& a, const BufferAllocator<U>& b) {
+    return true;
+}
+
+template<typename T, typename U>
+static inline bool operator!=(const BufferAllocator<T>& a, const BufferAllocator<U>& b) {
+    return false;
+}
+
+#endif
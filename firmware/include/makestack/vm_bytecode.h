@@ -0,0 +1,156 @@
+#ifndef __VM_BYTECODE_H__
+#define __VM_BYTECODE_H__
+
+#include <makestack/vm.h>
+
+// The bytecode backend: the app compiled by src/transpiler/bytecode.ts into a
+// compact blob which the firmware interprets instead of the transpiled C++
+// (app_setup). An app update is then the blob shipped through the protocol
+// instead of a whole firmware image.
+//
+// The blob is little-endian:
+//
+//     header:  "MSBC", u8 version, u8 reserved, u16 num_consts,
+//              u16 num_sites, u16 num_caches, u16 num_funcs
+//     consts:  u8 kind (VM_BC_CONST_*), then u16 length and the bytes
+//              (string) or f64 (double)
+//     sites:   u16 function name (a string constant), u16 line
+//     funcs:   u8 nparams, u8 nregs, u8 nboxes, u8 nupvals, u8 nupboxes,
+//              u16 code length, code
+//
+// The function 0 is the top level. The interpreter is register-based: each
+// call has `nregs` registers, which are the slots of its scope (parameters
+// first, then variables not boxed, then temporaries). Variables captured by
+// inner functions follow the flat closure model of the C++ backend: an inner
+// function value has a closure record holding `nupvals` values and
+// `nupboxes` boxes (see VM_CLOSURE).
+//
+// Bump VM_BYTECODE_VERSION on any incompatible change and keep the opcode
+// table in sync with src/transpiler/bytecode.ts.
+#define VM_BYTECODE_MAGIC "MSBC"
+#define VM_BYTECODE_VERSION 1
+#define VM_BYTECODE_HEADER_SIZE 14
+
+#define VM_BC_CONST_STRING 0
+#define VM_BC_CONST_DOUBLE 1
+
+// Opcodes and their operands:
+//
+//     r: u8 register        k: u16 constant     i: i32 integer
+//     j: i16 jump offset from the next instruction
+//     s: u16 call site      c: u16 inline cache f: u16 function
+//     n: u8 count           u: u8 upvalue or box index
+//     t: u8 typed array kind (PackedArrayKind) or method (VM_BC_TA_*)
+//
+// CLOSURE is followed by `nupvals` and `nupboxes` pairs of u8 (VM_BC_FROM_*,
+// index): where the captured values and boxes come from.
+#define VM_BYTECODE_OPCODES(X)                                              \
+    X(MOVE, "rr")       /* a = b */                                          \
+    X(LOADK, "rk")      /* a = consts[k] */                                  \
+    X(LOADI, "ri")      /* a = i */                                          \
+    X(LOADU, "r")       /* a = undefined */                                  \
+    X(LOADNULL, "r")                                                         \
+    X(LOADTRUE, "r")                                                         \
+    X(LOADFALSE, "r")                                                        \
+    X(GETUP, "ru")      /* a = the captured value u */                       \
+    X(GETBOX, "ru")     /* a = the box u */                                  \
+    X(SETBOX, "ur")     /* the box u = a */                                  \
+    X(GETUPBOX, "ru")   /* a = the captured box u */                         \
+    X(SETUPBOX, "ur")                                                        \
+    X(GETG, "rk")       /* a = the global variable named k */                \
+    X(SETG, "kr")                                                            \
+    X(ADD, "rrr")       /* a = b + c */                                      \
+    X(SUB, "rrr")                                                            \
+    X(MUL, "rrr")                                                            \
+    X(DIV, "rrr")                                                            \
+    X(MOD, "rrr")                                                            \
+    X(BAND, "rrr")                                                           \
+    X(BOR, "rrr")                                                            \
+    X(BXOR, "rrr")                                                           \
+    X(SHL, "rrr")                                                            \
+    X(SHR, "rrr")                                                            \
+    X(EQ, "rrr")        /* a = b == c */                                     \
+    X(NE, "rrr")                                                             \
+    X(LT, "rrr")                                                             \
+    X(LE, "rrr")                                                             \
+    X(GT, "rrr")                                                             \
+    X(GE, "rrr")                                                             \
+    X(NOT, "rr")        /* a = !b */                                         \
+    X(NEG, "rr")                                                             \
+    X(POS, "rr")                                                             \
+    X(BNOT, "rr")                                                            \
+    X(INC, "r")         /* a++ */                                            \
+    X(DEC, "r")                                                              \
+    X(CONCAT, "rrn")    /* a = b + ... + (b + n - 1) */                      \
+    X(GET, "rrr")       /* a = b[c] */                                       \
+    X(GETK, "rrkc")     /* a = b.k */                                        \
+    X(SET, "rrr")       /* a[b] = c */                                       \
+    X(SETK, "rkr")      /* a.k = b */                                        \
+    X(ARRAY, "rrn")     /* a = [b, ..., b + n - 1] */                        \
+    X(NEWTA, "rtr")     /* a = new (typed array t)(b) */                     \
+    X(CLOSURE, "rfnn")  /* a = the function f capturing n values, n boxes */ \
+    X(CALL, "rrns")     /* a = b(b + 1, ..., b + n) */                       \
+    X(MCALL, "rrnkcs")  /* a = b.k(b + 1, ..., b + n) */                     \
+    X(TACALL, "rtrn")   /* a = the typed array method t of b(...) */         \
+    X(JMP, "j")                                                              \
+    X(JT, "rj")         /* jump if a is truthy */                            \
+    X(JF, "rj")                                                              \
+    X(RET, "r")                                                              \
+    X(RETU, "")         /* return undefined */
+
+#define VM_BYTECODE_OPCODE_ENUM(name, operands) name,
+enum class Opcode : uint8_t {
+    VM_BYTECODE_OPCODES(VM_BYTECODE_OPCODE_ENUM)
+    NUM_OPCODES
+};
+#undef VM_BYTECODE_OPCODE_ENUM
+
+// Where CLOSURE takes a captured value or box from: a register or box of the
+// current function, or one captured by the current function.
+#define VM_BC_FROM_LOCAL 0
+#define VM_BC_FROM_UPVALUE 1
+
+// Typed array methods called by TACALL.
+#define VM_BC_TA_FILL 0
+#define VM_BC_TA_SUBARRAY 1
+#define VM_BC_TA_SET 2
+#define VM_BC_NUM_TA_METHODS 3
+
+class BytecodeFunction {
+public:
+    uint8_t nparams;
+    uint8_t nregs;
+    uint8_t nboxes;
+    uint8_t nupvals;
+    uint8_t nupboxes;
+    uint16_t code_len;
+    const uint8_t *code;
+};
+
+// A loaded app. The blob must outlive the program: the code is interpreted in
+// place.
+class BytecodeProgram {
+public:
+    // Parses and verifies `blob`, so that a corrupted or malicious blob never
+    // makes the interpreter access out of bounds. Returns null and sets
+    // `error` if it is invalid.
+    static BytecodeProgram *load(const uint8_t *blob, size_t len, const char **error);
+    // Runs the top level, i.e., registers callbacks such as `__onReady`.
+    // Only one program can run at once.
+    Value run(Context *ctx);
+    // Runs the function `index` with the closure record `record`.
+    Value execute(Context *ctx, int index, Scope *record, int nargs, Value *args);
+    // Creates a value of the function `index` with the closure record.
+    Value create_function(int index, Scope *record);
+
+private:
+    std::vector<Value, PoolAllocator<Value>> consts;
+    std::vector<CallSite, PoolAllocator<CallSite>> sites;
+    std::vector<PropertyCache, PoolAllocator<PropertyCache>> caches;
+    std::vector<BytecodeFunction, PoolAllocator<BytecodeFunction>> funcs;
+    int num_caches;
+
+    bool verify(const BytecodeFunction& func, const char **error);
+};
+
+#endif
@@ -1,12 +1,20 @@
 #include <makestack/types.h>
 #include <makestack/logger.h>
+#include <esp_heap_caps.h>
 
 static char *ring_buf;
 static int read_p = 0;
 static int write_p = 0;
 
 void init_logger() {
-    ring_buf = (char *) malloc(LOGGER_BUF_SIZE);
+#ifdef CONFIG_SPIRAM_SUPPORT
+    // The log backlog is rarely read: keep it out of the internal RAM.
+    ring_buf = (char *) heap_caps_malloc(LOGGER_BUF_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#endif
+    if (!ring_buf) {
+        ring_buf = (char *) malloc(LOGGER_BUF_SIZE);
+    }
+
     if (!ring_buf) {
         printf("WARN: failed to allocate the logger buffer!\n");
     }
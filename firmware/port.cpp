@@ -1,7 +1,12 @@
 #include <makestack/types.h>
 #include <makestack/logger.h>
 #include <makestack/vm.h>
+#include <makestack/device_api.h>
+#include <makestack/app_store.h>
+#include <makestack/vm_bytecode.h>
 #include <Arduino.h>
+#include <esp_heap_caps.h>
+#include <soc/soc.h>
 
 void vm_port_panic(const char *fmt, ...) {
     va_list vargs;
@@ -10,7 +15,8 @@ void vm_port_panic(const char *fmt, ...) {
     va_end(vargs);
 
     vm_port_print("Backtrace:\n");
-    vm_print_stacktrace(vm_port_get_current_context()->frames);
+    Context *ctx = vm_port_get_current_context();
+    vm_print_stacktrace(ctx->frames, ctx->num_frames);
 
     WARN("Restarting in 10 seconds...");
     vTaskDelay(10000 / portTICK_PERIOD_MS);
@@ -31,6 +37,35 @@ void vm_port_debug(const char *fmt, ...) {
     va_end(vargs);
 }
 
+void *vm_port_alloc_external(size_t size) {
+#ifdef CONFIG_SPIRAM_SUPPORT
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#else
+    return nullptr;
+#endif
+}
+
+void vm_port_free_external(void *ptr) {
+    heap_caps_free(ptr);
+}
+
+size_t vm_port_external_free_size() {
+#ifdef CONFIG_SPIRAM_SUPPORT
+    return heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#else
+    return 0;
+#endif
+}
+
+bool vm_port_is_external(const void *ptr) {
+#ifdef CONFIG_SPIRAM_SUPPORT
+    intptr_t addr = reinterpret_cast<intptr_t>(ptr);
+    return addr >= SOC_EXTRAM_DATA_LOW && addr < SOC_EXTRAM_DATA_HIGH;
+#else
+    return false;
+#endif
+}
+
 void vm_port_unhandled_error(ErrorInfo &error) {
     vm_print_error(error);
 
@@ -39,6 +74,35 @@ void vm_port_unhandled_error(ErrorInfo &error) {
     esp_restart();
 }
 
+// The VM heap budget in bytes. If it is not set, the VM may use the free heap
+// except the reserve for the supervisor: receiving a (deflated) OTA update
+// needs a 32 KiB buffer in addition to the adapter's ones.
+#ifndef VM_HEAP_BUDGET
+#define VM_HEAP_BUDGET 0
+#endif
+
+#ifndef VM_SUPERVISOR_HEAP_RESERVE
+#define VM_SUPERVISOR_HEAP_RESERVE (48 * 1024)
+#endif
+
+static void init_heap_budget() {
+    size_t budget = VM_HEAP_BUDGET;
+    if (budget == 0) {
+        // Buffers in the external RAM do not count toward the budget.
+        size_t free_heap = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        if (free_heap < VM_SUPERVISOR_HEAP_RESERVE * 2) {
+            WARN("low memory: %u bytes free", free_heap);
+            budget = free_heap / 2;
+        } else {
+            budget = free_heap - VM_SUPERVISOR_HEAP_RESERVE;
+        }
+    }
+
+    // Objects allocated before the app starts count toward the budget too.
+    vm_heap_budget.limit = vm_heap_budget.used + budget;
+    INFO("VM heap budget: %u bytes", vm_heap_budget.limit);
+}
+
 static VM *app_vm = nullptr;
 static Context *app_ctx = nullptr;
 static Value onready_callback = Value::Undefined();
@@ -52,16 +116,12 @@ static Value api_onready(Context *ctx, int nargs, Value *args) {
     return Value::Undefined();
 }
 
-static Value api_print(Context *ctx, int nargs, Value *args) {
-    std::string str = VM_GET_STRING_ARG(0);
-    vm_port_print("%s\n", str.c_str());
+Value vm_device_print(Context *ctx, StringView message) {
+    vm_port_print("%s\n", message.c_str());
     return Value::Undefined();
 }
 
-static Value api_publish(Context *ctx, int nargs, Value *args) {
-    std::string name = VM_GET_STRING_ARG(0);
-    Value value = VM_GET_ARG(1);
-
+Value vm_device_publish(Context *ctx, StringView name, const Value& value) {
     char type;
     switch (value.type()) {
     case ValueType::Bool:
@@ -70,6 +130,9 @@ static Value api_publish(Context *ctx, int nargs, Value *args) {
     case ValueType::Int:
         type = 'i';
         break;
+    case ValueType::Double:
+        type = 'd';
+        break;
     case ValueType::String:
         type = 's';
     break;
@@ -77,32 +140,49 @@ static Value api_publish(Context *ctx, int nargs, Value *args) {
         type = 'u';
     }
 
-    vm_port_print("@%s %c:%s\n", name.c_str(), type, value.toString().c_str());
+    // Format numbers on the stack: no heap allocation. Doubles are formatted
+    // so that the server parses exactly the same value.
+    if (type == 'i') {
+        char str[VM_INT_STR_MAX + 1];
+        str[vm_format_int(str, value.toInt())] = '\0';
+        vm_port_print("@%s %c:%s\n", name.c_str(), type, str);
+        return Value::Undefined();
+    } else if (type == 'd') {
+        char str[VM_DOUBLE_STR_MAX];
+        vm_format_double(str, value.toDouble());
+        vm_port_print("@%s %c:%s\n", name.c_str(), type, str);
+        return Value::Undefined();
+    }
+
+    StringArg str(value);
+    vm_port_print("@%s %c:%s\n", name.c_str(), type, StringView(str).c_str());
     return Value::Undefined();
 }
 
-static Value api_delay(Context *ctx, int nargs, Value *args) {
-    int ms = VM_GET_INT_ARG(0);
+// The app is idle while it sleeps: collect garbage cycles in the meantime.
+static void collect_cycles_while_idle() {
+    vm_collect_cycles(VM_GC_MAX_WORK_PER_SLICE);
+}
+
+Value vm_device_delay(Context *ctx, int ms) {
+    collect_cycles_while_idle();
     vTaskDelay(ms / portTICK_PERIOD_MS);
     return Value::Undefined();
 }
 
-static Value api_delay_seconds(Context *ctx, int nargs, Value *args) {
-    int secs = VM_GET_INT_ARG(0);
+Value vm_device_delay_seconds(Context *ctx, int secs) {
+    collect_cycles_while_idle();
     vTaskDelay((secs * 1000) / portTICK_PERIOD_MS);
     return Value::Undefined();
 }
 
-static Value api_delay_minutes(Context *ctx, int nargs, Value *args) {
-    int mins = VM_GET_INT_ARG(0);
+Value vm_device_delay_minutes(Context *ctx, int mins) {
+    collect_cycles_while_idle();
     vTaskDelay((mins * 1000 * 60) / portTICK_PERIOD_MS);
     return Value::Undefined();
 }
 
-static Value api_pin_mode(Context *ctx, int nargs, Value *args) {
-    int pin = VM_GET_INT_ARG(0);
-    std::string mode_name = VM_GET_STRING_ARG(1);
-
+Value vm_device_pin_mode(Context *ctx, int pin, StringView mode_name) {
     int mode;
     if (mode_name == "OUTPUT") {
         mode = VM_PORT_GPIO_OUTPUT;
@@ -117,29 +197,64 @@ static Value api_pin_mode(Context *ctx, int nargs, Value *args) {
     return Value::Undefined();
 }
 
-static Value api_digital_write(Context *ctx, int nargs, Value *args) {
-    int pin = VM_GET_INT_ARG(0);
-    bool level = VM_GET_BOOL_ARG(1);
+Value vm_device_digital_write(Context *ctx, int pin, bool level) {
     VM_DEBUG("digitalWrite: %d %d", pin, level);
     digitalWrite(pin, level ? VM_PORT_HIGH : VM_PORT_LOW);
     return Value::Undefined();
 }
 
-static Value api_digital_read(Context *ctx, int nargs, Value *args) {
-    int pin = VM_GET_INT_ARG(0);
+Value vm_device_digital_read(Context *ctx, int pin) {
     bool value = digitalRead(pin) == VM_PORT_HIGH;
     VM_DEBUG("digitalRead: %d %d", pin, value);
     return Value::Bool(value);
 }
 
-static Value api_analog_read(Context *ctx, int nargs, Value *args) {
-    int pin = VM_GET_INT_ARG(0);
-
+Value vm_device_analog_read(Context *ctx, int pin) {
     VM_DEBUG("analogRead: %d %d", pin);
     int value = analogRead(pin);
     return Value::Int(value);
 }
 
+// The builtins in the device object: they convert arguments and call the
+// functions above.
+static Value api_print(Context *ctx, int nargs, Value *args) {
+    return vm_device_print(ctx, VM_GET_STRING_ARG(0));
+}
+
+static Value api_publish(Context *ctx, int nargs, Value *args) {
+    return vm_device_publish(ctx, VM_GET_STRING_ARG(0), VM_GET_ARG(1));
+}
+
+static Value api_delay(Context *ctx, int nargs, Value *args) {
+    return vm_device_delay(ctx, VM_GET_INT_ARG(0));
+}
+
+static Value api_delay_seconds(Context *ctx, int nargs, Value *args) {
+    return vm_device_delay_seconds(ctx, VM_GET_INT_ARG(0));
+}
+
+static Value api_delay_minutes(Context *ctx, int nargs, Value *args) {
+    return vm_device_delay_minutes(ctx, VM_GET_INT_ARG(0));
+}
+
+static Value api_pin_mode(Context *ctx, int nargs, Value *args) {
+    int pin = VM_GET_INT_ARG(0);
+    return vm_device_pin_mode(ctx, pin, VM_GET_STRING_ARG(1));
+}
+
+static Value api_digital_write(Context *ctx, int nargs, Value *args) {
+    int pin = VM_GET_INT_ARG(0);
+    return vm_device_digital_write(ctx, pin, VM_GET_BOOL_ARG(1));
+}
+
+static Value api_digital_read(Context *ctx, int nargs, Value *args) {
+    return vm_device_digital_read(ctx, VM_GET_INT_ARG(0));
+}
+
+static Value api_analog_read(Context *ctx, int nargs, Value *args) {
+    return vm_device_analog_read(ctx, VM_GET_INT_ARG(0));
+}
+
 #ifdef MAKESTACK_APP
 extern void app_setup(Context *ctx);
 #else
@@ -151,29 +266,71 @@ void app_setup(Context *ctx) {
 }
 #endif
 
+VM_CONST_STR(str_print, "print");
+VM_CONST_STR(str_publish, "publish");
+VM_CONST_STR(str_delay, "delay");
+VM_CONST_STR(str_delay_seconds, "delaySeconds");
+VM_CONST_STR(str_delay_minutes, "delayMinutes");
+VM_CONST_STR(str_pin_mode, "pinMode");
+VM_CONST_STR(str_digital_write, "digitalWrite");
+VM_CONST_STR(str_digital_read, "digitalRead");
+VM_CONST_STR(str_analog_read, "analogRead");
+
 void run_app() {
+    init_heap_budget();
     app_vm = new VM();
     app_ctx = app_vm->create_context();
 
-    app_vm->globals.set("__onReady", Value::Function(api_onready));
+    app_vm->globals.set("__onReady", Value::Builtin(api_onready));
 
     Value device_object = Value::Object();
-    device_object.set(Value::String("print"), Value::Function(api_print));
-    device_object.set(Value::String("publish"), Value::Function(api_publish));
-    device_object.set(Value::String("delay"), Value::Function(api_delay));
-    device_object.set(Value::String("delaySeconds"), Value::Function(api_delay_seconds));
-    device_object.set(Value::String("delayMinutes"), Value::Function(api_delay_minutes));
-    device_object.set(Value::String("pinMode"), Value::Function(api_pin_mode));
-    device_object.set(Value::String("digitalWrite"), Value::Function(api_digital_write));
-    device_object.set(Value::String("digitalRead"), Value::Function(api_digital_read));
-    device_object.set(Value::String("analogRead"), Value::Function(api_analog_read));
+    device_object.set(VM_CONST(str_print), Value::Builtin(api_print));
+    device_object.set(VM_CONST(str_publish), Value::Builtin(api_publish));
+    device_object.set(VM_CONST(str_delay), Value::Builtin(api_delay));
+    device_object.set(VM_CONST(str_delay_seconds), Value::Builtin(api_delay_seconds));
+    device_object.set(VM_CONST(str_delay_minutes), Value::Builtin(api_delay_minutes));
+    device_object.set(VM_CONST(str_pin_mode), Value::Builtin(api_pin_mode));
+    device_object.set(VM_CONST(str_digital_write), Value::Builtin(api_digital_write));
+    device_object.set(VM_CONST(str_digital_read), Value::Builtin(api_digital_read));
+    device_object.set(VM_CONST(str_analog_read), Value::Builtin(api_analog_read));
+
+    // Prefer the app bytecode received through the protocol, if any. The
+    // program and the blob live as long as the app.
+    BytecodeProgram *program = nullptr;
+    size_t blob_len;
+    uint8_t *blob = app_store_load(&blob_len);
+    if (blob) {
+        const char *error;
+        if (!(program = BytecodeProgram::load(blob, blob_len, &error))) {
+            // Run the embedded app from now on instead of failing on every
+            // boot.
+            WARN("invalid app bytecode: %s", error);
+            app_store_reject(app_store_version());
+            app_store_clear();
+            free(blob);
+        }
+    }
 
     INFO("Initializing the app...");
-    app_setup(app_ctx);
+    if (program) {
+        program->run(app_ctx);
+    } else {
+        app_setup(app_ctx);
+    }
 
     INFO("Entering the onready callback...");
     if (onready_callback) {
         Value args[] = {device_object};
-        app_ctx->call(VM_CURRENT_LOC, onready_callback, 1, args);
+        app_ctx->call(VM_CURRENT_CALL_SITE, onready_callback, 1, args);
     }
+
+    // Free garbage cycles left by the app.
+    while (vm_collect_cycles(VM_GC_MAX_WORK_PER_SLICE)) {}
+
+#ifdef VM_IC_STATS
+    vm_print_inline_cache_stats();
+#endif
+#ifdef VM_REFCOUNT_STATS
+    vm_port_print("refcount operations: %lu\n", vm_refcount_ops);
+#endif
 }
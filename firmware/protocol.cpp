@@ -3,6 +3,9 @@
 #include <makestack/cred.h>
 #include <makestack/logger.h>
 #include <makestack/protocol.h>
+#include <makestack/app_store.h>
+#include <makestack/vm.h>
+#include <makestack/vm_bytecode.h>
 
 #define MINIZ_NO_STDIO
 #define MINIZ_NO_ARCHIVE_APIS
@@ -17,11 +20,15 @@
 enum class State {
     NORMAL,
     UPDATING,
+    DOWNLOADING_APP,
 };
 
 static State current_state = State::NORMAL;
 static uint32_t downloaded_size;
 static uint64_t next_version = 0;
+static uint32_t next_app_version = 0;
+static uint32_t app_size;
+static uint8_t *app_buf = NULL;
 static esp_ota_handle_t update_handle;
 static esp_partition_t *update_part;
 static int read_retries = 0;
@@ -93,7 +100,12 @@ static struct payload_header *verify_magic(uint8_t *payload, size_t payload_len)
     return header;
 }
 
+static void abort_update();
+
 static void update_firmware() {
+    // Cancel downloading the app, if any: the new firmware embeds its own.
+    abort_update();
+
     INFO("[MakeStack] Initiating software update...");
     current_state = State::UPDATING;
     downloaded_size = 0;
@@ -133,6 +145,8 @@ void process_version_info(uint8_t *data, size_t len) {
 static void abort_update() {
     current_state = State::NORMAL;
     downloaded_size = 0;
+    free(app_buf);
+    app_buf = NULL;
 }
 
 static void receive_ota_data(uint8_t *data, size_t len) {
@@ -168,6 +182,9 @@ static void process_firmware_data(uint8_t *data, size_t len) {
             return;
         }
 
+        // Run the app embedded in the new firmware instead of the old bytecode.
+        app_store_clear();
+
         INFO("restarting the system...");
         esp_restart();
 
@@ -213,6 +230,81 @@ static void process_firmware_data(uint8_t *data, size_t len) {
     }
 }
 
+static void process_app_info(uint8_t *data, size_t len) {
+    if (len < sizeof(struct app_info)) {
+        DEBUG("[MakeStack] too short data len");
+        return;
+    }
+
+    struct app_info *info = (struct app_info *) data;
+    if (current_state != State::NORMAL || info->version == app_store_version()
+        || app_store_is_rejected(info->version)) {
+        return;
+    }
+
+    if (info->size < VM_BYTECODE_HEADER_SIZE || info->size > MAKESTACK_BYTECODE_MAX_SIZE) {
+        WARN("invalid app size: %u bytes", info->size);
+        return;
+    }
+
+    app_buf = (uint8_t *) malloc(info->size);
+    if (!app_buf) {
+        WARN("failed to allocate the app buffer");
+        return;
+    }
+
+    INFO("[MakeStack] Downloading the app (%u bytes)...", info->size);
+    current_state = State::DOWNLOADING_APP;
+    next_app_version = info->version;
+    app_size = info->size;
+    downloaded_size = 0;
+}
+
+static void process_app_data(uint8_t *data, size_t len) {
+    if (len < sizeof(struct app_data_header)) {
+        DEBUG("[MakeStack] too short data len");
+        return;
+    }
+
+    if (current_state != State::DOWNLOADING_APP) {
+        return;
+    }
+
+    struct app_data_header *header = (struct app_data_header *) data;
+    uint8_t *buf = data + sizeof(struct app_data_header);
+    size_t buf_len = len - sizeof(struct app_data_header);
+    if (header->offset != downloaded_size || buf_len > app_size - downloaded_size) {
+        DEBUG("ignoring unexpected app data (offset=%u)", header->offset);
+        return;
+    }
+
+    memcpy(app_buf + downloaded_size, buf, buf_len);
+    downloaded_size += buf_len;
+    if (downloaded_size < app_size) {
+        return;
+    }
+
+    // The interpreter verifies the whole bytecode when it loads it.
+    if (memcmp(app_buf, VM_BYTECODE_MAGIC, 4) || app_buf[4] != VM_BYTECODE_VERSION) {
+        WARN("unsupported app bytecode");
+        // Don't retry downloading the same app.
+        app_store_reject(next_app_version);
+        abort_update();
+        return;
+    }
+
+    if (!app_store_save(next_app_version, app_buf, app_size)) {
+        abort_update();
+        return;
+    }
+
+    INFO("restarting the system...");
+    esp_restart();
+
+    WARN("failed to restart :(");
+    abort_update();
+}
+
 static void process_corrupt_rate_check(uint8_t *data, size_t data_len) {
     int num_corrupted = 0;
     uint8_t patterns[] = { 0x00, 0x5a, 0x0a, 0xff, 0xff, 0xa5, 0xee, 0xc0 };
@@ -247,6 +339,12 @@ static void process_field(uint8_t type, uint8_t *data, size_t data_len) {
     case 0x04: // ping
         process_ping(data, data_len);
         break;
+    case 0x08: // app info
+        process_app_info(data, data_len);
+        break;
+    case 0x09: // app data
+        process_app_data(data, data_len);
+        break;
     default:
         DEBUG("[MakeStack] Ignoring unknown type: %02x", type);
     }
@@ -306,6 +404,20 @@ size_t build_device_status_field(uint8_t *&p, size_t& remaining) {
     data.state = 0; // TODO:
     data.battery_level = 0; // TODO:
     data.ram_free = esp_get_free_heap_size();
+    data.vm_pool_size = vm_alloc_pool_size();
+
+    const ValueType types[] = {
+        ValueType::String, ValueType::Function, ValueType::Object, ValueType::Error
+    };
+    for (int i = 0; i < VM_STATUS_SCOPE; i++) {
+        data.vm_live[i] = vm_heap_stats.live[static_cast<int>(types[i])];
+        data.vm_peak[i] = vm_heap_stats.peak[static_cast<int>(types[i])];
+    }
+    data.vm_live[VM_STATUS_SCOPE] = vm_heap_stats.scopes_live;
+    data.vm_peak[VM_STATUS_SCOPE] = vm_heap_stats.scopes_peak;
+    data.vm_heap_used = vm_heap_budget.used;
+    data.vm_heap_peak = vm_heap_budget.peak;
+    data.vm_heap_budget = vm_heap_budget.limit;
 
     size_t copied_len;
     if (!(copied_len = build_field(p, remaining, 0x07, (void *) &data, sizeof(data)))) {
@@ -371,6 +483,22 @@ size_t build_payload(uint8_t *buf, size_t buf_len) {
         remaining -= copied_len;
     }
 
+    // app_request
+    if (current_state == State::DOWNLOADING_APP) {
+        struct app_request data;
+        data.version = next_app_version;
+        data.offset = downloaded_size;
+
+        size_t copied_len;
+        if (!(copied_len = build_field(p, remaining, 0xab, &data, sizeof(data)))) {
+            WARN("too short payload buf");
+            return 0;
+        }
+
+        p += copied_len;
+        remaining -= copied_len;
+    }
+
     // pong
     if (reply_pong) {
         size_t copied_len;
@@ -393,9 +521,9 @@ size_t build_payload(uint8_t *buf, size_t buf_len) {
 
 void adapter_read_error() {
     // FIXME: handle this in a smart way.
-    if (current_state == State::UPDATING) {
+    if (current_state != State::NORMAL) {
         if (read_retries > 5) {
-            WARN("too many retries, aborting the firmware update");
+            WARN("too many retries, aborting the update");
             abort_update();
         } else {
             TRACE("failed read a packet, retyring....");
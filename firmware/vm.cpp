@@ -1,17 +1,48 @@
 #include <makestack/vm.h>
+#include <math.h>
+#include <stdlib.h>
 
-void vm_print_stacktrace(std::vector<Frame>& frames) {
-    for (int i = frames.size() - 1; i >= 0; i--) {
-        const SourceLoc& callee = frames[i].callee;
-        vm_port_print("    %d: %s (%s:%d)\n",
-            i, callee.func, callee.file, callee.lineno);
+HeapStats vm_heap_stats;
+#ifdef VM_REFCOUNT_STATS
+unsigned long vm_refcount_ops = 0;
+#endif
+
+// Call sites indexed by their ids. The id 0 means unregistered.
+static std::vector<const CallSite *> call_sites(1, nullptr);
+
+CallSiteId CallSite::register_id() {
+    if (call_sites.size() > UINT16_MAX) {
+        VM_PANIC("too many call sites");
+    }
+
+    site_id = call_sites.size();
+    call_sites.push_back(this);
+    return site_id;
+}
+
+const CallSite& vm_get_call_site(CallSiteId id) {
+    return *call_sites[id];
+}
+
+static void print_frame(int i, const char *func, const char *file, int lineno) {
+    vm_port_print("    %d: %s (%s:%d)\n", i, func, file, lineno);
+}
+
+void vm_print_stacktrace(const CallSiteId *frames, int num_frames) {
+    for (int i = num_frames - 1; i >= 0; i--) {
+        const CallSite& callee = vm_get_call_site(frames[i]);
+        print_frame(i, callee.func, callee.file, callee.lineno);
     }
 }
 
 void vm_print_error(ErrorInfo &info) {
-    vm_port_print("Unhandled error: %s\n", info.message.c_str());
+    vm_port_print("Unhandled error: %s\n", info.message);
     vm_port_print("Backtrace:\n");
-    vm_print_stacktrace(info.frames);
+    std::vector<CallSiteId>& frames = info.stacktrace();
+    if (info.has_stacktrace()) {
+        print_frame(frames.size(), info.loc.func, info.loc.file, info.loc.lineno);
+        vm_print_stacktrace(frames.data(), frames.size());
+    }
 }
 
 static void check_nargs_or_panic(int nargs, int nth) {
@@ -27,12 +58,39 @@ bool vm_get_bool_arg_or_panic(Context *ctx, int nargs, Value *args, int nth) {
 
 int vm_get_int_arg_or_panic(Context *ctx, int nargs, Value *args, int nth) {
     check_nargs_or_panic(nargs, nth);
-    return args[nth].toInt();
+    return vm_to_int_arg(args[nth]);
 }
 
-std::string vm_get_string_arg_or_panic(Context *ctx, int nargs, Value *args, int nth) {
+int vm_to_int_arg(const Value& arg) {
+    if (arg.type() == ValueType::String) {
+        // Accept numeric strings like "13" as JavaScript does.
+        StringView s = arg.toStringView();
+        int value;
+        if (!vm_parse_int(s.c_str(), s.length(), &value)) {
+            VM_PANIC("expected an integer: \"%s\"", s.c_str());
+        }
+
+        return value;
+    }
+
+    if (arg.type() == ValueType::Double) {
+        return arg.toInt32();
+    }
+
+    return arg.toInt();
+}
+
+// Returns a view of the argument. Non-string arguments are converted into a
+// string in place so that the view stays valid until the native function
+// returns.
+StringView vm_get_string_arg_or_panic(Context *ctx, int nargs, Value *args, int nth) {
     check_nargs_or_panic(nargs, nth);
-    return args[nth].toString();
+    Value& arg = args[nth];
+    if (arg.type() != ValueType::String) {
+        arg = Value::String(arg.toString());
+    }
+
+    return arg.toStringView();
 }
 
 Value vm_get_arg_or_panic(Context *ctx, int nargs, Value *args, int nth) {
@@ -40,314 +98,1098 @@ Value vm_get_arg_or_panic(Context *ctx, int nargs, Value *args, int nth) {
     return args[nth];
 }
 
-ErrorInfo::ErrorInfo(SourceLoc loc, std::string message) : message(message) {
-    Context *ctx = vm_port_get_current_context();
+ErrorInfo::ErrorInfo(SourceLoc loc, const char *message)
+    : loc(loc), ctx(vm_port_get_current_context()), depth(-1),
+      prev_pending(nullptr), next_pending(nullptr) {
+    size_t len = strlen(message);
+    char *buf = (len < sizeof(inline_message))
+        ? inline_message : static_cast<char *>(vm_alloc(len + 1));
+    memcpy(buf, message, len + 1);
+    this->message = buf;
+
     if (!ctx) {
         // FIXME: Called in the initialization phase.
         return;
     }
 
-    frames = ctx->frames;
-    frames.push_back(loc);
+    depth = ctx->num_frames;
+    next_pending = ctx->pending_errors;
+    if (next_pending) {
+        next_pending->prev_pending = this;
+    }
+
+    ctx->pending_errors = this;
 }
 
 ErrorInfo::~ErrorInfo() {
     if (!checked) {
         vm_port_unhandled_error(*this);
     }
+
+    if (ctx) {
+        remove_pending();
+    }
+
+    if (message != inline_message) {
+        vm_free(const_cast<char *>(message), strlen(message) + 1);
+    }
 }
 
-ValueInner *ValueInner::add(const ValueInner& rhs) {
-    if (type == ValueType::String || rhs.type == ValueType::String) {
-        std::string new_s = toString() + rhs.toString();
-        return new ValueInner(new_s.c_str());
-    } else if (type == ValueType::Int && rhs.type == ValueType::Int) {
-        int new_i = toInt() + rhs.toInt();
-        type = ValueType::Int;
-        return new ValueInner(new_i);
+void ErrorInfo::check() {
+    checked = true;
+    // The stacktrace is no longer needed.
+    if (ctx) {
+        remove_pending();
+    }
+}
+
+// Copies the frames when the error is thrown. They are still on the context's
+// stack: Context::call captures the trace before popping any of them.
+void ErrorInfo::capture() {
+    frames.assign(ctx->frames, ctx->frames + depth);
+    remove_pending();
+}
+
+void ErrorInfo::remove_pending() {
+    if (prev_pending) {
+        prev_pending->next_pending = next_pending;
     } else {
-        /* Insane type combinations. */
-        VM_PANIC("Invalid types for `+'.");
+        ctx->pending_errors = next_pending;
+    }
+
+    if (next_pending) {
+        next_pending->prev_pending = prev_pending;
+    }
+
+    ctx = nullptr;
+}
+
+// Reference counting of strings and typed arrays referred from other strings
+// and typed arrays. They never form cycles.
+static void retain_inner(ValueInner *inner) {
+    if (!inner->immortal) {
+        inner->retain();
     }
 }
 
-ValueInner *ValueInner::sub(const ValueInner& rhs) {
-    if (type == ValueType::Int && rhs.type == ValueType::Int) {
-        int new_i = toInt() - rhs.toInt();
-        return new ValueInner(new_i);
+static void release_inner(ValueInner *inner) {
+    if (!inner->immortal && --inner->ref_count == 0) {
+        delete inner;
+    }
+}
+
+// "00", "01", ..., "99": formatting two digits at once halves the number of
+// divisions.
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+int vm_format_int(char *buf, int value) {
+    // Fill digits from the end of a temporary buffer.
+    char tmp[VM_INT_STR_MAX];
+    char *p = tmp + sizeof(tmp);
+    uint32_t n = (value < 0) ? 0u - static_cast<uint32_t>(value) : value;
+    while (n >= 100) {
+        const char *pair = &digit_pairs[(n % 100) * 2];
+        n /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+
+    if (n >= 10) {
+        *--p = digit_pairs[n * 2 + 1];
+        *--p = digit_pairs[n * 2];
     } else {
-        /* Insane type combinations. */
-        VM_PANIC("Invalid types for `-'.");
+        *--p = '0' + n;
     }
+
+    if (value < 0) {
+        *--p = '-';
+    }
+
+    int len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+    return len;
 }
 
-ValueInner *ValueInner::mul(const ValueInner& rhs) {
-    if (type == ValueType::Int && rhs.type == ValueType::Int) {
-        int new_i = toInt() * rhs.toInt();
-        return new ValueInner(new_i);
+int vm_format_double(char *buf, double value) {
+    if (isnan(value)) {
+        return sprintf(buf, "NaN");
+    }
+
+    char *p = buf;
+    if (signbit(value) && value != 0) {
+        *p++ = '-';
+        value = -value;
+    }
+
+    if (isinf(value)) {
+        return (p - buf) + sprintf(p, "Infinity");
+    }
+
+    if (value == 0) {
+        return sprintf(buf, "0");
+    }
+
+    // Find the fewest significant digits which read back as the same value.
+    char sci[VM_DOUBLE_STR_MAX];
+    for (int precision = 0; precision < 17; precision++) {
+        snprintf(sci, sizeof(sci), "%.*e", precision, value);
+        if (strtod(sci, nullptr) == value) {
+            break;
+        }
+    }
+
+    // Split "d.ddde+XX" into the digits and the exponent.
+    char digits[18];
+    int k = 0;
+    char *q = sci;
+    for (; *q != 'e'; q++) {
+        if (*q != '.') {
+            digits[k++] = *q;
+        }
+    }
+
+    while (k > 1 && digits[k - 1] == '0') {
+        k--;
+    }
+
+    // The value is 0.digits * 10^n.
+    int n = atoi(q + 1) + 1;
+    if (k <= n && n <= 21) {
+        // 123400
+        memcpy(p, digits, k);
+        p += k;
+        for (int i = k; i < n; i++) {
+            *p++ = '0';
+        }
+    } else if (0 < n && n <= 21) {
+        // 12.34
+        memcpy(p, digits, n);
+        p += n;
+        *p++ = '.';
+        memcpy(p, digits + n, k - n);
+        p += k - n;
+    } else if (-6 < n && n <= 0) {
+        // 0.001234
+        *p++ = '0';
+        *p++ = '.';
+        for (int i = n; i < 0; i++) {
+            *p++ = '0';
+        }
+        memcpy(p, digits, k);
+        p += k;
     } else {
-        /* Insane type combinations. */
-        VM_PANIC("Invalid types for `*'.");
+        // 1.234e+21
+        *p++ = digits[0];
+        if (k > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, k - 1);
+            p += k - 1;
+        }
+        p += sprintf(p, "e%c%d", (n - 1 < 0) ? '-' : '+', abs(n - 1));
+    }
+
+    *p = '\0';
+    return p - buf;
+}
+
+bool vm_parse_int(const char *s, size_t length, int *value) {
+    size_t i = 0;
+    bool negative = false;
+    if (i < length && (s[i] == '-' || s[i] == '+')) {
+        negative = (s[i] == '-');
+        i++;
+    }
+
+    if (i == length) {
+        return false;
     }
+
+    uint32_t limit = negative ? 2147483648u : 2147483647u;
+    uint32_t n = 0;
+    for (; i < length; i++) {
+        uint32_t digit = static_cast<uint8_t>(s[i]) - '0';
+        if (digit > 9 || n > (limit - digit) / 10) {
+            return false;
+        }
+
+        n = n * 10 + digit;
+    }
+
+    *value = negative ? static_cast<int>(0u - n) : static_cast<int>(n);
+    return true;
 }
 
-ValueInner *ValueInner::div(const ValueInner& rhs) {
-    if (type == ValueType::Int && rhs.type == ValueType::Int) {
-        int new_i = toInt() / rhs.toInt();
-        return new ValueInner(new_i);
+uint32_t vm_hash_string(const char *s, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= static_cast<uint8_t>(s[i]);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+ValueInner::ValueInner(ValueInner *left, ValueInner *right)
+    : HeapObject(false), type(ValueType::String), rope(true) {
+    retain_inner(left);
+    retain_inner(right);
+    rope_left = left;
+    rope_right = right;
+    rope_length = left->str_length() + right->str_length();
+    int depth = left->str_depth();
+    if (right->str_depth() > depth) {
+        depth = right->str_depth();
+    }
+
+    rope_depth = depth + 1;
+    vm_heap_stats.value_allocated(type);
+}
+
+void ValueInner::append_to(HeapString& buf) const {
+    if (rope) {
+        rope_left->append_to(buf);
+        rope_right->append_to(buf);
     } else {
-        /* Insane type combinations. */
-        VM_PANIC("Invalid types for `/'.");
+        buf += v_s;
     }
 }
 
-ValueInner *ValueInner::mod(const ValueInner& rhs) {
-    return new ValueInner(toInt() % rhs.toInt());
+void ValueInner::flatten() {
+    HeapString flat;
+    flat.reserve(rope_length);
+    append_to(flat);
+    release_inner(rope_left);
+    release_inner(rope_right);
+    rope = false;
+    new (&v_s) HeapString(std::move(flat));
 }
 
-ValueInner *ValueInner::bitwise_and(const ValueInner& rhs) {
-    return new ValueInner(toInt() & rhs.toInt());
+ValueInner::~ValueInner() {
+    if (!immortal) {
+        vm_heap_stats.value_freed(type);
+    }
+
+    switch (type) {
+    case ValueType::Function:
+        if (v_closure) {
+            v_closure->release();
+        }
+        break;
+    case ValueType::String:
+        if (rope) {
+            release_inner(rope_left);
+            release_inner(rope_right);
+        } else {
+            v_s.~basic_string();
+        }
+        break;
+    case ValueType::Object:
+        v_obj.~Properties();
+        break;
+    case ValueType::Array:
+        v_array.~Elements();
+        break;
+    case ValueType::Error:
+        v_e->~ErrorInfo();
+        vm_free(v_e, sizeof(ErrorInfo));
+        break;
+    case ValueType::TypedArray:
+        if (v_packed.owner) {
+            release_inner(v_packed.owner);
+        } else if (v_packed.data) {
+            vm_free_buffer(v_packed.data, v_packed.length * v_packed.element_size());
+        }
+        break;
+    default:
+        VM_PANIC("tried to destruct invalid value");
+    }
 }
 
-ValueInner *ValueInner::bitwise_or(const ValueInner& rhs) {
-    return new ValueInner(toInt() | rhs.toInt());
+Value Value::String(const char *s) {
+    return Value(new ValueInner(s));
 }
 
-ValueInner *ValueInner::bitwise_xor(const ValueInner& rhs) {
-    return new ValueInner(toInt() ^ rhs.toInt());
+Value Value::String(HeapString&& s) {
+    return Value(new ValueInner(std::move(s)));
 }
 
-ValueInner *ValueInner::bitwise_lshift(const ValueInner& rhs) {
-    return new ValueInner(toInt() << rhs.toInt());
+Value Value::String(const std::string& s) {
+    return Value(new ValueInner(HeapString(s.data(), s.length())));
 }
 
-ValueInner *ValueInner::bitwise_rshift(const ValueInner& rhs) {
-    return new ValueInner(toInt() >> rhs.toInt());
+Value Value::Number(double d) {
+    // -0 is not an int32.
+    if (d >= INT32_MIN && d <= INT32_MAX && d == static_cast<int>(d)
+        && !(d == 0 && signbit(d))) {
+        return Value::Int(static_cast<int>(d));
+    }
+
+    return Value::Double(d);
 }
 
-ValueInner *ValueInner::bitwise_not() {
-    return new ValueInner(~toInt());
+Value Value::Function(NativeFunction f, Scope *closure) {
+    return Value(new ValueInner(f, closure));
 }
 
-ValueInner *ValueInner::unary_plus() {
-    return new ValueInner(toInt());
+Value Value::Builtin(NativeFunction f) {
+    ValueInner *inner = new ValueInner(f, nullptr);
+    inner->builtin = true;
+    return Value(inner);
 }
 
-ValueInner *ValueInner::unary_minus() {
-    return new ValueInner(-toInt());
+Value Value::Object() {
+    VM_CHECK_HEAP(sizeof(ValueInner));
+    return Value(new ValueInner(ValueType::Object));
 }
 
+Value Value::Error(SourceLoc loc, const char *fmt, ...) {
+    va_list vargs;
+    va_start(vargs, fmt);
+    char buf[256];
+    vsnprintf((char *) &buf, sizeof(buf), fmt, vargs);
+    Value value(new ValueInner(loc, buf));
+    va_end(vargs);
+    return value;
+}
 
-bool ValueInner::eq(const ValueInner& rhs) {
-    if (type == rhs.type) {
-        switch (type) {
-        case ValueType::Int:
-            return v_i == rhs.v_i;
-        case ValueType::String:
-            return v_s == rhs.v_s;
-        case ValueType::Bool:
-            return v_b == rhs.v_b;
-        case ValueType::Null:
-        case ValueType::Undefined:
-            return true;
-        default:
-            VM_PANIC("Invalid types for `=='.");
-        }
-    } else {
-        VM_PANIC("Invalid types for `=='.");
+std::string Value::toString() const {
+    switch (tag) {
+    case ValueType::Bool:
+        return v_b ? "true" : "false";
+    case ValueType::Int: {
+        char buf[VM_INT_STR_MAX];
+        return std::string(buf, vm_format_int(buf, v_i));
+    }
+    case ValueType::Double: {
+        char buf[VM_DOUBLE_STR_MAX];
+        return std::string(buf, vm_format_double(buf, v_d));
+    }
+    case ValueType::String: {
+        const HeapString& s = inner->str();
+        return std::string(s.data(), s.length());
+    }
+    default:
+        VM_PANIC("TODO: NYI");
     }
 }
 
-bool ValueInner::gt(const ValueInner& rhs) {
-    if (type == ValueType::Int && rhs.type == ValueType::Int) {
-        return v_i > rhs.v_i;
-    } else {
-        VM_PANIC("Invalid types for `>'.");
+StringView Value::toStringView() const {
+    VM_ASSERT(tag == ValueType::String);
+    const HeapString& s = inner->str();
+    return StringView(s.c_str(), s.length());
+}
+
+bool Value::toBool() const {
+    switch (tag) {
+    case ValueType::Int:
+        return v_i != 0;
+    case ValueType::Double:
+        return v_d != 0 && !isnan(v_d);
+    case ValueType::Bool:
+        return v_b;
+    case ValueType::String:
+        return inner->str_length() > 0;
+    case ValueType::Function:
+    case ValueType::Object:
+    case ValueType::Array:
+    case ValueType::TypedArray:
+        return true;
+    case ValueType::Null:
+    case ValueType::Error:
+    case ValueType::Undefined:
+        return false;
+    default:
+        VM_UNREACHABLE();
     }
 }
 
-bool ValueInner::lt(const ValueInner& rhs) {
-    if (type == ValueType::Int && rhs.type == ValueType::Int) {
-        return v_i < rhs.v_i;
+size_t Value::string_length() const {
+    switch (tag) {
+    case ValueType::String:
+        return inner->str_length();
+    case ValueType::Int: {
+        int i = v_i;
+        size_t len = (i < 0) ? 2 : 1;
+        while (i /= 10) {
+            len++;
+        }
+        return len;
+    }
+    default:
+        return toString().length();
+    }
+}
+
+void Value::append_string_to(HeapString& buf) const {
+    if (tag == ValueType::String) {
+        inner->append_to(buf);
+    } else if (tag == ValueType::Int) {
+        char tmp[VM_INT_STR_MAX];
+        buf.append(tmp, vm_format_int(tmp, v_i));
+    } else if (tag == ValueType::Double) {
+        char tmp[VM_DOUBLE_STR_MAX];
+        buf.append(tmp, vm_format_double(tmp, v_d));
     } else {
-        VM_PANIC("Invalid types for `<'.");
+        std::string str = toString();
+        buf.append(str.data(), str.length());
     }
 }
 
+Value Value::concat(int nparts, const Value *parts) {
+    // Numbers are added until a string appears: 1 + 2 + "a" is "3a".
+    Value acc = parts[0];
+    int i = 1;
+    while (i < nparts && acc.tag != ValueType::String
+           && parts[i].tag != ValueType::String) {
+        acc = acc.add(parts[i]);
+        i++;
+    }
 
-void ValueInner::self_add(const ValueInner& rhs) {
-    if (type == ValueType::String) {
-        v_s += rhs.toString();
-    } else if (type == ValueType::Int) {
-        v_i += rhs.toInt();
-    } else {
-        VM_PANIC("Invalid types for `+='.");
+    if (i == nparts) {
+        return acc;
+    }
+
+    size_t length = acc.string_length();
+    for (int j = i; j < nparts; j++) {
+        length += parts[j].string_length();
     }
+
+    VM_CHECK_HEAP(length);
+
+    HeapString buf;
+    buf.reserve(length);
+    acc.append_string_to(buf);
+    for (int j = i; j < nparts; j++) {
+        parts[j].append_string_to(buf);
+    }
+
+    return Value::String(std::move(buf));
 }
 
-void ValueInner::self_sub(const ValueInner& rhs) {
-    if (type != ValueType::Int) {
-        VM_PANIC("Invalid types for `-='.");
+#define NO Operands::Invalid
+#define II Operands::IntInt
+#define NN Operands::Numbers
+#define SS Operands::Strings
+#define EQ Operands::Same
+const Operands vm_operand_types[VM_NUM_VALUE_TYPES][VM_NUM_VALUE_TYPES] = {
+    //             Inv Und Nul Err Boo Int Str Fun Obj Dbl TyA Arr
+    /* Invalid */ { NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO, NO },
+    /* Undef */   { NO, EQ, NO, NO, NO, NO, SS, NO, NO, NO, NO, NO },
+    /* Null */    { NO, NO, EQ, NO, NO, NO, SS, NO, NO, NO, NO, NO },
+    /* Error */   { NO, NO, NO, NO, NO, NO, SS, NO, NO, NO, NO, NO },
+    /* Bool */    { NO, NO, NO, NO, EQ, NO, SS, NO, NO, NO, NO, NO },
+    /* Int */     { NO, NO, NO, NO, NO, II, SS, NO, NO, NN, NO, NO },
+    /* String */  { NO, SS, SS, SS, SS, SS, SS, SS, SS, SS, SS, SS },
+    /* Func */    { NO, NO, NO, NO, NO, NO, SS, NO, NO, NO, NO, NO },
+    /* Object */  { NO, NO, NO, NO, NO, NO, SS, NO, NO, NO, NO, NO },
+    /* Double */  { NO, NO, NO, NO, NO, NN, SS, NO, NO, NN, NO, NO },
+    /* TypedArr */{ NO, NO, NO, NO, NO, NO, SS, NO, NO, NO, NO, NO },
+    /* Array */   { NO, NO, NO, NO, NO, NO, SS, NO, NO, NO, NO, NO },
+};
+#undef NO
+#undef II
+#undef NN
+#undef SS
+#undef EQ
+
+// The int/int cases here are reached only on overflow or when called
+// directly (e.g. from concat()): the operators in vm.h handle the rest.
+Value Value::add(const Value& rhs) const {
+    int result;
+    switch (operands(rhs)) {
+    case Operands::IntInt:
+        if (!__builtin_add_overflow(v_i, rhs.v_i, &result)) {
+            return Value::Int(result);
+        }
+        /* fallthrough */
+    case Operands::Numbers:
+        return Value::Number(number() + rhs.number());
+    case Operands::Strings:
+        // A rope is flattened into a buffer of the same length later.
+        VM_CHECK_HEAP(string_length() + rhs.string_length());
+        if (tag == ValueType::String && rhs.tag == ValueType::String
+            && inner->str_length() + rhs.inner->str_length() >= VM_ROPE_MIN_LENGTH) {
+            // Defer copying long strings until someone reads the contents.
+            if (inner->str_depth() >= VM_ROPE_MAX_DEPTH) {
+                inner->str();
+            }
+
+            if (rhs.inner->str_depth() >= VM_ROPE_MAX_DEPTH) {
+                rhs.inner->str();
+            }
+
+            return Value(new ValueInner(inner, rhs.inner));
+        } else {
+            HeapString buf;
+            buf.reserve(string_length() + rhs.string_length());
+            append_string_to(buf);
+            rhs.append_string_to(buf);
+            return Value::String(std::move(buf));
+        }
+    default:
+        /* Insane type combinations. */
+        VM_PANIC("Invalid types for `+'.");
+    }
+}
+
+// Appends `rhs` to the string buffer if this is a temporary string which no
+// one else refers to. Used for `+` chains like `a + b + c`.
+Value Value::add_in_place(const Value& rhs) {
+    if (tag == ValueType::String && is_unique()) {
+        if (!append_in_place(rhs)) {
+            return VM_CREATE_ERROR("out of memory");
+        }
+
+        return std::move(*this);
     }
 
-    v_i -= rhs.toInt();
+    return add(rhs);
 }
 
-void ValueInner::self_mul(const ValueInner& rhs) {
-    if (type != ValueType::Int) {
-        VM_PANIC("Invalid types for `*='.");
+bool Value::append_in_place(const Value& rhs) {
+    HeapString& buf = inner->mutable_str();
+    size_t capacity = buf.capacity();
+    size_t length = buf.length() + rhs.string_length();
+    // The buffer grows twice as large and the old one is freed after copying.
+    if (length > capacity
+        && !vm_heap_has_room((length > capacity * 2) ? length : capacity * 2)) {
+        return false;
     }
 
-    v_i *= rhs.toInt();
+    rhs.append_string_to(buf);
+    return true;
 }
 
-void ValueInner::self_div(const ValueInner& rhs) {
-    if (type != ValueType::Int) {
-        VM_PANIC("Invalid types for `/='.");
+Value Value::sub(const Value& rhs) const {
+    int result;
+    switch (operands(rhs)) {
+    case Operands::IntInt:
+        if (!__builtin_sub_overflow(v_i, rhs.v_i, &result)) {
+            return Value::Int(result);
+        }
+        /* fallthrough */
+    case Operands::Numbers:
+        return Value::Number(number() - rhs.number());
+    default:
+        /* Insane type combinations. */
+        VM_PANIC("Invalid types for `-'.");
     }
+}
 
-    v_i /= rhs.toInt();
+Value Value::mul(const Value& rhs) const {
+    int result;
+    switch (operands(rhs)) {
+    case Operands::IntInt:
+        if (!__builtin_mul_overflow(v_i, rhs.v_i, &result)
+            && (result != 0 || (v_i >= 0 && rhs.v_i >= 0))) {
+            return Value::Int(result);
+        }
+        /* fallthrough */
+    case Operands::Numbers:
+        // Overflowed, a double, or -0 (e.g. `-1 * 0`).
+        return Value::Number(number() * rhs.number());
+    default:
+        /* Insane type combinations. */
+        VM_PANIC("Invalid types for `*'.");
+    }
+}
 
+Value Value::div(const Value& rhs) const {
+    switch (operands(rhs)) {
+    case Operands::IntInt:
+        if (rhs.v_i != 0 && rhs.v_i != -1 && v_i % rhs.v_i == 0
+            && (v_i != 0 || rhs.v_i > 0)) {
+            return Value::Int(v_i / rhs.v_i);
+        }
+        /* fallthrough */
+    case Operands::Numbers:
+        // Not divisible, division by zero, or -0.
+        return Value::Number(number() / rhs.number());
+    default:
+        /* Insane type combinations. */
+        VM_PANIC("Invalid types for `/'.");
+    }
 }
 
-void ValueInner::self_mod(const ValueInner& rhs) {
-    if (type != ValueType::Int) {
-        VM_PANIC("Expected an integer.");
+Value Value::mod(const Value& rhs) const {
+    switch (operands(rhs)) {
+    case Operands::IntInt:
+        if (rhs.v_i > 0 && v_i >= 0) {
+            return Value::Int(v_i % rhs.v_i);
+        }
+        /* fallthrough */
+    case Operands::Numbers:
+        return Value::Number(fmod(number(), rhs.number()));
+    default:
+        /* Insane type combinations. */
+        VM_PANIC("Invalid types for `%%'.");
     }
+}
 
-    v_i = rhs.toInt();
+int Value::toInt32() const {
+    switch (tag) {
+    case ValueType::Int:
+        return v_i;
+    case ValueType::Double: {
+        if (!isfinite(v_d)) {
+            return 0;
+        }
+
+        // Wrap around modulo 2^32.
+        double d = fmod(trunc(v_d), 4294967296.0);
+        if (d < 0) {
+            d += 4294967296.0;
+        }
+
+        return static_cast<int>(static_cast<uint32_t>(d));
+    }
+    default:
+        VM_PANIC("Expected a number.");
+    }
 }
 
-void ValueInner::self_bitwise_and(const ValueInner& rhs) {
-    if (type != ValueType::Int) {
-        VM_PANIC("Expected an integer.");
+Value Value::bitwise_and(const Value& rhs) const {
+    return Value::Int(toInt32() & rhs.toInt32());
+}
+
+Value Value::bitwise_or(const Value& rhs) const {
+    return Value::Int(toInt32() | rhs.toInt32());
+}
+
+Value Value::bitwise_xor(const Value& rhs) const {
+    return Value::Int(toInt32() ^ rhs.toInt32());
+}
+
+Value Value::bitwise_lshift(const Value& rhs) const {
+    uint32_t lhs = static_cast<uint32_t>(toInt32());
+    return Value::Int(static_cast<int>(lhs << (rhs.toInt32() & 31)));
+}
+
+Value Value::bitwise_rshift(const Value& rhs) const {
+    return Value::Int(toInt32() >> (rhs.toInt32() & 31));
+}
+
+Value Value::bitwise_not() const {
+    return Value::Int(~toInt32());
+}
+
+Value Value::unary_plus() const {
+    if (!is_number()) {
+        VM_PANIC("Expected a number.");
     }
 
-    v_i &= rhs.toInt();
+    return *this;
 }
 
-void ValueInner::self_bitwise_or(const ValueInner& rhs) {
-    if (type != ValueType::Int) {
-        VM_PANIC("Expected an integer.");
+Value Value::unary_minus() const {
+    if (tag == ValueType::Int && v_i != 0 && v_i != INT32_MIN) {
+        return Value::Int(-v_i);
     }
 
-    v_i |= rhs.toInt();
+    // -0 and -INT32_MIN are not int32.
+    return Value::Number(-toDouble());
 }
 
-void ValueInner::self_bitwise_xor(const ValueInner& rhs) {
-    if (type != ValueType::Int) {
-        VM_PANIC("Expected an integer.");
+
+bool Value::eq(const Value& rhs) const {
+    switch (operands(rhs)) {
+    case Operands::IntInt:
+        return v_i == rhs.v_i;
+    case Operands::Numbers:
+        return number() == rhs.number();
+    case Operands::Strings:
+        if (tag != rhs.tag) {
+            break;
+        }
+
+        if (inner == rhs.inner) {
+            return true;
+        }
+
+        // Compare the cached hashes first if both are computed.
+        if (inner->str_length() != rhs.inner->str_length()
+            || (inner->hash && rhs.inner->hash && inner->hash != rhs.inner->hash)) {
+            return false;
+        }
+
+        return inner->str() == rhs.inner->str();
+    case Operands::Same:
+        return tag != ValueType::Bool || v_b == rhs.v_b;
+    default:
+        break;
     }
 
-    v_i ^= rhs.toInt();
+    VM_PANIC("Invalid types for `=='.");
 }
 
-void ValueInner::self_bitwise_lshift(const ValueInner& rhs) {
-    if (type != ValueType::Int) {
-        VM_PANIC("Expected an integer.");
+Ordering Value::compare(const Value& rhs, const char *op) const {
+    switch (operands(rhs)) {
+    case Operands::IntInt:
+        if (v_i < rhs.v_i) {
+            return Ordering::Less;
+        }
+
+        return (v_i == rhs.v_i) ? Ordering::Equal : Ordering::Greater;
+    case Operands::Numbers: {
+        double lhs_d = number();
+        double rhs_d = rhs.number();
+        if (lhs_d < rhs_d) {
+            return Ordering::Less;
+        } else if (lhs_d > rhs_d) {
+            return Ordering::Greater;
+        }
+
+        return (lhs_d == rhs_d) ? Ordering::Equal : Ordering::Unordered;
     }
+    case Operands::Strings: {
+        if (tag != rhs.tag) {
+            break;
+        }
+
+        int result = inner->str().compare(rhs.inner->str());
+        if (result < 0) {
+            return Ordering::Less;
+        }
 
-    v_i <<= rhs.toInt();
+        return (result == 0) ? Ordering::Equal : Ordering::Greater;
+    }
+    default:
+        break;
+    }
+
+    VM_PANIC("Invalid types for `%s'.", op);
 }
 
-void ValueInner::self_bitwise_rshift(const ValueInner& rhs) {
-    if (type != ValueType::Int) {
-        VM_PANIC("Expected an integer.");
+
+// Compound assignments update the value in place only if no one else refers
+// to it: immediates always, and heap values if the reference count is 1
+// (copy-on-write). Otherwise, other variables referring to the same string
+// would see the change.
+void Value::self_add(const Value& rhs) {
+    if (tag == ValueType::String && is_unique()) {
+        // Appending to the buffer grows it amortized.
+        if (!append_in_place(rhs)) {
+            *this = VM_CREATE_ERROR("out of memory");
+        }
+    } else {
+        *this = add(rhs);
     }
+}
 
-    v_i >>= rhs.toInt();
+void Value::self_sub(const Value& rhs) {
+    *this = sub(rhs);
 }
 
+void Value::self_mul(const Value& rhs) {
+    *this = mul(rhs);
+}
 
+void Value::self_div(const Value& rhs) {
+    *this = div(rhs);
+}
+
+void Value::self_mod(const Value& rhs) {
+    *this = mod(rhs);
+}
+
+void Value::self_bitwise_and(const Value& rhs) {
+    *this = bitwise_and(rhs);
+}
+
+void Value::self_bitwise_or(const Value& rhs) {
+    *this = bitwise_or(rhs);
+}
+
+void Value::self_bitwise_xor(const Value& rhs) {
+    *this = bitwise_xor(rhs);
+}
 
-Value Value::call(Context *ctx, int nargs, Value *args) {
-    if (inner->type != ValueType::Function) {
+void Value::self_bitwise_lshift(const Value& rhs) {
+    *this = bitwise_lshift(rhs);
+}
+
+void Value::self_bitwise_rshift(const Value& rhs) {
+    *this = bitwise_rshift(rhs);
+}
+
+
+
+Value Value::call(Context *ctx, int nargs, Value *args) const {
+    if (tag != ValueType::Function) {
         return VM_CREATE_ERROR("not callable");
     }
 
+    ctx->callee_closure = inner->v_closure;
     return inner->v_f(ctx, nargs, args);
 }
 
-Value Value::get(Value prop) {
-    switch (inner->type) {
+Value Value::get(const Value& prop) const {
+    switch (tag) {
     case ValueType::Object: {
         if (prop.type() != ValueType::String) {
             return VM_CREATE_ERROR("prop must be string");
         }
 
-        std::string propString = prop.toString();
-        if (inner->v_obj.find(propString) == inner->v_obj.end()) {
-            return Value::Undefined();
-        }
-
-        ValueInner *inner_value = inner->v_obj[propString];
-        inner_value->ref_count++;
-        return Value(inner_value);
+        return inner->v_obj.get(prop.inner->str(), prop.inner->str_hash());
     }
+    case ValueType::Array:
+        return vm_array_get_element(*this, prop);
+    case ValueType::TypedArray:
+        return vm_typed_array_get_element(*this, prop);
     default:
         return Value::Undefined();
     }
 }
 
-Value Value::set(Value prop, Value value) {
-    switch (inner->type) {
+Value Value::get_uncached(const Value& prop, PropertyCache& cache) const {
+    cache.miss();
+    if (tag != ValueType::Object) {
+        return get(prop);
+    }
+
+    if (prop.type() != ValueType::String) {
+        return VM_CREATE_ERROR("prop must be string");
+    }
+
+    int index = inner->v_obj.shape->find(prop.inner->str(), prop.inner->str_hash());
+    if (index < 0) {
+        return Value::Undefined();
+    }
+
+    cache.shape = inner->v_obj.shape;
+    cache.index = index;
+    return inner->v_obj.slot(index);
+}
+
+Value Value::set(const Value& prop, const Value& value) const {
+    switch (tag) {
     case ValueType::Object: {
         if (prop.type() != ValueType::String) {
             return VM_CREATE_ERROR("prop must be string");
         }
 
-        value.inner->ref_count++;
-        inner->v_obj[prop.toString()] = value.inner;
+        inner->v_obj.set(prop.inner->str(), prop.inner->str_hash(), value);
         return value;
     }
+    case ValueType::Array:
+        return vm_array_set_element(*this, prop, value);
+    case ValueType::TypedArray:
+        return vm_typed_array_set_element(*this, prop, value);
     default:
         return Value::Undefined();
     }
 }
 
-Value Scope::get(const char *id) {
-    Scope *scope = this;
-    while (scope) {
-        if (scope->vars.find(id) != scope->vars.end()) {
-            return scope->vars[id].value;
+#ifdef VM_IC_STATS
+static PropertyCache *inline_caches = nullptr;
+
+PropertyCache::PropertyCache(const char *name)
+    : shape(nullptr), index(-1), name(name), hits(0), misses(0),
+      next(inline_caches) {
+    inline_caches = this;
+}
+
+void vm_print_inline_cache_stats() {
+    for (PropertyCache *cache = inline_caches; cache; cache = cache->next) {
+        vm_port_print("%s: hits=%u, misses=%u\n",
+            cache->name, cache->hits, cache->misses);
+    }
+}
+#else
+PropertyCache::PropertyCache(const char *name) : shape(nullptr), index(-1) {}
+#endif
+
+Shape *Shape::root() {
+    static Shape *empty = nullptr;
+    if (!empty) {
+        empty = new Shape(nullptr, "", 0);
+    }
+
+    return empty;
+}
+
+Shape *Shape::add(const HeapString& prop, uint32_t hash) {
+    for (Shape *child : transitions) {
+        if (child->hash == hash && child->name == prop) {
+            return child;
         }
+    }
 
-        scope = scope->prev;
+    Shape *child = new Shape(this, prop, hash);
+    transitions.push_back(child);
+    return child;
+}
+
+Properties::~Properties() {
+    for (int i = 0; i < shape->num_props; i++) {
+        slots[i].~Value();
     }
 
-    VM_PANIC("undefined reference: %s", id);
+    vm_free(slots, sizeof(Value) * capacity);
 }
 
-Value Scope::set(const char *id, Value value) {
-    vars[id] = Var(value);
-    return value;
+Value Properties::get(const HeapString& prop, uint32_t hash) {
+    int index = shape->find(prop, hash);
+    if (index < 0) {
+        return Value::Undefined();
+    }
+
+    return slot(index);
 }
 
-void Context::enter_scope(SourceLoc callee) {
-    Scope *new_scope = new Scope(current);
-    current = new_scope;
-    frames.push_back(callee);
+void Properties::set(const HeapString& prop, uint32_t hash, const Value& value) {
+    int index = shape->find(prop, hash);
+    if (index >= 0) {
+        slot(index) = value;
+        return;
+    }
+
+    index = shape->num_props;
+    if (index == capacity) {
+        grow();
+    }
+
+    new (&slots[index]) Value(value);
+    shape = shape->add(prop, hash);
 }
 
-void Context::leave_scope() {
-    VM_ASSERT(current != nullptr);
-    Scope *prev = current->prev;
-    current->ref_count--;
-    if (current->ref_count == 0) {
-        delete current;
+void Properties::grow() {
+    int new_capacity = (capacity == 0) ? VM_OBJECT_MIN_SLOTS : capacity * 2;
+    Value *new_slots = static_cast<Value *>(vm_alloc(sizeof(Value) * new_capacity));
+    for (int i = 0; i < shape->num_props; i++) {
+        new (&new_slots[i]) Value(std::move(slots[i]));
+        slots[i].~Value();
     }
-    current = prev;
-    frames.pop_back();
+
+    vm_free(slots, sizeof(Value) * capacity);
+    slots = new_slots;
+    capacity = new_capacity;
 }
 
-Scope *Context::create_closure_scope() {
-    current->ref_count++;
-    return current;
+static size_t scope_size(int num_slots, int num_boxes) {
+    return sizeof(Scope) + sizeof(Value) * num_slots + sizeof(Scope *) * num_boxes;
 }
 
-Value Context::call(SourceLoc called_from, Value func, int nargs, Value *args) {
-    enter_scope(called_from);
+Scope *Scope::create(Scope *prev, int num_slots, int num_boxes) {
+    void *ptr = vm_alloc(scope_size(num_slots, num_boxes));
+    Value *slots = reinterpret_cast<Value *>(static_cast<Scope *>(ptr) + 1);
+    for (int i = 0; i < num_slots; i++) {
+        new (&slots[i]) Value();
+    }
+
+    Scope **boxes = reinterpret_cast<Scope **>(slots + num_slots);
+    for (int i = 0; i < num_boxes; i++) {
+        boxes[i] = nullptr;
+    }
+
+    return new (ptr) Scope(prev, num_slots, slots, num_boxes, boxes);
+}
+
+void Scope::release(bool may_be_cycle) {
+    ref_count--;
+    if (ref_count > 0) {
+        if (may_be_cycle && color != GCColor::Purple) {
+            vm_gc_add_candidate(this);
+        } else if (color == GCColor::Gray) {
+            vm_gc_touch(this);
+        }
+
+        return;
+    }
+
+    destroy();
+}
+
+// References from a stack scope are not heap edges. Dropping the one to the
+// closure record never makes it the entry of a garbage cycle: the function
+// value still refers to it, or its release on freeing the function has made
+// it a candidate. A box which outlives the function is referenced by closure
+// records; it may be the last external reference to a cycle only if it holds
+// an object, e.g. a closure stored in the variable it captures.
+void Scope::release_stack_refs() {
+    for (int i = 0; i < num_boxes; i++) {
+        Scope *box = boxes[i];
+        if (box) {
+            boxes[i] = nullptr;
+            box->release(box->slots[0].gc_container() != nullptr);
+        }
+    }
+
+    if (prev) {
+        prev->release(false);
+        prev = nullptr;
+    }
+}
+
+void Scope::destroy() {
+    int n = num_slots;
+    int m = num_boxes;
+    for (int i = 0; i < n; i++) {
+        slots[i].~Value();
+    }
+
+    this->~Scope();
+    vm_free(this, scope_size(n, m));
+}
+
+Value& Globals::get(const char *id) {
+    auto it = vars.find(id);
+    if (it == vars.end()) {
+        VM_PANIC("undefined reference: %s", id);
+    }
+
+    return it->second;
+}
+
+Value Globals::set(const char *id, const Value& value) {
+    vars[id] = value;
+    return value;
+}
+
+// Function calls do not allocate a scope here: transpiled functions enter
+// their own scope in VM_STACK_FUNC_ENTER and native functions need none.
+Value Context::call_function(CallSiteId called_from, const Value& func, int nargs, Value *args) {
+    if (num_frames == max_frames || !has_stack_room(0)) {
+        return VM_CREATE_ERROR("maximum call stack size exceeded");
+    }
+
+    frames[num_frames++] = called_from;
     Value ret = func.call(this, nargs, args);
-    leave_scope();
+    if (pending_errors) {
+        capture_pending_errors(num_frames);
+    }
+
+    num_frames--;
     return ret;
 }
+
+void Context::capture_pending_errors(int depth) {
+    ErrorInfo *error = pending_errors;
+    while (error) {
+        ErrorInfo *next = error->next_pending;
+        if (error->depth >= depth) {
+            error->capture();
+        }
+
+        error = next;
+    }
+}
+
+Value Context::call_method(CallSiteId called_from, const Value& obj, const Value& prop,
+                           int nargs, Value *args) {
+    if (obj.type() == ValueType::Array) {
+        return vm_array_call_method(obj, prop, nargs, args);
+    }
+
+    return call(called_from, obj.get(prop), nargs, args);
+}
@@ -0,0 +1,118 @@
+#include <makestack/vm.h>
+#include <makestack/vm_alloc.h>
+#include <stdlib.h>
+
+static const size_t size_classes[VM_ALLOC_NUM_CLASSES] = {
+    16, 32, 48, 64, 96, 128
+};
+
+struct FreeObject {
+    FreeObject *next;
+};
+
+static FreeObject *free_lists[VM_ALLOC_NUM_CLASSES];
+static size_t pool_size = 0;
+static size_t external_size = 0;
+HeapBudget vm_heap_budget;
+
+static int get_size_class(size_t size) {
+    for (int i = 0; i < VM_ALLOC_NUM_CLASSES; i++) {
+        if (size <= size_classes[i]) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void refill(int size_class) {
+    size_t obj_size = size_classes[size_class];
+    uint8_t *slab = (uint8_t *) malloc(VM_ALLOC_SLAB_SIZE);
+    if (!slab) {
+        VM_PANIC("out of memory");
+    }
+
+    pool_size += VM_ALLOC_SLAB_SIZE;
+    vm_heap_budget.allocated(VM_ALLOC_SLAB_SIZE);
+    for (size_t off = 0; off + obj_size <= VM_ALLOC_SLAB_SIZE; off += obj_size) {
+        FreeObject *obj = (FreeObject *) &slab[off];
+        obj->next = free_lists[size_class];
+        free_lists[size_class] = obj;
+    }
+}
+
+void *vm_alloc(size_t size) {
+    int size_class = get_size_class(size);
+    if (size_class < 0) {
+        void *ptr = malloc(size);
+        if (!ptr) {
+            VM_PANIC("out of memory");
+        }
+
+        vm_heap_budget.allocated(size);
+        return ptr;
+    }
+
+    if (!free_lists[size_class]) {
+        refill(size_class);
+    }
+
+    FreeObject *obj = free_lists[size_class];
+    free_lists[size_class] = obj->next;
+    return obj;
+}
+
+void vm_free(void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+
+    int size_class = get_size_class(size);
+    if (size_class < 0) {
+        free(ptr);
+        vm_heap_budget.freed(size);
+        return;
+    }
+
+    FreeObject *obj = (FreeObject *) ptr;
+    obj->next = free_lists[size_class];
+    free_lists[size_class] = obj;
+}
+
+size_t vm_alloc_pool_size() {
+    return pool_size;
+}
+
+void *vm_alloc_buffer(size_t size) {
+    if (size >= VM_EXTERNAL_MIN_SIZE) {
+        void *ptr = vm_port_alloc_external(size);
+        if (ptr) {
+            external_size += size;
+            return ptr;
+        }
+    }
+
+    return vm_alloc(size);
+}
+
+void vm_free_buffer(void *ptr, size_t size) {
+    if (size >= VM_EXTERNAL_MIN_SIZE && ptr && vm_port_is_external(ptr)) {
+        vm_port_free_external(ptr);
+        external_size -= size;
+        return;
+    }
+
+    vm_free(ptr, size);
+}
+
+size_t vm_alloc_external_size() {
+    return external_size;
+}
+
+bool vm_heap_has_room(size_t size) {
+    if (size >= VM_EXTERNAL_MIN_SIZE && size <= vm_port_external_free_size()) {
+        return true;
+    }
+
+    return vm_heap_budget.has_room(size);
+}
@@ -0,0 +1,186 @@
+// Arrays: a dense vector of values. Holes are not supported: writing past the
+// end fills the gap with undefined.
+#include <makestack/vm.h>
+
+Elements::~Elements() {
+    for (int i = 0; i < length; i++) {
+        slots[i].~Value();
+    }
+
+    vm_free(slots, sizeof(Value) * capacity);
+}
+
+void Elements::reserve(int n) {
+    if (n <= capacity) {
+        return;
+    }
+
+    Value *new_slots = static_cast<Value *>(vm_alloc(sizeof(Value) * n));
+    for (int i = 0; i < length; i++) {
+        new (&new_slots[i]) Value(std::move(slots[i]));
+        slots[i].~Value();
+    }
+
+    vm_free(slots, sizeof(Value) * capacity);
+    slots = new_slots;
+    capacity = n;
+}
+
+void Elements::resize(int n) {
+    if (n > capacity) {
+        // Grow geometrically so that appending one by one stays amortized.
+        reserve((n > capacity * 2) ? n : capacity * 2);
+    }
+
+    for (int i = length; i < n; i++) {
+        new (&slots[i]) Value();
+    }
+
+    for (int i = n; i < length; i++) {
+        slots[i].~Value();
+    }
+
+    length = n;
+}
+
+// The maximum length of an array: the size of its slots in bytes must fit in
+// an int even when the capacity is doubled.
+static const int max_length = INT32_MAX / (2 * sizeof(Value));
+
+// Returns true if the array can grow to `n` elements within the heap budget.
+static bool has_room_for(const Elements& elements, int n) {
+    if (n <= elements.capacity) {
+        return true;
+    }
+
+    if (n > max_length) {
+        return false;
+    }
+
+    // The old slots are freed after moving the elements to new ones.
+    int capacity = (n > elements.capacity * 2) ? n : elements.capacity * 2;
+    return vm_heap_budget.has_room(sizeof(Value) * capacity);
+}
+
+Value Value::Array(int nelems, Value *elems) {
+    VM_CHECK_HEAP(sizeof(Value) * nelems);
+    ValueInner *inner = new ValueInner(ValueType::Array);
+    Elements& array = inner->v_array;
+    array.reserve(nelems);
+    for (int i = 0; i < nelems; i++) {
+        new (&array.slots[i]) Value(std::move(elems[i]));
+    }
+
+    array.length = nelems;
+    return Value(inner);
+}
+
+// Converts a property into an element index. Returns -1 if it is not an array
+// index.
+static int element_index(const Value& prop) {
+    switch (prop.type()) {
+    case ValueType::Int:
+        return (prop.toInt() >= 0) ? prop.toInt() : -1;
+    case ValueType::Double: {
+        double d = prop.toDouble();
+        if (!(d >= 0 && d <= INT32_MAX)) {
+            return -1;
+        }
+
+        int index = static_cast<int>(d);
+        return (index == d) ? index : -1;
+    }
+    default:
+        return -1;
+    }
+}
+
+Value vm_array_get_element(const Value& array, const Value& prop) {
+    const Elements& elements = array.elements();
+    if (prop.type() == ValueType::String) {
+        if (prop.toStringView() == "length") {
+            return Value::Int(elements.length);
+        }
+
+        return Value::Undefined();
+    }
+
+    int index = element_index(prop);
+    if (index < 0 || index >= elements.length) {
+        return Value::Undefined();
+    }
+
+    return elements.slots[index];
+}
+
+Value vm_array_set_element(const Value& array, const Value& prop, const Value& value) {
+    Elements& elements = array.elements();
+    if (prop.type() == ValueType::String) {
+        if (prop.toStringView() != "length") {
+            return VM_CREATE_ERROR("arrays have no properties other than length");
+        }
+
+        int length = element_index(value);
+        if (length < 0 || length > max_length) {
+            return VM_CREATE_ERROR("invalid array length");
+        }
+
+        if (!has_room_for(elements, length)) {
+            return VM_CREATE_ERROR("out of memory");
+        }
+
+        elements.resize(length);
+        return value;
+    }
+
+    int index = element_index(prop);
+    if (index < 0) {
+        return VM_CREATE_ERROR("invalid array index");
+    }
+
+    if (index >= elements.length) {
+        // Checked before computing the new length, which may overflow.
+        if (index >= max_length) {
+            return VM_CREATE_ERROR("invalid array index");
+        }
+
+        if (!has_room_for(elements, index + 1)) {
+            return VM_CREATE_ERROR("out of memory");
+        }
+
+        elements.resize(index + 1);
+    }
+
+    elements.slots[index] = value;
+    return value;
+}
+
+// array.push(...items): returns the new length.
+static Value array_push(Elements& elements, int nargs, Value *args) {
+    if (!has_room_for(elements, elements.length + nargs)) {
+        return VM_CREATE_ERROR("out of memory");
+    }
+
+    for (int i = 0; i < nargs; i++) {
+        elements.push(args[i]);
+    }
+
+    return Value::Int(elements.length);
+}
+
+// array.pop(): returns the last element or undefined if the array is empty.
+static Value array_pop(Elements& elements, int nargs, Value *args) {
+    return elements.pop();
+}
+
+Value vm_array_call_method(const Value& array, const Value& prop, int nargs, Value *args) {
+    Elements& elements = array.elements();
+    StringView method = prop.toStringView();
+    if (method == "push") {
+        return array_push(elements, nargs, args);
+    } else if (method == "pop") {
+        return array_pop(elements, nargs, args);
+    }
+
+    return VM_CREATE_ERROR("array has no method `%s'", method.c_str());
+}
@@ -0,0 +1,671 @@
+#include <makestack/vm_bytecode.h>
+#include <alloca.h>
+
+#define VM_BYTECODE_OPERANDS(name, operands) operands,
+static const char *const opcode_operands[] = {
+    VM_BYTECODE_OPCODES(VM_BYTECODE_OPERANDS)
+};
+#undef VM_BYTECODE_OPERANDS
+
+static BytecodeProgram *running_program = nullptr;
+
+static inline uint16_t read_u16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static inline int32_t read_i32(const uint8_t *p) {
+    return static_cast<int32_t>(p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24));
+}
+
+// Reads the blob with bounds checks. Once it runs out of the blob, `ok` is
+// false and it returns zeros.
+class BlobReader {
+public:
+    bool ok;
+
+    BlobReader(const uint8_t *p, size_t len) : ok(true), p(p), end(p + len) {}
+
+    const uint8_t *bytes(size_t len) {
+        if (!ok || static_cast<size_t>(end - p) < len) {
+            ok = false;
+            return nullptr;
+        }
+
+        const uint8_t *data = p;
+        p += len;
+        return data;
+    }
+
+    uint8_t u8() {
+        const uint8_t *data = bytes(1);
+        return data ? data[0] : 0;
+    }
+
+    uint16_t u16() {
+        const uint8_t *data = bytes(2);
+        return data ? read_u16(data) : 0;
+    }
+
+    bool at_end() const {
+        return p == end;
+    }
+
+private:
+    const uint8_t *p;
+    const uint8_t *end;
+};
+
+static int operands_size(const char *operands) {
+    int size = 0;
+    for (const char *op = operands; *op; op++) {
+        switch (*op) {
+        case 'k': case 'j': case 's': case 'c': case 'f':
+            size += 2;
+            break;
+        case 'i':
+            size += 4;
+            break;
+        default:
+            size += 1;
+        }
+    }
+
+    return size;
+}
+
+// Returns the size of the instruction at `code` or 0 if it is truncated.
+static int instruction_size(const uint8_t *code, size_t remaining) {
+    Opcode op = static_cast<Opcode>(code[0]);
+    int size = 1 + operands_size(opcode_operands[code[0]]);
+    if (op == Opcode::CLOSURE && static_cast<size_t>(size) <= remaining) {
+        size += 2 * (code[4] + code[5]);
+    }
+
+    return (static_cast<size_t>(size) <= remaining) ? size : 0;
+}
+
+BytecodeProgram *BytecodeProgram::load(const uint8_t *blob, size_t len, const char **error) {
+    BlobReader reader(blob, len);
+    const uint8_t *magic = reader.bytes(4);
+    if (!magic || memcmp(magic, VM_BYTECODE_MAGIC, 4) != 0) {
+        *error = "not a bytecode";
+        return nullptr;
+    }
+
+    if (reader.u8() != VM_BYTECODE_VERSION) {
+        *error = "unsupported bytecode version";
+        return nullptr;
+    }
+
+    reader.u8();
+    int num_consts = reader.u16();
+    int num_sites = reader.u16();
+    int num_caches = reader.u16();
+    int num_funcs = reader.u16();
+    if (num_funcs == 0) {
+        *error = "no top level";
+        return nullptr;
+    }
+
+    BytecodeProgram *program = new BytecodeProgram();
+    program->consts.reserve(num_consts);
+    for (int i = 0; i < num_consts && reader.ok; i++) {
+        switch (reader.u8()) {
+        case VM_BC_CONST_STRING: {
+            size_t length = reader.u16();
+            const uint8_t *data = reader.bytes(length);
+            if (data) {
+                program->consts.push_back(Value::String(std::string(reinterpret_cast<const char *>(data), length)));
+            }
+            break;
+        }
+        case VM_BC_CONST_DOUBLE: {
+            const uint8_t *data = reader.bytes(sizeof(double));
+            if (data) {
+                double value;
+                memcpy(&value, data, sizeof(value));
+                program->consts.push_back(Value::Double(value));
+            }
+            break;
+        }
+        default:
+            reader.ok = false;
+        }
+    }
+
+    // Call sites and inline caches must not move once they are used.
+    program->sites.reserve(num_sites);
+    for (int i = 0; i < num_sites && reader.ok; i++) {
+        int name = reader.u16();
+        int line = reader.u16();
+        if (name >= num_consts || program->consts[name].type() != ValueType::String) {
+            reader.ok = false;
+            break;
+        }
+
+        const char *func = program->consts[name].toStringView().c_str();
+        program->sites.push_back({ "app.js", func, line, 0 });
+    }
+
+    program->num_caches = num_caches;
+    program->funcs.reserve(num_funcs);
+    for (int i = 0; i < num_funcs && reader.ok; i++) {
+        BytecodeFunction func;
+        func.nparams = reader.u8();
+        func.nregs = reader.u8();
+        func.nboxes = reader.u8();
+        func.nupvals = reader.u8();
+        func.nupboxes = reader.u8();
+        func.code_len = reader.u16();
+        func.code = reader.bytes(func.code_len);
+        program->funcs.push_back(func);
+    }
+
+    *error = nullptr;
+    if (!reader.ok || !reader.at_end()) {
+        *error = "malformed bytecode";
+    } else if (program->funcs[0].nupvals > 0 || program->funcs[0].nupboxes > 0) {
+        // The top level has no closure record.
+        *error = "invalid top level";
+    }
+
+    for (int i = 0; i < num_funcs && !*error; i++) {
+        program->verify(program->funcs[i], error);
+    }
+
+    if (*error) {
+        delete program;
+        return nullptr;
+    }
+
+    // Created after the verification: under VM_IC_STATS, inline caches are
+    // registered globally and must never be freed.
+    program->caches.reserve(num_caches);
+    for (int i = 0; i < num_caches; i++) {
+        program->caches.emplace_back("(bytecode)");
+    }
+
+    return program;
+}
+
+bool BytecodeProgram::verify(const BytecodeFunction& func, const char **error) {
+    if (func.nparams > func.nregs) {
+        *error = "too few registers";
+        return false;
+    }
+
+    // Find the beginning of instructions: jumps must land on one of them.
+    std::vector<bool, PoolAllocator<bool>> starts(func.code_len, false);
+    Opcode last = Opcode::NUM_OPCODES;
+    for (int pc = 0; pc < func.code_len;) {
+        if (func.code[pc] >= static_cast<uint8_t>(Opcode::NUM_OPCODES)) {
+            *error = "invalid opcode";
+            return false;
+        }
+
+        int size = instruction_size(&func.code[pc], func.code_len - pc);
+        if (!size) {
+            *error = "truncated instruction";
+            return false;
+        }
+
+        starts[pc] = true;
+        last = static_cast<Opcode>(func.code[pc]);
+        pc += size;
+    }
+
+    // The interpreter never runs off the end of the code.
+    if (last != Opcode::RET && last != Opcode::RETU && last != Opcode::JMP) {
+        *error = "function does not end with a return";
+        return false;
+    }
+
+    for (int pc = 0; pc < func.code_len;) {
+        Opcode op = static_cast<Opcode>(func.code[pc]);
+        const uint8_t *operand = &func.code[pc + 1];
+        int size = instruction_size(&func.code[pc], func.code_len - pc);
+        int next = pc + size;
+        uint8_t regs[3] = { 0, 0, 0 };
+        int num_regs = 0;
+        int count = 0;
+        for (const char *kind = opcode_operands[func.code[pc]]; *kind; kind++) {
+            switch (*kind) {
+            case 'r':
+                if (*operand >= func.nregs) {
+                    *error = "invalid register";
+                    return false;
+                }
+
+                regs[num_regs++] = *operand;
+                operand += 1;
+                break;
+            case 'k': {
+                int k = read_u16(operand);
+                if (k >= static_cast<int>(consts.size())) {
+                    *error = "invalid constant";
+                    return false;
+                }
+
+                // Constants other than LOADK name a variable or a property.
+                if (op != Opcode::LOADK && consts[k].type() != ValueType::String) {
+                    *error = "invalid name";
+                    return false;
+                }
+
+                operand += 2;
+                break;
+            }
+            case 'i':
+                operand += 4;
+                break;
+            case 'j': {
+                int target = next + static_cast<int16_t>(read_u16(operand));
+                if (target < 0 || target >= func.code_len || !starts[target]) {
+                    *error = "invalid jump";
+                    return false;
+                }
+
+                operand += 2;
+                break;
+            }
+            case 's':
+                if (read_u16(operand) >= sites.size()) {
+                    *error = "invalid call site";
+                    return false;
+                }
+
+                operand += 2;
+                break;
+            case 'c':
+                if (read_u16(operand) >= num_caches) {
+                    *error = "invalid inline cache";
+                    return false;
+                }
+
+                operand += 2;
+                break;
+            case 'f': {
+                int f = read_u16(operand);
+                // CLOSURE is followed by the captures of the function.
+                if (f == 0 || f >= static_cast<int>(funcs.size())
+                    || operand[2] != funcs[f].nupvals || operand[3] != funcs[f].nupboxes) {
+                    *error = "invalid function";
+                    return false;
+                }
+
+                operand += 2;
+                break;
+            }
+            case 'n':
+                count = *operand;
+                operand += 1;
+                break;
+            case 'u': {
+                int limit = 0;
+                switch (op) {
+                case Opcode::GETUP: limit = func.nupvals; break;
+                case Opcode::GETBOX: case Opcode::SETBOX: limit = func.nboxes; break;
+                default: limit = func.nupboxes;
+                }
+
+                if (*operand >= limit) {
+                    *error = "invalid variable";
+                    return false;
+                }
+
+                operand += 1;
+                break;
+            }
+            case 't': {
+                int limit = (op == Opcode::NEWTA) ? 3 : VM_BC_NUM_TA_METHODS;
+                if (*operand >= limit) {
+                    *error = "invalid typed array operand";
+                    return false;
+                }
+
+                operand += 1;
+                break;
+            }
+            }
+        }
+
+        // Instructions which take `count` consecutive registers.
+        switch (op) {
+        case Opcode::CONCAT:
+        case Opcode::ARRAY:
+            if (regs[1] + count > func.nregs) {
+                *error = "invalid register";
+                return false;
+            }
+            break;
+        case Opcode::CALL:
+        case Opcode::MCALL:
+        case Opcode::TACALL:
+            if (regs[1] + 1 + count > func.nregs) {
+                *error = "invalid register";
+                return false;
+            }
+            break;
+        case Opcode::CLOSURE: {
+            int nupvals = func.code[pc + 4];
+            for (int i = 0; i < nupvals + func.code[pc + 5]; i++) {
+                bool is_box = i >= nupvals;
+                int index = operand[2 * i + 1];
+                int limit;
+                switch (operand[2 * i]) {
+                case VM_BC_FROM_LOCAL:
+                    limit = is_box ? func.nboxes : func.nregs;
+                    break;
+                case VM_BC_FROM_UPVALUE:
+                    limit = is_box ? func.nupboxes : func.nupvals;
+                    break;
+                default:
+                    limit = 0;
+                }
+
+                if (index >= limit) {
+                    *error = "invalid capture";
+                    return false;
+                }
+            }
+            break;
+        }
+        default:
+            break;
+        }
+
+        pc = next;
+    }
+
+    return true;
+}
+
+// The native function of function values created by CLOSURE: the function
+// index is the first slot of the closure record.
+static Value call_bytecode_function(Context *ctx, int nargs, Value *args) {
+    Scope *record = ctx->callee_closure;
+    return running_program->execute(ctx, record->slots[0].toInt(), record, nargs, args);
+}
+
+Value BytecodeProgram::create_function(int index, Scope *record) {
+    record->slots[0] = Value::Int(index);
+    return Value::Function(call_bytecode_function, record);
+}
+
+Value BytecodeProgram::run(Context *ctx) {
+    running_program = this;
+    return execute(ctx, 0, nullptr, 0, nullptr);
+}
+
+// Registers of a call allocated on the C stack.
+class Registers {
+public:
+    Value *regs;
+    int num_regs;
+
+    Registers(Value *regs, int num_regs) : regs(regs), num_regs(num_regs) {
+        for (int i = 0; i < num_regs; i++) {
+            new (&regs[i]) Value();
+        }
+    }
+
+    ~Registers() {
+        for (int i = 0; i < num_regs; i++) {
+            regs[i].~Value();
+        }
+    }
+};
+
+// Writes the result of an instruction into a register. Registers mostly hold
+// ints and doubles: overwrite them without going through the release path of
+// the assignment. The interpreter loop is too large for the compiler to
+// inline this by itself.
+static inline __attribute__((always_inline)) void store(Value& reg, Value&& value) {
+    if (reg.is_heap()) {
+        reg = std::move(value);
+    } else {
+        new (&reg) Value(std::move(value));
+    }
+}
+
+// Returns true if `array[index]` is an in-bounds element of a typed array:
+// the fast path of GET and SET as VM_TA_GET and VM_TA_SET in the C++
+// backend, which knows typed array variables statically.
+static inline bool is_packed_index(const Value& array, const Value& index) {
+    return array.type() == ValueType::TypedArray && index.type() == ValueType::Int
+        && static_cast<unsigned>(index.toInt()) < static_cast<unsigned>(array.packed().length);
+}
+
+#define R(i) regs[pc[i]]
+#define U16(i) read_u16(&pc[i])
+#define NEXT(size) do { pc += (size); goto *handlers[*pc++]; } while (0)
+
+Value BytecodeProgram::execute(Context *ctx, int index, Scope *record, int nargs, Value *args) {
+    const BytecodeFunction& func = funcs[index];
+    // Registers and boxes are allocated on the C stack: up to 255 registers
+    // may not fit in the rest of it even if the call depth does.
+    if (!ctx->has_stack_room(sizeof(Value) * func.nregs + sizeof(Scope *) * func.nboxes)) {
+        return VM_CREATE_ERROR("maximum call stack size exceeded");
+    }
+
+    Registers registers(static_cast<Value *>(alloca(sizeof(Value) * func.nregs)), func.nregs);
+    Scope **boxes = static_cast<Scope **>(alloca(sizeof(Scope *) * func.nboxes));
+    StackClosure frame(ctx, record, func.nregs, registers.regs, func.nboxes, boxes);
+    ctx->current->bind_args(func.nparams, nargs, args);
+
+    Value *regs = registers.regs;
+    const uint8_t *pc = func.code;
+    // Each handler jumps to the next one through the table (threaded
+    // dispatch) instead of going back to a switch. The verifier has checked
+    // every opcode.
+#define VM_BC_HANDLER(name, operands) &&op_##name,
+    static const void *const handlers[] = {
+        VM_BYTECODE_OPCODES(VM_BC_HANDLER)
+    };
+#undef VM_BC_HANDLER
+
+    NEXT(0);
+    op_MOVE:
+        R(0) = R(1);
+        NEXT(2);
+    op_LOADK:
+        R(0) = consts[U16(1)];
+        NEXT(3);
+    op_LOADI:
+        store(R(0), Value::Int(read_i32(&pc[1])));
+        NEXT(5);
+    op_LOADU:
+        store(R(0), Value::Undefined());
+        NEXT(1);
+    op_LOADNULL:
+        store(R(0), Value::Null());
+        NEXT(1);
+    op_LOADTRUE:
+        store(R(0), Value::Bool(true));
+        NEXT(1);
+    op_LOADFALSE:
+        store(R(0), Value::Bool(false));
+        NEXT(1);
+    op_GETUP:
+        R(0) = record->slots[1 + pc[1]];
+        NEXT(2);
+    op_GETBOX:
+        R(0) = boxes[pc[1]]->slots[0];
+        NEXT(2);
+    op_SETBOX:
+        boxes[pc[0]]->slots[0] = R(1);
+        NEXT(2);
+    op_GETUPBOX:
+        R(0) = record->boxes[pc[1]]->slots[0];
+        NEXT(2);
+    op_SETUPBOX:
+        record->boxes[pc[0]]->slots[0] = R(1);
+        NEXT(2);
+    op_GETG:
+        R(0) = ctx->globals->get(consts[U16(1)].toStringView().c_str());
+        NEXT(3);
+    op_SETG:
+        ctx->globals->set(consts[U16(0)].toStringView().c_str(), R(2));
+        NEXT(3);
+    // `x = x + y` appends to the string in place as `x += y` does.
+    op_ADD:
+        if (pc[0] == pc[1]) {
+            R(0) += R(2);
+        } else {
+            store(R(0), R(1) + R(2));
+        }
+        NEXT(3);
+    op_SUB:
+        if (pc[0] == pc[1]) {
+            R(0) -= R(2);
+        } else {
+            store(R(0), R(1) - R(2));
+        }
+        NEXT(3);
+    op_MUL:
+        store(R(0), R(1) * R(2));
+        NEXT(3);
+    op_DIV:
+        store(R(0), R(1) / R(2));
+        NEXT(3);
+    op_MOD:
+        store(R(0), R(1) % R(2));
+        NEXT(3);
+    op_BAND:
+        store(R(0), R(1) & R(2));
+        NEXT(3);
+    op_BOR:
+        store(R(0), R(1) | R(2));
+        NEXT(3);
+    op_BXOR:
+        store(R(0), R(1) ^ R(2));
+        NEXT(3);
+    op_SHL:
+        store(R(0), R(1) << R(2));
+        NEXT(3);
+    op_SHR:
+        store(R(0), R(1) >> R(2));
+        NEXT(3);
+    op_EQ:
+        store(R(0), Value::Bool(R(1) == R(2)));
+        NEXT(3);
+    op_NE:
+        store(R(0), Value::Bool(R(1) != R(2)));
+        NEXT(3);
+    op_LT:
+        store(R(0), Value::Bool(R(1) < R(2)));
+        NEXT(3);
+    op_LE:
+        store(R(0), Value::Bool(R(1) <= R(2)));
+        NEXT(3);
+    op_GT:
+        store(R(0), Value::Bool(R(1) > R(2)));
+        NEXT(3);
+    op_GE:
+        store(R(0), Value::Bool(R(1) >= R(2)));
+        NEXT(3);
+    op_NOT:
+        store(R(0), Value::Bool(!R(1).toBool()));
+        NEXT(2);
+    op_NEG:
+        store(R(0), -R(1));
+        NEXT(2);
+    op_POS:
+        store(R(0), +R(1));
+        NEXT(2);
+    op_BNOT:
+        store(R(0), ~R(1));
+        NEXT(2);
+    op_INC:
+        ++R(0);
+        NEXT(1);
+    op_DEC:
+        --R(0);
+        NEXT(1);
+    op_CONCAT:
+        store(R(0), Value::concat(pc[2], &R(1)));
+        NEXT(3);
+    op_GET:
+        if (is_packed_index(R(1), R(2))) {
+            store(R(0), Value::Int(R(1).packed().get(R(2).toInt())));
+        } else {
+            store(R(0), R(1).get_element(R(2)));
+        }
+        NEXT(3);
+    op_GETK:
+        store(R(0), R(1).get(consts[U16(2)], caches[U16(4)]));
+        NEXT(6);
+    op_SET:
+        if (is_packed_index(R(0), R(1)) && R(2).type() == ValueType::Int) {
+            R(0).packed().set(R(1).toInt(), R(2).toInt());
+        } else {
+            R(0).set_element(R(1), R(2));
+        }
+        NEXT(3);
+    op_SETK:
+        R(0).set_element(consts[U16(1)], R(3));
+        NEXT(4);
+    op_ARRAY:
+        store(R(0), Value::Array(pc[2], &R(1)));
+        NEXT(3);
+    op_NEWTA:
+        store(R(0), Value::TypedArray(static_cast<PackedArrayKind>(pc[1]), R(2)));
+        NEXT(3);
+    op_CLOSURE: {
+        int nupvals = pc[3];
+        int nupboxes = pc[4];
+        const uint8_t *from = &pc[5];
+        Scope *closure = Scope::create(nullptr, 1 + nupvals, nupboxes);
+        for (int i = 0; i < nupvals; i++, from += 2) {
+            closure->slots[1 + i] = (from[0] == VM_BC_FROM_LOCAL) ? regs[from[1]] : record->slots[1 + from[1]];
+        }
+
+        for (int i = 0; i < nupboxes; i++, from += 2) {
+            closure->share_box(i, (from[0] == VM_BC_FROM_LOCAL) ? boxes[from[1]] : record->boxes[from[1]]);
+        }
+
+        store(R(0), create_function(U16(1), closure));
+        pc = from;
+        NEXT(0);
+    }
+    op_CALL:
+        store(R(0), ctx->call(sites[U16(3)].id(), R(1), pc[2], &R(1) + 1));
+        NEXT(5);
+    op_MCALL: {
+        // Arrays have methods (e.g. `queue.push(x)`). Other values call
+        // the function stored in the property.
+        const Value& obj = R(1);
+        const Value& prop = consts[U16(3)];
+        CallSiteId site = sites[U16(7)].id();
+        if (obj.type() == ValueType::Array) {
+            store(R(0), ctx->call_method(site, obj, prop, pc[2], &R(1) + 1));
+        } else {
+            store(R(0), ctx->call(site, obj.get(prop, caches[U16(5)]), pc[2], &R(1) + 1));
+        }
+        NEXT(9);
+    }
+    op_TACALL: {
+        Value *method_args = &R(2) + 1;
+        switch (pc[1]) {
+        case VM_BC_TA_FILL:
+            store(R(0), vm_typed_array_fill(R(2), pc[3], method_args));
+            break;
+        case VM_BC_TA_SUBARRAY:
+            store(R(0), vm_typed_array_subarray(R(2), pc[3], method_args));
+            break;
+        default:
+            store(R(0), vm_typed_array_set(R(2), pc[3], method_args));
+        }
+        NEXT(4);
+    }
+    op_JMP:
+        NEXT(2 + static_cast<int16_t>(U16(0)));
+    op_JT:
+        NEXT(3 + (R(0).toBool() ? static_cast<int16_t>(U16(1)) : 0));
+    op_JF:
+        NEXT(3 + (R(0).toBool() ? 0 : static_cast<int16_t>(U16(1))));
+    op_RET:
+        return std::move(R(0));
+    op_RETU:
+        return Value::Undefined();
+}
@@ -0,0 +1,397 @@
+// A cycle collector based on trial deletion (Bacon and Rajan, "Concurrent
+// Cycle Collection in Reference Counted Systems", 2001).
+//
+// Reference counting frees everything but garbage cycles. An object whose
+// reference count is decremented to nonzero becomes a candidate: it may be the
+// last external reference to a cycle. For each candidate, the collector
+// counts references to the objects reachable from it (the subgraph) from
+// outside of the subgraph (Mark); objects referenced from outside and
+// everything reachable from them are live (Scan) and the rest is garbage
+// (Clear and Free).
+//
+// The collection is incremental so that the pause is bounded: each phase
+// keeps its position in explicit worklists, even within a large object, and a
+// slice stops once it has done `max_work` steps. The app runs between slices
+// of a collection:
+//
+// - The counts are kept in gc_count instead of ref_count and the collector
+//   holds a reference to every object in the subgraph until the collection
+//   ends, so the app never frees an object the collector refers to.
+// - The app may change references to a gray object between slices. Such an
+//   object is touched (HeapObject::retain() and vm_gc_add_candidate()) and
+//   kept alive in the collection. Garbage is unreachable from the app, so it
+//   is never touched: an object which has lost a reference is traced again as
+//   a candidate in the next collection instead.
+#include <makestack/vm.h>
+
+typedef std::vector<HeapObject *, PoolAllocator<HeapObject *>> HeapObjectStack;
+
+enum class Phase {
+    Idle,
+    // Counts references from outside of the subgraph.
+    Mark,
+    // Marks objects referenced from outside and objects reachable from them
+    // live. The remaining gray objects are garbage.
+    Scan,
+    // Drops references from garbage.
+    Clear,
+    // Frees garbage and drops the collector's references to live objects.
+    Free,
+};
+
+static HeapObject *candidates = nullptr;
+static Phase phase = Phase::Idle;
+// Objects in the subgraph of the current candidate. The collector holds a
+// reference to each of them.
+static HeapObjectStack subgraph;
+// Objects whose references are to be traced: gray ones in Mark and live ones
+// in Scan.
+static HeapObjectStack worklist;
+// Gray objects touched by the app in the current collection.
+static HeapObjectStack touched;
+// The object being traced and the index of its next reference.
+static HeapObject *current = nullptr;
+static int current_ref;
+// The position in `subgraph` in Scan, Clear, and Free.
+static size_t cursor;
+
+void vm_gc_add_candidate(HeapObject *obj) {
+    if (obj->color == GCColor::Gray) {
+        vm_gc_touch(obj);
+    } else {
+        obj->color = GCColor::Purple;
+    }
+
+    if (obj->buffered) {
+        return;
+    }
+
+    obj->buffered = true;
+    obj->prev_candidate = nullptr;
+    obj->next_candidate = candidates;
+    if (candidates) {
+        candidates->prev_candidate = obj;
+    }
+
+    candidates = obj;
+}
+
+void vm_gc_remove_candidate(HeapObject *obj) {
+    if (obj->prev_candidate) {
+        obj->prev_candidate->next_candidate = obj->next_candidate;
+    } else {
+        candidates = obj->next_candidate;
+    }
+
+    if (obj->next_candidate) {
+        obj->next_candidate->prev_candidate = obj->prev_candidate;
+    }
+
+    obj->buffered = false;
+    obj->prev_candidate = nullptr;
+    obj->next_candidate = nullptr;
+}
+
+void vm_gc_touch(HeapObject *obj) {
+    if (!obj->dirty) {
+        obj->dirty = true;
+        touched.push_back(obj);
+    }
+}
+
+// Returns the number of references from `obj` which may point to objects,
+// arrays, functions, and scopes. Strings and errors never refer to them.
+static int num_refs(HeapObject *obj) {
+    if (obj->is_scope) {
+        Scope *scope = static_cast<Scope *>(obj);
+        // Slots, boxes, and the outer scope.
+        return scope->num_slots + scope->num_boxes + 1;
+    }
+
+    ValueInner *inner = static_cast<ValueInner *>(obj);
+    switch (inner->type) {
+    case ValueType::Object:
+        return inner->v_obj.shape->num_props;
+    case ValueType::Array:
+        return inner->v_array.length;
+    case ValueType::Function:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Returns the object referred to by the `index`-th reference from `obj` or
+// null if it is not an object, array, function, or scope.
+static HeapObject *ref_at(HeapObject *obj, int index) {
+    if (obj->is_scope) {
+        Scope *scope = static_cast<Scope *>(obj);
+        if (index < scope->num_slots) {
+            return scope->slots[index].gc_container();
+        }
+
+        index -= scope->num_slots;
+        if (index < scope->num_boxes) {
+            return scope->boxes[index];
+        }
+
+        return scope->prev;
+    }
+
+    ValueInner *inner = static_cast<ValueInner *>(obj);
+    switch (inner->type) {
+    case ValueType::Object:
+        return inner->v_obj.slot(index).gc_container();
+    case ValueType::Array:
+        return inner->v_array.slots[index].gc_container();
+    case ValueType::Function:
+        return inner->v_closure;
+    default:
+        return nullptr;
+    }
+}
+
+static bool is_garbage(HeapObject *obj) {
+    return obj->color == GCColor::Gray || obj->color == GCColor::White;
+}
+
+static void clear_value(Value& value) {
+    ValueInner *inner = value.gc_container();
+    if (inner && is_garbage(inner)) {
+        // Its reference count no longer matters: it is freed as well.
+        value.gc_forget();
+    } else {
+        value = Value::Undefined();
+    }
+}
+
+static void clear_scope_ref(Scope *&ref) {
+    if (ref && !is_garbage(ref)) {
+        ref->release();
+    }
+
+    ref = nullptr;
+}
+
+// Drops the `index`-th reference from `obj`.
+static void clear_ref(HeapObject *obj, int index) {
+    if (obj->is_scope) {
+        Scope *scope = static_cast<Scope *>(obj);
+        if (index < scope->num_slots) {
+            clear_value(scope->slots[index]);
+            return;
+        }
+
+        index -= scope->num_slots;
+        if (index < scope->num_boxes) {
+            clear_scope_ref(scope->boxes[index]);
+        } else {
+            clear_scope_ref(scope->prev);
+        }
+        return;
+    }
+
+    ValueInner *inner = static_cast<ValueInner *>(obj);
+    switch (inner->type) {
+    case ValueType::Object:
+        clear_value(inner->v_obj.slot(index));
+        break;
+    case ValueType::Array:
+        clear_value(inner->v_array.slots[index]);
+        break;
+    case ValueType::Function:
+        clear_scope_ref(inner->v_closure);
+        break;
+    default:
+        break;
+    }
+}
+
+static void destroy(HeapObject *obj) {
+    if (obj->is_scope) {
+        static_cast<Scope *>(obj)->destroy();
+    } else {
+        delete static_cast<ValueInner *>(obj);
+    }
+}
+
+// Adds `obj` to the subgraph.
+static void visit(HeapObject *obj) {
+    obj->color = GCColor::Gray;
+    obj->dirty = false;
+    if (obj->ref_count > UINT16_MAX) {
+        // Too many references to count: it is surely referenced from outside.
+        obj->dirty = true;
+    } else {
+        obj->gc_count = obj->ref_count;
+    }
+
+    obj->ref_count++;
+    subgraph.push_back(obj);
+    worklist.push_back(obj);
+}
+
+// Marks a gray object live.
+static void blacken(HeapObject *obj) {
+    // A candidate which has lost a reference in the collection may have
+    // become garbage since.
+    obj->color = (obj->dirty && obj->buffered) ? GCColor::Purple : GCColor::Black;
+    obj->dirty = false;
+    worklist.push_back(obj);
+}
+
+// Returns the next reference from the object being traced, taking a new one
+// from the worklist if needed. Returns false if the worklist is empty.
+static bool next_ref(HeapObject **obj, int *index) {
+    while (!current || current_ref >= num_refs(current)) {
+        if (worklist.empty()) {
+            current = nullptr;
+            return false;
+        }
+
+        current = worklist.back();
+        worklist.pop_back();
+        current_ref = 0;
+    }
+
+    *obj = current;
+    *index = current_ref++;
+    return true;
+}
+
+static void mark(int& work, int max_work) {
+    HeapObject *obj;
+    int index;
+    while (work < max_work) {
+        if (!next_ref(&obj, &index)) {
+            phase = Phase::Scan;
+            cursor = 0;
+            return;
+        }
+
+        work++;
+        HeapObject *target = ref_at(obj, index);
+        if (!target) {
+            continue;
+        }
+
+        if (target->color != GCColor::Gray) {
+            visit(target);
+        }
+
+        if (target->gc_count > 0) {
+            target->gc_count--;
+        }
+    }
+}
+
+static void scan(int& work, int max_work) {
+    HeapObject *obj;
+    int index;
+    while (work < max_work) {
+        work++;
+        if (!touched.empty()) {
+            obj = touched.back();
+            touched.pop_back();
+            if (obj->color == GCColor::Gray) {
+                blacken(obj);
+            }
+        } else if (next_ref(&obj, &index)) {
+            HeapObject *target = ref_at(obj, index);
+            if (target && target->color == GCColor::Gray) {
+                blacken(target);
+            }
+        } else if (cursor < subgraph.size()) {
+            obj = subgraph[cursor++];
+            if (obj->color == GCColor::Gray && (obj->dirty || obj->gc_count > 0)) {
+                blacken(obj);
+            }
+        } else {
+            phase = Phase::Clear;
+            cursor = 0;
+            return;
+        }
+    }
+}
+
+static void clear(int& work, int max_work) {
+    while (work < max_work) {
+        work++;
+        if (current && current_ref < num_refs(current)) {
+            clear_ref(current, current_ref++);
+            continue;
+        }
+
+        if (cursor == subgraph.size()) {
+            current = nullptr;
+            phase = Phase::Free;
+            cursor = 0;
+            return;
+        }
+
+        current = subgraph[cursor++];
+        current_ref = 0;
+        if (current->color == GCColor::Gray) {
+            current->color = GCColor::White;
+        } else {
+            current = nullptr;
+        }
+    }
+}
+
+static void free_subgraph(int& work, int max_work) {
+    while (work < max_work) {
+        if (cursor == subgraph.size()) {
+            subgraph.clear();
+            phase = Phase::Idle;
+            return;
+        }
+
+        work++;
+        HeapObject *obj = subgraph[cursor++];
+        // A live object may have been dropped by the app in the collection.
+        if (obj->color == GCColor::White || --obj->ref_count == 0) {
+            destroy(obj);
+        }
+    }
+}
+
+bool vm_collect_cycles(int max_work) {
+    int work = 0;
+    while (work < max_work) {
+        switch (phase) {
+        case Phase::Idle: {
+            if (!candidates) {
+                return false;
+            }
+
+            HeapObject *root = candidates;
+            vm_gc_remove_candidate(root);
+            work++;
+
+            // The candidate has been found live in another collection.
+            if (root->color != GCColor::Purple) {
+                continue;
+            }
+
+            visit(root);
+            phase = Phase::Mark;
+            break;
+        }
+        case Phase::Mark:
+            mark(work, max_work);
+            break;
+        case Phase::Scan:
+            scan(work, max_work);
+            break;
+        case Phase::Clear:
+            clear(work, max_work);
+            break;
+        case Phase::Free:
+            free_subgraph(work, max_work);
+            break;
+        }
+    }
+
+    return phase != Phase::Idle || candidates != nullptr;
+}
@@ -0,0 +1,177 @@
+// Typed arrays (Int16Array, Int32Array, and Uint8Array): elements are packed
+// into a contiguous buffer instead of being stored as values.
+#include <makestack/vm.h>
+
+Value Value::TypedArray(PackedArrayKind kind, const Value& length) {
+    if (length.type() != ValueType::Int || length.toInt() < 0) {
+        return VM_CREATE_ERROR("invalid typed array length");
+    }
+
+    int n = length.toInt();
+    PackedArray packed;
+    packed.kind = kind;
+    // The size in bytes must fit in an int as well as the length.
+    if (n > INT32_MAX / packed.element_size()) {
+        return VM_CREATE_ERROR("RangeError: invalid typed array length");
+    }
+
+    size_t size = static_cast<size_t>(n) * packed.element_size();
+    VM_CHECK_HEAP(size);
+
+    ValueInner *inner = new ValueInner(kind, n, nullptr, nullptr);
+    if (n > 0) {
+        inner->v_packed.data = static_cast<uint8_t *>(vm_alloc_buffer(size));
+        memset(inner->v_packed.data, 0, size);
+    }
+
+    return Value(inner);
+}
+
+Value Value::TypedArrayView(const Value& array, int begin, int length) {
+    PackedArray& packed = array.packed();
+    ValueInner *owner = packed.owner ? packed.owner : array.inner;
+    uint8_t *data = packed.data + begin * packed.element_size();
+    return Value(new ValueInner(packed.kind, length, data, owner));
+}
+
+// Converts a property into an element index. Returns -1 if it is not an index
+// in the array.
+static int element_index(const PackedArray& array, const Value& prop) {
+    int index;
+    switch (prop.type()) {
+    case ValueType::Int:
+        index = prop.toInt();
+        break;
+    case ValueType::Double: {
+        double d = prop.toDouble();
+        if (!(d >= 0 && d < array.length)) {
+            return -1;
+        }
+
+        index = static_cast<int>(d);
+        if (index != d) {
+            return -1;
+        }
+        break;
+    }
+    default:
+        return -1;
+    }
+
+    return (index >= 0 && index < array.length) ? index : -1;
+}
+
+// Converts a value stored into an element as ToInt32 does: booleans are 0 or
+// 1, integer strings are parsed, and other values are NaN, i.e., 0.
+static int element_value(const Value& value) {
+    switch (value.type()) {
+    case ValueType::Int:
+    case ValueType::Double:
+        return value.toInt32();
+    case ValueType::Bool:
+        return value.toBool() ? 1 : 0;
+    case ValueType::String: {
+        StringView s = value.toStringView();
+        int i;
+        return vm_parse_int(s.c_str(), s.length(), &i) ? i : 0;
+    }
+    default:
+        return 0;
+    }
+}
+
+// Out-of-bounds reads return undefined as in JavaScript.
+Value vm_typed_array_get_element(const Value& array, const Value& prop) {
+    const PackedArray& packed = array.packed();
+    if (prop.type() == ValueType::String) {
+        StringView name = prop.toStringView();
+        if (name == "length") {
+            return Value::Int(packed.length);
+        }
+
+        return Value::Undefined();
+    }
+
+    int index = element_index(packed, prop);
+    if (index < 0) {
+        return Value::Undefined();
+    }
+
+    return Value::Int(packed.get(index));
+}
+
+// Out-of-bounds writes are ignored as in JavaScript.
+Value vm_typed_array_set_element(const Value& array, const Value& prop, const Value& value) {
+    PackedArray& packed = array.packed();
+    int index = element_index(packed, prop);
+    if (index >= 0) {
+        packed.set(index, element_value(value));
+    }
+
+    return value;
+}
+
+// Resolves a relative index argument (negative ones count from the end) into
+// [0, length].
+static int relative_index(int nargs, Value *args, int nth, int length, int default_index) {
+    if (nth >= nargs || args[nth].type() == ValueType::Undefined) {
+        return default_index;
+    }
+
+    int index = args[nth].toInt32();
+    if (index < 0) {
+        index += length;
+        return (index < 0) ? 0 : index;
+    }
+
+    return (index > length) ? length : index;
+}
+
+// array.fill(value, start = 0, end = length)
+Value vm_typed_array_fill(const Value& array, int nargs, Value *args) {
+    PackedArray& packed = array.packed();
+    int value = (nargs > 0) ? element_value(args[0]) : 0;
+    int start = relative_index(nargs, args, 1, packed.length, 0);
+    int end = relative_index(nargs, args, 2, packed.length, packed.length);
+    for (int i = start; i < end; i++) {
+        packed.set(i, value);
+    }
+
+    return array;
+}
+
+// array.subarray(begin = 0, end = length): returns a view which shares the
+// elements with `array`.
+Value vm_typed_array_subarray(const Value& array, int nargs, Value *args) {
+    PackedArray& packed = array.packed();
+    int begin = relative_index(nargs, args, 0, packed.length, 0);
+    int end = relative_index(nargs, args, 1, packed.length, packed.length);
+    int length = (end > begin) ? end - begin : 0;
+    return Value::TypedArrayView(array, begin, length);
+}
+
+// array.set(source, offset = 0): copies elements of the typed array `source`.
+Value vm_typed_array_set(const Value& array, int nargs, Value *args) {
+    PackedArray& dst = array.packed();
+    if (nargs < 1 || args[0].type() != ValueType::TypedArray) {
+        return VM_CREATE_ERROR("source must be a typed array");
+    }
+
+    const PackedArray& src = args[0].packed();
+    int offset = (nargs > 1) ? args[1].toInt32() : 0;
+    if (offset < 0 || offset > dst.length - src.length) {
+        return VM_CREATE_ERROR("offset is out of bounds");
+    }
+
+    if (src.kind == dst.kind) {
+        // The source may be a view of the same buffer.
+        memmove(dst.data + offset * dst.element_size(), src.data,
+                src.length * src.element_size());
+    } else {
+        for (int i = 0; i < src.length; i++) {
+            dst.set(offset + i, src.get(i));
+        }
+    }
+
+    return Value::Undefined();
+}
@@ -13,7 +13,7 @@ import {
 } from "./command";
 import { Board, BuildError, BuildOptions } from "../boards";
 import { logger } from "../logger";
-import { buildApp } from "../firmware";
+import { buildApp, compileAppBytecode } from "../firmware";
 import { SerialAdapter, WiFiAdapter } from "../adapters";
 import { DevServer } from "../dev_server";
 import { ProtocolServer } from "../server/server";
@@ -47,6 +47,11 @@ export class DevCommand extends Command {
             desc: "The dev server port.",
             default: 1234,
         },
+        {
+            name: "--bytecode",
+            desc: "Ships app changes as a bytecode instead of rebuilding the firmware.",
+            default: false,
+        },
     ];
     public static watchMode = true;
 
@@ -85,7 +90,11 @@ export class DevCommand extends Command {
             if (filename == "app.js" && fs.existsSync(appFile)) {
                 logger.progress("Change detected, restarting and rebuilding the app...");
                 this.devServer.restart();
-                await this.build(opts.appDir, opts as BuildOptions);
+                if (opts.bytecode) {
+                    this.compileBytecode(opts.appDir);
+                } else {
+                    await this.build(opts.appDir, opts as BuildOptions);
+                }
             }
         });
 
@@ -117,6 +126,21 @@ export class DevCommand extends Command {
         return true;
     }
 
+    private compileBytecode(appDir: string) {
+        logger.progress("Compiling the app into a bytecode...");
+        let bytecode;
+        try {
+            bytecode = compileAppBytecode(appDir);
+        } catch (e) {
+            logger.error(`failed to compile: ${e.message}`);
+            return false;
+        }
+
+        this.protocolServer.setAppBytecode(bytecode);
+        logger.success(`Compiled the app (${bytecode.length} bytes)`);
+        return true;
+    }
+
     private async initializeAdapter(adapter: string, opts: any) {
         switch (adapter) {
             case "serial":
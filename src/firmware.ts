@@ -1,7 +1,7 @@
 import * as fs from "fs-extra";
 import * as path from "path";
 import { Board, BuildOptions } from "./boards";
-import { Transpiler } from "./transpiler";
+import { BytecodeCompiler, Transpiler } from "./transpiler";
 import { render, execScriptHook } from "./helpers";
 
 export interface Credential {
@@ -24,6 +24,7 @@ export function extractCredentials(path: string): Credential {
 const APP_CXX_TEMPLATE = `\
 #include <makestack/vm.h>
 #include <makestack/logger.h>
+#include <makestack/device_api.h>
 
 {{ code }}
 `
@@ -36,6 +37,15 @@ export function transpileApp(appDir: string): string {
     return render(APP_CXX_TEMPLATE, { code });
 }
 
+// Compiles the app into a bytecode, which can be shipped to a device running
+// the firmware without rebuilding it.
+export function compileAppBytecode(appDir: string): Buffer {
+    const appFile = path.join(appDir, "app.js");
+    const appJs = fs.readFileSync(appFile, "utf-8");
+    const compiler = new BytecodeCompiler();
+    return compiler.compile(appJs);
+}
+
 export async function buildApp(board: Board, appDir: string, opts: BuildOptions) {
     execScriptHook(appDir, "build");
     await board.buildFirmware(appDir, transpileApp(appDir), opts);
@@ -1,10 +1,31 @@
 import { logger } from "../logger";
 
+// The number of VM objects in the device, in the order of VM_STATUS_* in
+// firmware/include/makestack/protocol.h.
+export interface VMObjectCounts {
+    strings: number,
+    functions: number,
+    objects: number,
+    errors: number,
+    scopes: number,
+}
+
 export interface Payload {
     deviceStatus?: {
         state: string,
         batteryLevel: number,
         ramFree: number,
+        vm?: {
+            poolSize: number,
+            live: VMObjectCounts,
+            peak: VMObjectCounts,
+            // In bytes. The budget is 0 if unlimited.
+            heap?: {
+                used: number,
+                peak: number,
+                budget: number,
+            },
+        },
     },
     version?: number,  /* FIXME: use bigint */
     firmwareRequest?: {
@@ -16,6 +37,19 @@ export interface Payload {
         offset: number,
         data: Buffer,
     },
+    // An app bytecode (see firmware/include/makestack/vm_bytecode.h).
+    appInfo?: {
+        version: number,
+        size: number,
+    },
+    appData?: {
+        offset: number,
+        data: Buffer,
+    },
+    appRequest?: {
+        version: number,
+        offset: number,
+    },
     corruptRateCheck?: {
         length: number,
     },
@@ -55,6 +89,16 @@ function decodeLEB128(buf: Buffer): [number, number] {
 }
 
 
+function parseVMObjectCounts(data: Buffer, offset: number): VMObjectCounts {
+    return {
+        strings: data.readUInt16LE(offset),
+        functions: data.readUInt16LE(offset + 2),
+        objects: data.readUInt16LE(offset + 4),
+        errors: data.readUInt16LE(offset + 6),
+        scopes: data.readUInt16LE(offset + 8),
+    };
+}
+
 function computeChecksum(data: Buffer): number {
     let checksum = 0;
     for (var i = 0; i < data.length; i++) {
@@ -84,6 +128,23 @@ export function constructPayload(payload: Payload): Buffer {
         payloadData = Buffer.concat([payloadData, type, encodeLEB128(data.length), data]);
     }
 
+    if (payload.appInfo) {
+        const type = Buffer.from([0x08]);
+        const data = Buffer.alloc(8);
+        data.writeUInt32LE(payload.appInfo.version, 0);
+        data.writeUInt32LE(payload.appInfo.size, 4);
+        payloadData = Buffer.concat([payloadData, type, encodeLEB128(data.length), data]);
+    }
+
+    if (payload.appData) {
+        const chunk = payload.appData.data;
+        const type = Buffer.from([0x09]);
+        const data = Buffer.alloc(4 + chunk.length);
+        data.writeUInt32LE(payload.appData.offset, 0);
+        chunk.copy(data, 4);
+        payloadData = Buffer.concat([payloadData, type, encodeLEB128(data.length), data]);
+    }
+
     if (payload.corruptRateCheck) {
         const type = Buffer.from([0x03]);
         const data = Buffer.alloc(payload.corruptRateCheck.length);
@@ -121,6 +182,7 @@ export function parsePayload(buf: Buffer): Payload {
     }
 
     let firmwareRequest;
+    let appRequest;
     let pong;
     let log;
     let deviceStatus;
@@ -143,6 +205,17 @@ export function parsePayload(buf: Buffer): Payload {
                 state: "", // TODO:
                 batteryLevel: data.readUInt8(1),
                 ramFree: data.readUInt32LE(4),
+                // Older firmware does not send the VM statistics.
+                vm: (data.length < 32) ? undefined : {
+                    poolSize: data.readUInt32LE(8),
+                    live: parseVMObjectCounts(data, 12),
+                    peak: parseVMObjectCounts(data, 22),
+                    heap: (data.length < 44) ? undefined : {
+                        used: data.readUInt32LE(32),
+                        peak: data.readUInt32LE(36),
+                        budget: data.readUInt32LE(40),
+                    },
+                },
             };
             break;
         case 0xaa:
@@ -156,10 +229,21 @@ export function parsePayload(buf: Buffer): Payload {
                 offset: data.readUInt32LE(8),
             };
             break;
+        case 0xab:
+            if (data.length != 8) {
+                logger.warn("malformed field (size of app_request is wrong)");
+                break;
+            }
+
+            appRequest = {
+                version: data.readUInt32LE(0),
+                offset: data.readUInt32LE(4),
+            };
+            break;
         }
 ''
         offset += 1 + lengthLength + length;
     }
 
-    return { pong, firmwareRequest, log, deviceStatus };
+    return { pong, firmwareRequest, appRequest, log, deviceStatus };
 }
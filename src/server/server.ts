@@ -1,4 +1,5 @@
 import * as fs from "fs";
+import * as crypto from "crypto";
 import * as zlib from "zlib";
 import { parsePayload, constructPayload } from "./protocol";
 import { bytesToReadableString } from "../helpers";
@@ -8,6 +9,8 @@ import { extractCredentials } from "../firmware";
 export class ProtocolServer {
     private firmwareVersion!: number;
     private firmwareImage!: Buffer;
+    private appBytecode?: Buffer;
+    private appVersion: number = 0;
     private eventCallback: (name: string, value: any) => void;
     public verifiedPong: boolean = false;
 
@@ -19,9 +22,23 @@ export class ProtocolServer {
         this.eventCallback = eventCallback;
     }
 
+    // Ships the app as a bytecode instead of the firmware image: the device
+    // runs it on the firmware it is running.
+    public setAppBytecode(bytecode: Buffer) {
+        // The device compares versions to determine if it is new. 0 means
+        // that the device has no app bytecode.
+        const digest = crypto.createHash("sha1").update(bytecode).digest();
+        this.appVersion = digest.readUInt32LE(0) || 1;
+        this.appBytecode = bytecode;
+    }
+
     public buildHeartbeatPayload(): Buffer {
         return constructPayload({
             version: this.firmwareVersion,
+            appInfo: this.appBytecode && {
+                version: this.appVersion,
+                size: this.appBytecode.length,
+            },
             ping: {
                 data: Buffer.from("HELO"),
             },
@@ -34,13 +51,33 @@ export class ProtocolServer {
     public processPayload(rawPayload: Buffer):  Buffer | null {
         const payload = parsePayload(rawPayload);
         if (payload.deviceStatus) {
-            const { ramFree } = payload.deviceStatus;
+            const { ramFree, vm } = payload.deviceStatus;
             console.log(`ram free: ${ramFree} bytes (${bytesToReadableString(ramFree)})`);
+            if (vm) {
+                const { live, peak } = vm;
+                console.log(
+                    `vm pool: ${bytesToReadableString(vm.poolSize)}, ` +
+                    `strings: ${live.strings} (peak ${peak.strings}), ` +
+                    `functions: ${live.functions} (peak ${peak.functions}), ` +
+                    `objects: ${live.objects} (peak ${peak.objects}), ` +
+                    `errors: ${live.errors} (peak ${peak.errors}), ` +
+                    `scopes: ${live.scopes} (peak ${peak.scopes})`
+                );
+            }
+
+            if (vm && vm.heap) {
+                const { used, peak, budget } = vm.heap;
+                console.log(
+                    `vm heap: ${bytesToReadableString(used)} ` +
+                    `(peak ${bytesToReadableString(peak)}, ` +
+                    `budget ${budget ? bytesToReadableString(budget) : "unlimited"})`
+                );
+            }
         }
 
         if (payload.log) {
             for (const line of payload.log.split("\n")) {
-                const EVENT_REGEX = /^@(?<name>[^ ]+) (?<type>[bis]):(?<value>.*)$/;
+                const EVENT_REGEX = /^@(?<name>[^ ]+) (?<type>[bisd]):(?<value>.*)$/;
                 const m = line.match(EVENT_REGEX);
                 if (m) {
                     const { name, type, value: valueStr } = m.groups!;
@@ -48,6 +85,7 @@ export class ProtocolServer {
                     switch (type) {
                     case "b": value = (valueStr == "true"); break;
                     case "i": value = parseInt(valueStr); break;
+                    case "d": value = parseFloat(valueStr); break;
                     case "s": value = valueStr; break;
                     default:
                         logger.warn(`unknown event type: \`${type}'`);
@@ -108,6 +146,23 @@ export class ProtocolServer {
             return firmwareDataPayload;
         }
 
+        if (payload.appRequest && this.appBytecode) {
+            if (payload.appRequest.version != this.appVersion) {
+                logger.warn(`invalid app version: ${payload.appRequest.version}`);
+                return null;
+            }
+
+            const offset = payload.appRequest.offset;
+            const DATA_LEN = 4096;
+            const data = this.appBytecode.slice(offset, offset + DATA_LEN);
+            console.log(
+                `Uploading the app len=${data.length}, offset=${offset} ` +
+                `(${this.appBytecode.length} bytes)`
+            );
+
+            return constructPayload({ appData: { offset, data } });
+        }
+
         return null;
     }
 }
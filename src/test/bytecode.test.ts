@@ -0,0 +1,127 @@
+import { BytecodeCompiler, disassemble } from "../transpiler";
+
+function compile(code: string): string {
+    const compiler = new BytecodeCompiler();
+    return ignoreWhitespace(disassemble(compiler.compile(code)));
+}
+
+// Removes whitespaces and newlines to make toStrictEqual ignore them.
+function ignoreWhitespace(code: string): string {
+    return code.replace(/[ \n]/g, "");
+}
+
+test("Hello World!", () => {
+    expect(compile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            device.print("Hello World!");
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        func 0: nparams=0 nregs=2 nboxes=0 nupvals=0 nupboxes=0
+          0: GETG r0 "__onReady"
+          4: CLOSURE r1 f1 0 0
+          10: CALL r0 r0 1 ("(top level)":2)
+          16: RETU
+        func 1: nparams=1 nregs=3 nboxes=0 nupvals=0 nupboxes=0
+          0: GETK r1 r0 "print" c0
+          7: LOADK r2 "Hello World!"
+          11: CALL r1 r1 1 ("(anonymous function)":3)
+          17: RETU
+    `));
+});
+
+test("loops and captured variables", () => {
+    expect(compile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            let count = 0;
+            const inc = () => {
+                count += 1;
+            };
+            for (let i = 0; i < 3; i++) {
+                inc();
+            }
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        func 0: nparams=0 nregs=2 nboxes=0 nupvals=0 nupboxes=0
+          0: GETG r0 "__onReady"
+          4: CLOSURE r1 f1 0 0
+          10: CALL r0 r0 1 ("(top level)":2)
+          16: RETU
+        func 1: nparams=1 nregs=5 nboxes=1 nupvals=0 nupboxes=0
+          0: LOADI r3 0
+          6: SETBOX 0 r3
+          9: CLOSURE r1 f2 0 1 local:0
+          17: LOADI r2 0
+          23: LOADI r3 3
+          29: LT r4 r2 r3
+          33: JF r4 @51
+          37: MOVE r3 r1
+          40: CALL r3 r3 0 ("(anonymous function)":8)
+          46: INC r2
+          48: JMP @23
+          51: RETU
+        func 2: nparams=0 nregs=2 nboxes=0 nupvals=0 nupboxes=1
+          0: GETUPBOX r0 0
+          3: LOADI r1 1
+          9: ADD r0 r0 r1
+          13: SETUPBOX 0 r0
+          16: RETU
+    `));
+});
+
+test("typed arrays", () => {
+    expect(compile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            const samples = new Int16Array(8);
+            samples[0] = samples.length;
+            samples.fill(-1, 1);
+            device.last = samples[1];
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        func 0: nparams=0 nregs=2 nboxes=0 nupvals=0 nupboxes=0
+          0: GETG r0 "__onReady"
+          4: CLOSURE r1 f1 0 0
+          10: CALL r0 r0 1 ("(top level)":2)
+          16: RETU
+        func 1: nparams=1 nregs=7 nboxes=0 nupvals=0 nupboxes=0
+          0: LOADI r2 8
+          6: NEWTA r1 0 r2
+          10: LOADI r2 0
+          16: GETK r3 r1 "length" c0
+          23: SET r1 r2 r3
+          27: MOVE r2 r1
+          30: LOADI r5 1
+          36: NEG r3 r5
+          39: LOADI r4 1
+          45: TACALL r6 0 r2 2
+          50: LOADI r2 1
+          56: GET r3 r1 r2
+          60: SETK r0 "last" r3
+          65: RETU
+    `));
+});
+
+test("template literal escapes", () => {
+    expect(compile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            device.print(\`a\\nb\${device.name}\\t\\\\\`);
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        func 0: nparams=0 nregs=2 nboxes=0 nupvals=0 nupboxes=0
+          0: GETG r0 "__onReady"
+          4: CLOSURE r1 f1 0 0
+          10: CALL r0 r0 1 ("(top level)":2)
+          16: RETU
+        func 1: nparams=1 nregs=6 nboxes=0 nupvals=0 nupboxes=0
+          0: GETK r1 r0 "print" c0
+          7: LOADK r3 "a\\nb"
+          11: GETK r4 r0 "name" c1
+          18: LOADK r5 "\\t\\\\"
+          22: CONCAT r2 r3 3
+          26: CALL r1 r1 1 ("(anonymous function)":3)
+          32: RETU
+    `));
+});
@@ -20,9 +20,8 @@ test("Hello World!", () => {
         });
     `)).toStrictEqual(ignoreWhitespace(`
         VM_FUNC_DEF(__lambda_0, __closure_0) {
-            VM_FUNC_ENTER1(__closure_0, "device");
-            VM_CALL(VM_ANON_LOC(5),VM_MGET(VM_GET("device"), VM_STR("print")),
-            1, VM_STR("Hello World!"));
+            VM_STACK_FUNC_ENTER(__closure_0, 1, 1);
+            VM_NATIVE_CALL(VM_ANON_LOC(5), vm_device_print, VM_STRING_LIT("Hello World!"));
             return VM_UNDEF;
         }
 
@@ -43,10 +42,31 @@ test("binary operators", () => {
         });
     `)).toStrictEqual(ignoreWhitespace(`
         VM_FUNC_DEF(__lambda_0, __closure_0) {
-            VM_FUNC_ENTER0(__closure_0);
-            VM_SET("ans", VM_INT(0));
-            VM_SET("ans", ((VM_INT(1)+VM_INT(2))-(VM_INT(3)*VM_INT(4))));
-            (VM_GET("ans") += VM_INT(5));
+            VM_STACK_FUNC_ENTER(__closure_0, 0, 1);
+            VM_SET_VAR(0, 0, VM_INT(0));
+            VM_SET_VAR(0, 0, ((VM_INT(1)+VM_INT(2))-(VM_INT(3)*VM_INT(4))));
+            (VM_GET_VAR(0, 0) += VM_INT(5));
+            return VM_UNDEF;
+        }
+
+        void app_setup(Context *__ctx) {
+            VM_CALL(VM_APP_LOC("(top level)", 2), VM_GET("__onReady"), 1,
+                    VM_FUNC(__lambda_0, __closure_0));
+        }
+    `));
+});
+
+test("number literals", () => {
+    expect(transpile(`\
+        const app = require("makestack");
+        app.onReady(() => {
+            let x = 0.1 * 3000000000 + 1e-7 + 2.5e+30;
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        VM_FUNC_DEF(__lambda_0, __closure_0) {
+            VM_STACK_FUNC_ENTER(__closure_0, 0, 1);
+            VM_SET_VAR(0, 0, (((VM_DOUBLE(0.1)*VM_DOUBLE(3000000000.0)) + VM_DOUBLE(1e-7))
+                              + VM_DOUBLE(2.5e+30)));
             return VM_UNDEF;
         }
 
@@ -72,21 +92,28 @@ test("if statement", () => {
                 device.print("Where am I?");
         });
     `)).toStrictEqual(ignoreWhitespace(`
+        VM_CONST_STR(__str_0, "location");
+        VM_CONST_STR(__str_1, "earth");
+        VM_CONST_STR(__str_2, "name");
+        VM_CONST_STR(__str_3, "moon");
+        VM_INLINE_CACHE(__ic_0);
+        VM_INLINE_CACHE(__ic_1);
+
         VM_FUNC_DEF(__lambda_0, __closure_0) {
-            VM_FUNC_ENTER1(__closure_0, "device");
+            VM_STACK_FUNC_ENTER(__closure_0, 1, 1);
             if ((VM_INT(1) == VM_INT(2)))
-                VM_CALL(VM_ANON_LOC(4),VM_MGET(VM_GET("device"), VM_STR("print")),
-                       1, VM_STR("Something went wrong!"));;
-
-            if ((VM_MGET(VM_GET("device"), VM_STR("location")) == VM_STR("earth"))) {
-                VM_CALL(VM_ANON_LOC(7),VM_MGET(VM_GET("device"), VM_STR("print")),
-                       1, VM_STR("I'm on the earth!"));
-            } else if((VM_MGET(VM_GET("device"), VM_STR("name"))==VM_STR("moon")))
-                VM_CALL(VM_ANON_LOC(9), VM_MGET(VM_GET("device"), VM_STR("print")),
-                        1, VM_STR("I'm on the moon!"));
+                VM_NATIVE_CALL(VM_ANON_LOC(4), vm_device_print,
+                               VM_STRING_LIT("Something went wrong!"));;
+
+            if ((VM_MGET_IC(VM_GET_VAR(0, 0), VM_CONST(__str_0), __ic_0) == VM_CONST(__str_1))) {
+                VM_NATIVE_CALL(VM_ANON_LOC(7), vm_device_print,
+                               VM_STRING_LIT("I'm on the earth!"));
+            } else if((VM_MGET_IC(VM_GET_VAR(0, 0), VM_CONST(__str_2), __ic_1)==VM_CONST(__str_3)))
+                VM_NATIVE_CALL(VM_ANON_LOC(9), vm_device_print,
+                               VM_STRING_LIT("I'm on the moon!"));
             else
-                VM_CALL(VM_ANON_LOC(11), VM_MGET(VM_GET("device"), VM_STR("print")),
-                        1, VM_STR("WhereamI?"));;
+                VM_NATIVE_CALL(VM_ANON_LOC(11), vm_device_print,
+                               VM_STRING_LIT("Where am I?"));;
 
             return VM_UNDEF;
         }
@@ -111,22 +138,20 @@ test("while statement", () => {
         });
     `)).toStrictEqual(ignoreWhitespace(`
         VM_FUNC_DEF(__lambda_0, __closure_0) {
-            VM_FUNC_ENTER1(__closure_0, "device");
+            VM_STACK_FUNC_ENTER(__closure_0, 1, 1);
             while (VM_INT(1)) {
-                VM_CALL(
+                VM_NATIVE_CALL(
                     VM_ANON_LOC(4),
-                    VM_MGET(VM_GET("device"), VM_STR("print")),
-                    1,
-                    VM_STR("infinite loop")
+                    vm_device_print,
+                    VM_STRING_LIT("infinite loop")
                 );
             };
 
             while (VM_INT(1))
-                VM_CALL(
+                VM_NATIVE_CALL(
                     VM_ANON_LOC(8),
-                    VM_MGET(VM_GET("device"), VM_STR("print")),
-                    1,
-                    VM_STR("unreachable!")
+                    vm_device_print,
+                    VM_STRING_LIT("unreachable!")
                 );;
 
             return VM_UNDEF;
@@ -149,12 +174,356 @@ test("for statement", () => {
         });
     `)).toStrictEqual(ignoreWhitespace(`
         VM_FUNC_DEF(__lambda_0,__closure_0) {
-            VM_FUNC_ENTER1(__closure_0, "device");
-            VM_SET("i", VM_INT(0));
-            for (; (VM_GET("i") < VM_INT(100)); VM_GET("i")++) {
-                VM_CALL(VM_ANON_LOC(4), VM_MGET(VM_GET("device"), VM_STR("print")),
-                        1, VM_STR("finiteloop"));
+            VM_STACK_FUNC_ENTER(__closure_0, 1, 2);
+            VM_SET_VAR(0, 1, VM_INT(0));
+            for (; (VM_GET_VAR(0, 1) < VM_INT(100)); VM_GET_VAR(0, 1)++) {
+                VM_NATIVE_CALL(VM_ANON_LOC(4), vm_device_print, VM_STRING_LIT("finite loop"));
+            };
+            return VM_UNDEF;
+        }
+
+        void app_setup(Context *__ctx) {
+            VM_CALL(VM_APP_LOC("(top level)", 2), VM_GET("__onReady"), 1,
+                    VM_FUNC(__lambda_0, __closure_0));
+        }
+    `));
+});
+
+test("string literals", () => {
+    expect(transpile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            device.print("ping");
+            device.print(\`pong \${device.name}\`);
+            device.print("ping");
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        VM_CONST_STR(__str_0, "pong ");
+        VM_CONST_STR(__str_1, "name");
+        VM_INLINE_CACHE(__ic_0);
+
+        VM_FUNC_DEF(__lambda_0, __closure_0) {
+            VM_STACK_FUNC_ENTER(__closure_0, 1, 1);
+            VM_NATIVE_CALL(VM_ANON_LOC(3), vm_device_print, VM_STRING_LIT("ping"));
+            VM_NATIVE_CALL(VM_ANON_LOC(4), vm_device_print,
+                           VM_STRING_ARG(VM_CONCAT(2, VM_CONST(__str_0),
+                               VM_MGET_IC(VM_GET_VAR(0, 0), VM_CONST(__str_1), __ic_0))));
+            VM_NATIVE_CALL(VM_ANON_LOC(5), vm_device_print, VM_STRING_LIT("ping"));
+            return VM_UNDEF;
+        }
+
+        void app_setup(Context *__ctx) {
+            VM_CALL(VM_APP_LOC("(top level)", 2), VM_GET("__onReady"), 1,
+                    VM_FUNC(__lambda_0, __closure_0));
+        }
+    `));
+});
+
+test("string literal escapes", () => {
+    expect(transpile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            device.print("say \\"hi\\"\\\\\\n\\t\\u0001é");
+            device.name = "\\\\u0041";
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        VM_CONST_STR(__str_0, "\\\\u0041");
+        VM_CONST_STR(__str_1, "name");
+
+        VM_FUNC_DEF(__lambda_0, __closure_0) {
+            VM_STACK_FUNC_ENTER(__closure_0, 1, 1);
+            VM_NATIVE_CALL(VM_ANON_LOC(3), vm_device_print,
+                           VM_STRING_LIT("say\\"hi\\"\\\\\\n\\t\\001\\303\\251"));
+            VM_MSET(VM_GET_VAR(0, 0), VM_CONST(__str_1), VM_CONST(__str_0));
+            return VM_UNDEF;
+        }
+
+        void app_setup(Context *__ctx) {
+            VM_CALL(VM_APP_LOC("(top level)", 2), VM_GET("__onReady"), 1,
+                    VM_FUNC(__lambda_0, __closure_0));
+        }
+    `));
+});
+
+test("template literal escapes", () => {
+    expect(transpile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            device.print(\`a\\nb\${device.name}\\t\\\\\`);
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        VM_CONST_STR(__str_0, "a\\nb");
+        VM_CONST_STR(__str_1, "name");
+        VM_CONST_STR(__str_2, "\\t\\\\");
+        VM_INLINE_CACHE(__ic_0);
+
+        VM_FUNC_DEF(__lambda_0, __closure_0) {
+            VM_STACK_FUNC_ENTER(__closure_0, 1, 1);
+            VM_NATIVE_CALL(VM_ANON_LOC(3), vm_device_print,
+                           VM_STRING_ARG(VM_CONCAT(3, VM_CONST(__str_0),
+                               VM_MGET_IC(VM_GET_VAR(0, 0), VM_CONST(__str_1), __ic_0),
+                               VM_CONST(__str_2))));
+            return VM_UNDEF;
+        }
+
+        void app_setup(Context *__ctx) {
+            VM_CALL(VM_APP_LOC("(top level)", 2), VM_GET("__onReady"), 1,
+                    VM_FUNC(__lambda_0, __closure_0));
+        }
+    `));
+});
+
+test("string concatenation", () => {
+    expect(transpile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            let a = 1;
+            device.print("a=" + a + " b=" + (a + 1));
+            device.print(\`\${a}\${a}\`);
+            device.print(a + 1 + "!" + a);
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        VM_CONST_STR(__str_0, "a=");
+        VM_CONST_STR(__str_1, " b=");
+        VM_CONST_STR(__str_2, "");
+        VM_CONST_STR(__str_3, "!");
+
+        VM_FUNC_DEF(__lambda_0, __closure_0) {
+            VM_STACK_FUNC_ENTER(__closure_0, 1, 2);
+            VM_SET_VAR(0, 1, VM_INT(1));
+            VM_NATIVE_CALL(VM_ANON_LOC(4), vm_device_print,
+                           VM_STRING_ARG(VM_CONCAT(4, VM_CONST(__str_0), VM_GET_VAR(0, 1),
+                               VM_CONST(__str_1), (VM_GET_VAR(0, 1)+VM_INT(1)))));
+            VM_NATIVE_CALL(VM_ANON_LOC(5), vm_device_print,
+                           VM_STRING_ARG(VM_CONCAT(3, VM_CONST(__str_2), VM_GET_VAR(0, 1),
+                               VM_GET_VAR(0, 1))));
+            VM_NATIVE_CALL(VM_ANON_LOC(6), vm_device_print,
+                           VM_STRING_ARG(VM_CONCAT(3, (VM_GET_VAR(0, 1)+VM_INT(1)),
+                               VM_CONST(__str_3), VM_GET_VAR(0, 1))));
+            return VM_UNDEF;
+        }
+
+        void app_setup(Context *__ctx) {
+            VM_CALL(VM_APP_LOC("(top level)", 2), VM_GET("__onReady"), 1,
+                    VM_FUNC(__lambda_0, __closure_0));
+        }
+    `));
+});
+
+test("captured scope", () => {
+    expect(transpile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            let count = 0;
+            const inc = () => {
+                count += 1;
             };
+            inc();
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        VM_FUNC_DEF(__lambda_1, __closure_1) {
+            VM_STACK_FUNC_ENTER(__closure_1, 0, 0);
+            (VM_GET_BOX(1, 0) += VM_INT(1));
+            return VM_UNDEF;
+        }
+
+        VM_FUNC_DEF(__lambda_0, __closure_0) {
+            VM_BOXED_FUNC_ENTER(__closure_0, 1, 2, 1);
+            VM_SET_BOX(0, 0, VM_INT(0));
+            VM_SET_VAR(0, 1, VM_CLOSURE(__lambda_1, 0, 1, VM_CAPTURE_BOX(0, 0, 0)));
+            VM_CALL(VM_ANON_LOC(7), VM_GET_VAR(0, 1), 0);
+            return VM_UNDEF;
+        }
+
+        void app_setup(Context *__ctx) {
+            VM_CALL(VM_APP_LOC("(top level)", 2), VM_GET("__onReady"), 1,
+                    VM_FUNC(__lambda_0, __closure_0));
+        }
+    `));
+});
+
+test("variable resolution", () => {
+    expect(transpile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            let last = 0;
+            const update = (value) => {
+                let prev = last;
+                last = value;
+                counter = prev;
+            };
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        VM_FUNC_DEF(__lambda_1, __closure_1) {
+            VM_STACK_FUNC_ENTER(__closure_1, 1, 2);
+            VM_SET_VAR(0, 1, VM_GET_BOX(1, 0));
+            VM_SET_BOX(1, 0, VM_GET_VAR(0, 0));
+            VM_SET("counter", VM_GET_VAR(0, 1));
+            return VM_UNDEF;
+        }
+
+        VM_FUNC_DEF(__lambda_0, __closure_0) {
+            VM_BOXED_FUNC_ENTER(__closure_0, 1, 2, 1);
+            VM_SET_BOX(0, 0, VM_INT(0));
+            VM_SET_VAR(0, 1, VM_CLOSURE(__lambda_1, 0, 1, VM_CAPTURE_BOX(0, 0, 0)));
+            return VM_UNDEF;
+        }
+
+        void app_setup(Context *__ctx) {
+            VM_CALL(VM_APP_LOC("(top level)", 2), VM_GET("__onReady"), 1,
+                    VM_FUNC(__lambda_0, __closure_0));
+        }
+    `));
+});
+
+test("flat closures", () => {
+    expect(transpile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            const buf = new Int16Array(64);
+            const label = "t=";
+            const report = (t) => {
+                const log = () => {
+                    device.publish(label, t);
+                };
+                log();
+            };
+            report(buf.length);
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        VM_CONST_STR(__str_0, "t=");
+
+        VM_FUNC_DEF(__lambda_2, __closure_2) {
+            VM_STACK_FUNC_ENTER(__closure_2, 0, 0);
+            VM_NATIVE_CALL(VM_ANON_LOC(7), vm_device_publish, VM_STRING_ARG(VM_GET_VAR(1, 0)), VM_GET_VAR(1, 1));
+            return VM_UNDEF;
+        }
+
+        VM_FUNC_DEF(__lambda_1, __closure_1) {
+            VM_STACK_FUNC_ENTER(__closure_1, 1, 2);
+            VM_SET_VAR(0, 1, VM_CLOSURE(__lambda_2, 2, 0, VM_CAPTURE_VAR(0, 1, 0), VM_CAPTURE_VAR(1, 0, 0)));
+            VM_CALL(VM_ANON_LOC(9), VM_GET_VAR(0, 1), 0);
+            return VM_UNDEF;
+        }
+
+        VM_FUNC_DEF(__lambda_0, __closure_0) {
+            VM_STACK_FUNC_ENTER(__closure_0, 1, 4);
+            VM_SET_VAR(0, 1, VM_NEW_TYPED_ARRAY(Int16, VM_INT(64)));
+            VM_SET_VAR(0, 2, VM_CONST(__str_0));
+            VM_SET_VAR(0, 3, VM_CLOSURE(__lambda_1, 1, 0, VM_CAPTURE_VAR(0, 0, 2)));
+            VM_CALL(VM_ANON_LOC(11), VM_GET_VAR(0, 3), 1, VM_TA_LENGTH(VM_GET_VAR(0, 1)));
+            return VM_UNDEF;
+        }
+
+        void app_setup(Context *__ctx) {
+            VM_CALL(VM_APP_LOC("(top level)", 2), VM_GET("__onReady"), 1,
+                    VM_FUNC(__lambda_0, __closure_0));
+        }
+    `));
+});
+
+test("typed arrays", () => {
+    expect(transpile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            const samples = new Int16Array(8);
+            samples[0] = samples.length;
+            samples.fill(-1, 1);
+            device.last = samples[1];
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        VM_CONST_STR(__str_0, "last");
+
+        VM_FUNC_DEF(__lambda_0, __closure_0) {
+            VM_STACK_FUNC_ENTER(__closure_0, 1, 2);
+            VM_SET_VAR(0, 1, VM_NEW_TYPED_ARRAY(Int16, VM_INT(8)));
+            VM_TA_SET(int16_t, VM_GET_VAR(0, 1), VM_INT(0), VM_TA_LENGTH(VM_GET_VAR(0, 1)));
+            VM_TA_CALL(fill, VM_GET_VAR(0, 1), 2, -(VM_INT(1)), VM_INT(1));
+            VM_MSET(VM_GET_VAR(0, 0), VM_CONST(__str_0), VM_TA_GET(int16_t, VM_GET_VAR(0, 1), VM_INT(1)));
+            return VM_UNDEF;
+        }
+
+        void app_setup(Context *__ctx) {
+            VM_CALL(VM_APP_LOC("(top level)", 2), VM_GET("__onReady"), 1,
+                    VM_FUNC(__lambda_0, __closure_0));
+        }
+    `));
+});
+
+test("arrays", () => {
+    expect(transpile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            let pins = [2, 4, 5];
+            const queue = [];
+            queue.push(pins[0], pins.length);
+            pins[1] = queue.pop();
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        VM_CONST_STR(__str_0, "push");
+        VM_CONST_STR(__str_1, "length");
+        VM_CONST_STR(__str_2, "pop");
+        VM_INLINE_CACHE(__ic_0);
+
+        VM_FUNC_DEF(__lambda_0, __closure_0) {
+            VM_STACK_FUNC_ENTER(__closure_0, 1, 3);
+            VM_SET_VAR(0, 1, VM_ARRAY(3, VM_INT(2), VM_INT(4), VM_INT(5)));
+            VM_SET_VAR(0, 2, VM_ARRAY(0));
+            VM_MCALL(VM_ANON_LOC(5), VM_GET_VAR(0, 2), VM_CONST(__str_0), 2,
+                     VM_MGET(VM_GET_VAR(0, 1), VM_INT(0)),
+                     VM_MGET_IC(VM_GET_VAR(0, 1), VM_CONST(__str_1), __ic_0));
+            VM_MSET(VM_GET_VAR(0, 1), VM_INT(1),
+                    VM_MCALL(VM_ANON_LOC(6), VM_GET_VAR(0, 2), VM_CONST(__str_2), 0));
+            return VM_UNDEF;
+        }
+
+        void app_setup(Context *__ctx) {
+            VM_CALL(VM_APP_LOC("(top level)", 2), VM_GET("__onReady"), 1,
+                    VM_FUNC(__lambda_0, __closure_0));
+        }
+    `));
+});
+
+test("update expressions on properties", () => {
+    for (const expr of ["device.count++", "pins[0]--", "++samples[1]"]) {
+        expect(() => transpile(`\
+            const app = require("makestack");
+            app.onReady((device) => {
+                const pins = [2, 4, 5];
+                const samples = new Int16Array(8);
+                ${expr};
+            });
+        `)).toThrow("operator on a property is not yet supported");
+    }
+});
+
+test("device API calls", () => {
+    expect(transpile(`\
+        const app = require("makestack");
+        app.onReady((device) => {
+            let pin = 2;
+            device.pinMode(pin, "OUTPUT");
+            device.digitalWrite(pin, true);
+            device.delay(pin * 100);
+            device.publish("light", device.analogRead(3));
+        });
+    `)).toStrictEqual(ignoreWhitespace(`
+        VM_CONST_STR(__str_0, "publish");
+        VM_CONST_STR(__str_1, "light");
+        VM_INLINE_CACHE(__ic_0);
+
+        VM_FUNC_DEF(__lambda_0, __closure_0) {
+            VM_STACK_FUNC_ENTER(__closure_0, 1, 2);
+            VM_SET_VAR(0, 1, VM_INT(2));
+            VM_NATIVE_CALL(VM_ANON_LOC(4), vm_device_pin_mode,
+                           VM_INT_ARG(VM_GET_VAR(0, 1)), VM_STRING_LIT("OUTPUT"));
+            VM_NATIVE_CALL(VM_ANON_LOC(5), vm_device_digital_write,
+                           VM_INT_ARG(VM_GET_VAR(0, 1)), true);
+            VM_NATIVE_CALL(VM_ANON_LOC(6), vm_device_delay,
+                           VM_INT_ARG((VM_GET_VAR(0, 1) * VM_INT(100))));
+            VM_CALL(VM_ANON_LOC(7), VM_MGET_IC(VM_GET_VAR(0, 0), VM_CONST(__str_0), __ic_0), 2,
+                    VM_CONST(__str_1),
+                    VM_NATIVE_CALL(VM_ANON_LOC(7), vm_device_analog_read, 3));
             return VM_UNDEF;
         }
 
@@ -0,0 +1,1020 @@
+import * as parser from "@babel/parser";
+import * as t from "@babel/types";
+import { TranspileError, UnimplementedError } from ".";
+import {
+    ARRAY_METHODS, FuncScope, TYPED_ARRAYS, TYPED_ARRAY_METHODS, concatOperands, createFuncScope,
+    isAssigned, isDeviceContextAPICall, isRequireCall, newTypedArrayCtor, resolveVar,
+    templateString,
+} from "./transpiler";
+
+// The bytecode backend: compiles app.js into the blob interpreted by the
+// firmware (firmware/include/makestack/vm_bytecode.h) instead of C++. Keep
+// the format and the opcode table in sync with the header.
+const BYTECODE_MAGIC = "MSBC";
+const BYTECODE_VERSION = 1;
+const CONST_STRING = 0;
+const CONST_DOUBLE = 1;
+const FROM_LOCAL = 0;
+const FROM_UPVALUE = 1;
+
+// Opcodes (in the order of their values) and their operands.
+const OPCODES: [string, string][] = [
+    ["MOVE", "rr"], ["LOADK", "rk"], ["LOADI", "ri"], ["LOADU", "r"],
+    ["LOADNULL", "r"], ["LOADTRUE", "r"], ["LOADFALSE", "r"],
+    ["GETUP", "ru"], ["GETBOX", "ru"], ["SETBOX", "ur"], ["GETUPBOX", "ru"],
+    ["SETUPBOX", "ur"], ["GETG", "rk"], ["SETG", "kr"],
+    ["ADD", "rrr"], ["SUB", "rrr"], ["MUL", "rrr"], ["DIV", "rrr"], ["MOD", "rrr"],
+    ["BAND", "rrr"], ["BOR", "rrr"], ["BXOR", "rrr"], ["SHL", "rrr"], ["SHR", "rrr"],
+    ["EQ", "rrr"], ["NE", "rrr"], ["LT", "rrr"], ["LE", "rrr"], ["GT", "rrr"], ["GE", "rrr"],
+    ["NOT", "rr"], ["NEG", "rr"], ["POS", "rr"], ["BNOT", "rr"],
+    ["INC", "r"], ["DEC", "r"], ["CONCAT", "rrn"],
+    ["GET", "rrr"], ["GETK", "rrkc"], ["SET", "rrr"], ["SETK", "rkr"],
+    ["ARRAY", "rrn"], ["NEWTA", "rtr"], ["CLOSURE", "rfnn"],
+    ["CALL", "rrns"], ["MCALL", "rrnkcs"], ["TACALL", "rtrn"],
+    ["JMP", "j"], ["JT", "rj"], ["JF", "rj"], ["RET", "r"], ["RETU", ""],
+];
+
+const OPCODE_VALUES: Map<string, number> = new Map(OPCODES.map(([name], i) => [name, i] as [string, number]));
+
+const BINARY_OPS: { [op: string]: string } = {
+    "+": "ADD", "-": "SUB", "*": "MUL", "/": "DIV", "%": "MOD",
+    "&": "BAND", "|": "BOR", "^": "BXOR", "<<": "SHL", ">>": "SHR",
+    "==": "EQ", "!=": "NE", "===": "EQ", "!==": "NE",
+    "<": "LT", "<=": "LE", ">": "GT", ">=": "GE",
+};
+
+const COMPOUND_ASSIGN_OPS: { [op: string]: string } = {
+    "+=": "ADD", "-=": "SUB", "*=": "MUL", "/=": "DIV",
+    "&=": "BAND", "|=": "BOR", "^=": "BXOR", "<<=": "SHL", ">>=": "SHR",
+};
+
+const UNARY_OPS: { [op: string]: string } = { "!": "NOT", "-": "NEG", "+": "POS", "~": "BNOT" };
+
+// PackedArrayKind in the VM.
+const TYPED_ARRAY_KINDS = ["Int16", "Int32", "Uint8"];
+
+// The registers of a function are its slots (see FuncScope) followed by
+// temporaries, which are freed at the end of each statement.
+const MAX_REGS = 255;
+
+interface Loop {
+    breaks: number[];
+    continues: number[];
+}
+
+// A function being compiled. `scope` is null for the top level.
+interface FuncState {
+    scope: FuncScope | null;
+    name: string;
+    code: number[];
+    nextReg: number;
+    numRegs: number;
+    loops: Loop[];
+}
+
+interface CompiledFunc {
+    nparams: number;
+    nregs: number;
+    nboxes: number;
+    nupvals: number;
+    nupboxes: number;
+    code: number[];
+}
+
+function pushU16(buf: number[], value: number) {
+    buf.push(value & 0xff, (value >> 8) & 0xff);
+}
+
+function pushI32(buf: number[], value: number) {
+    buf.push(value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, (value >>> 24) & 0xff);
+}
+
+export class BytecodeCompiler {
+    private apiVarName: string | null = null;
+    private consts: (string | number)[] = [];
+    private constIndices: Map<string, number> = new Map();
+    private sites: { name: number, line: number }[] = [];
+    private numInlineCaches: number = 0;
+    private funcs: (CompiledFunc | null)[] = [];
+    // The functions being compiled (the innermost one last) excluding the
+    // top level, as in Transpiler.
+    private funcScopes: FuncScope[] = [];
+    private func!: FuncState;
+
+    public compile(code: string): Buffer {
+        const ast = parser.parse(code);
+        this.funcs.push(null);
+        this.func = this.newFuncState(null, "(top level)");
+        for (const stmt of ast.program.body) {
+            this.visitTopLevel(stmt);
+        }
+
+        this.emit("RETU");
+        this.funcs[0] = this.finishFunc(ast.program, 0, 0, 0, 0);
+        return this.serialize();
+    }
+
+    private serialize(): Buffer {
+        const buf: number[] = [];
+        for (const ch of BYTECODE_MAGIC) {
+            buf.push(ch.charCodeAt(0));
+        }
+
+        buf.push(BYTECODE_VERSION, 0);
+        pushU16(buf, this.consts.length);
+        pushU16(buf, this.sites.length);
+        pushU16(buf, this.numInlineCaches);
+        pushU16(buf, this.funcs.length);
+        for (const value of this.consts) {
+            if (typeof value == "string") {
+                const bytes = Buffer.from(value, "utf8");
+                buf.push(CONST_STRING);
+                pushU16(buf, bytes.length);
+                buf.push(...bytes);
+            } else {
+                const bytes = Buffer.alloc(8);
+                bytes.writeDoubleLE(value, 0);
+                buf.push(CONST_DOUBLE, ...bytes);
+            }
+        }
+
+        for (const site of this.sites) {
+            pushU16(buf, site.name);
+            pushU16(buf, site.line);
+        }
+
+        for (const func of this.funcs) {
+            const f = func!;
+            buf.push(f.nparams, f.nregs, f.nboxes, f.nupvals, f.nupboxes);
+            pushU16(buf, f.code.length);
+            for (const byte of f.code) {
+                buf.push(byte);
+            }
+        }
+
+        return Buffer.from(buf);
+    }
+
+    private newFuncState(scope: FuncScope | null, name: string): FuncState {
+        const numSlots = scope ? scope.slots.length : 0;
+        return { scope, name, code: [], nextReg: numSlots, numRegs: numSlots, loops: [] };
+    }
+
+    private finishFunc(node: t.Node, nparams: number, nboxes: number, nupvals: number, nupboxes: number): CompiledFunc {
+        if (this.func.numRegs > MAX_REGS || nboxes > 255 || nupvals > 255 || nupboxes > 255) {
+            throw new TranspileError(node, "Too many variables.");
+        }
+
+        return { nparams, nregs: this.func.numRegs, nboxes, nupvals, nupboxes, code: this.func.code };
+    }
+
+    private constIndex(value: string | number, node: t.Node): number {
+        const key = `${typeof value}:${value}`;
+        let index = this.constIndices.get(key);
+        if (index === undefined) {
+            if (typeof value == "string" && Buffer.byteLength(value, "utf8") > 0xffff) {
+                throw new TranspileError(node, "Too long string.");
+            }
+
+            index = this.consts.length;
+            if (index > 0xffff) {
+                throw new TranspileError(node, "Too many constants.");
+            }
+
+            this.consts.push(value);
+            this.constIndices.set(key, index);
+        }
+
+        return index;
+    }
+
+    private newCallSite(node: t.Node): number {
+        const line = node.loc ? Math.min(node.loc.start.line, 0xffff) : 0;
+        this.sites.push({ name: this.constIndex(this.func.name, node), line });
+        return this.sites.length - 1;
+    }
+
+    private newInlineCache(): number {
+        return this.numInlineCaches++;
+    }
+
+    private allocReg(node: t.Node): number {
+        const reg = this.func.nextReg++;
+        if (reg >= MAX_REGS) {
+            throw new TranspileError(node, "Too many registers.");
+        }
+
+        this.func.numRegs = Math.max(this.func.numRegs, reg + 1);
+        return reg;
+    }
+
+    // Returns `dst` or a new temporary if it is undefined.
+    private target(dst: number | undefined, node: t.Node): number {
+        return (dst === undefined) ? this.allocReg(node) : dst;
+    }
+
+    private emit(op: string, ...operands: number[]) {
+        const code = this.func.code;
+        const opcode = OPCODE_VALUES.get(op)!;
+        code.push(opcode);
+        const kinds = OPCODES[opcode][1];
+        for (let i = 0; i < kinds.length; i++) {
+            switch (kinds[i]) {
+                case "k": case "j": case "s": case "c": case "f":
+                    pushU16(code, operands[i]);
+                    break;
+                case "i":
+                    pushI32(code, operands[i]);
+                    break;
+                default:
+                    code.push(operands[i]);
+            }
+        }
+    }
+
+    private pc(): number {
+        return this.func.code.length;
+    }
+
+    // Emits a jump to be patched later. Returns the position of the offset.
+    private emitJump(op: string, ...operands: number[]): number {
+        this.emit(op, ...operands, 0);
+        return this.pc() - 2;
+    }
+
+    private patchJump(pos: number, target: number, node: t.Node) {
+        // The offset is relative to the next instruction.
+        const offset = target - (pos + 2);
+        if (offset < -0x8000 || offset > 0x7fff) {
+            throw new TranspileError(node, "Too long jump.");
+        }
+
+        this.func.code[pos] = offset & 0xff;
+        this.func.code[pos + 1] = (offset >> 8) & 0xff;
+    }
+
+    private patchJumps(positions: number[], target: number, node: t.Node) {
+        for (const pos of positions) {
+            this.patchJump(pos, target, node);
+        }
+    }
+
+    private resolveVar(name: string) {
+        return resolveVar(this.funcScopes, name, this.funcScopes.length - 1);
+    }
+
+    // Returns the register of `name` if it is a variable of the current
+    // function not stored in a box.
+    private localReg(name: string): number | null {
+        const ref = this.resolveVar(name);
+        return (ref && !ref.boxed && ref.depth == 0) ? ref.index : null;
+    }
+
+    private getVar(name: string, node: t.Node, dst?: number): number {
+        const ref = this.resolveVar(name);
+        if (ref && !ref.boxed && ref.depth == 0) {
+            if (dst === undefined || dst == ref.index) {
+                return ref.index;
+            }
+
+            this.emit("MOVE", dst, ref.index);
+            return dst;
+        }
+
+        const reg = this.target(dst, node);
+        if (!ref) {
+            this.emit("GETG", reg, this.constIndex(name, node));
+        } else if (!ref.boxed) {
+            this.emit("GETUP", reg, ref.index);
+        } else {
+            this.emit(ref.depth == 0 ? "GETBOX" : "GETUPBOX", reg, ref.index);
+        }
+
+        return reg;
+    }
+
+    private setVar(name: string, node: t.Node, value: number) {
+        const ref = this.resolveVar(name);
+        if (!ref) {
+            this.emit("SETG", this.constIndex(name, node), value);
+        } else if (ref.boxed) {
+            this.emit(ref.depth == 0 ? "SETBOX" : "SETUPBOX", ref.index, value);
+        } else if (ref.depth == 0) {
+            if (ref.index != value) {
+                this.emit("MOVE", ref.index, value);
+            }
+        } else {
+            // Captured variables which are assigned are always boxed.
+            throw new TranspileError(node, `cannot assign to the captured variable \`${name}'`);
+        }
+    }
+
+    // Evaluates `value` and assigns it to the variable `name`.
+    private assignVar(name: string, value: t.Node | null, node: t.Node, dst?: number): number {
+        const local = this.localReg(name);
+        let reg;
+        if (local !== null) {
+            reg = value ? this.visitExpr(value, local) : local;
+            if (!value) {
+                this.emit("LOADU", local);
+            }
+        } else {
+            reg = value ? this.visitExpr(value, dst) : this.target(dst, node);
+            if (!value) {
+                this.emit("LOADU", reg);
+            }
+
+            this.setVar(name, node, reg);
+        }
+
+        if (dst !== undefined && dst != reg) {
+            this.emit("MOVE", dst, reg);
+            return dst;
+        }
+
+        return reg;
+    }
+
+    // Evaluates an operand. A variable is used in place unless `later`
+    // (operands evaluated after it) assigns to it.
+    private visitOperand(expr: t.Node, later: t.Node[] = []): number {
+        if (t.isIdentifier(expr) && later.some(node => isAssigned(node, expr.name))) {
+            return this.visitExpr(expr, this.allocReg(expr));
+        }
+
+        return this.visitExpr(expr);
+    }
+
+    // Evaluates `exprs` into consecutive registers. Returns the first one.
+    private visitConsecutive(exprs: t.Node[], node: t.Node): number {
+        const base = this.func.nextReg;
+        for (let i = 0; i < exprs.length; i++) {
+            this.allocReg(node);
+        }
+
+        exprs.forEach((expr, i) => this.visitExpr(expr, base + i));
+        return base;
+    }
+
+    // Returns the element kind if `expr` is a variable known to be a typed
+    // array.
+    private typedArrayOf(expr: t.Node): { kind: string, type: string } | null {
+        if (!t.isIdentifier(expr)) {
+            return null;
+        }
+
+        for (let level = this.funcScopes.length - 1; level >= 0; level--) {
+            const scope = this.funcScopes[level];
+            if (scope.vars.includes(expr.name)) {
+                const ctor = scope.typedArrays.get(expr.name);
+                return ctor ? TYPED_ARRAYS[ctor] : null;
+            }
+        }
+
+        return null;
+    }
+
+    private visitStmt(stmt: t.Statement) {
+        // Temporaries live until the end of the statement.
+        const mark = this.func.nextReg;
+        if (t.isExpressionStatement(stmt)) {
+            this.visitExprStmt(stmt);
+        } else if (t.isVariableDeclaration(stmt)) {
+            this.visitVarDeclStmt(stmt);
+        } else if (t.isIfStatement(stmt)) {
+            this.visitIfStmt(stmt);
+        } else if (t.isWhileStatement(stmt)) {
+            this.visitWhileStmt(stmt);
+        } else if (t.isDoWhileStatement(stmt)) {
+            this.visitDoWhileStmt(stmt);
+        } else if (t.isForStatement(stmt)) {
+            this.visitForStmt(stmt);
+        } else if (t.isBreakStatement(stmt) || t.isContinueStatement(stmt)) {
+            this.visitBreakOrContinueStmt(stmt);
+        } else if (t.isReturnStatement(stmt)) {
+            this.visitReturnStmt(stmt);
+        } else {
+            throw new UnimplementedError(stmt);
+        }
+
+        this.func.nextReg = mark;
+    }
+
+    private visitBlockOrExpr(blockOrExpr: t.Node) {
+        if (t.isBlockStatement(blockOrExpr)) {
+            for (const stmt of blockOrExpr.body) {
+                this.visitStmt(stmt);
+            }
+        } else if (t.isExpressionStatement(blockOrExpr)) {
+            this.visitStmt(blockOrExpr);
+        } else {
+            throw new UnimplementedError(blockOrExpr);
+        }
+    }
+
+    private visitExprStmt(stmt: t.ExpressionStatement) {
+        if (t.isUpdateExpression(stmt.expression)) {
+            this.visitUpdateExpr(stmt.expression, undefined, true);
+        } else {
+            this.visitExpr(stmt.expression);
+        }
+    }
+
+    private visitVarDeclStmt(stmt: t.VariableDeclaration) {
+        for (const decl of stmt.declarations) {
+            if (!t.isIdentifier(decl.id)) {
+                throw new TranspileError(decl.id, `expected an identifier`);
+            }
+
+            this.assignVar(decl.id.name, decl.init, decl);
+        }
+    }
+
+    private visitIfStmt(stmt: t.IfStatement) {
+        const toElse = this.visitCond(stmt.test, false);
+        this.visitBlockOrExpr(stmt.consequent);
+        if (stmt.alternate) {
+            const toEnd = this.emitJump("JMP");
+            this.patchJumps(toElse, this.pc(), stmt);
+            if (t.isIfStatement(stmt.alternate)) {
+                this.visitStmt(stmt.alternate);
+            } else {
+                this.visitBlockOrExpr(stmt.alternate);
+            }
+
+            this.patchJump(toEnd, this.pc(), stmt);
+        } else {
+            this.patchJumps(toElse, this.pc(), stmt);
+        }
+    }
+
+    private visitLoopBody(body: t.Node): Loop {
+        const loop: Loop = { breaks: [], continues: [] };
+        this.func.loops.push(loop);
+        this.visitBlockOrExpr(body);
+        this.func.loops.pop();
+        return loop;
+    }
+
+    private visitWhileStmt(stmt: t.WhileStatement) {
+        const start = this.pc();
+        const toEnd = this.visitCond(stmt.test, false);
+        const loop = this.visitLoopBody(stmt.body);
+        this.patchJumps(loop.continues, start, stmt);
+        this.patchJump(this.emitJump("JMP"), start, stmt);
+        this.patchJumps([...toEnd, ...loop.breaks], this.pc(), stmt);
+    }
+
+    private visitDoWhileStmt(stmt: t.DoWhileStatement) {
+        const start = this.pc();
+        const loop = this.visitLoopBody(stmt.body);
+        this.patchJumps(loop.continues, this.pc(), stmt);
+        this.patchJumps(this.visitCond(stmt.test, true), start, stmt);
+        this.patchJumps(loop.breaks, this.pc(), stmt);
+    }
+
+    private visitForStmt(stmt: t.ForStatement) {
+        if (t.isVariableDeclaration(stmt.init)) {
+            this.visitStmt(stmt.init);
+        } else if (stmt.init) {
+            this.visitStmt(t.expressionStatement(stmt.init));
+        }
+
+        const start = this.pc();
+        const toEnd = stmt.test ? this.visitCond(stmt.test, false) : [];
+        const loop = this.visitLoopBody(stmt.body);
+        this.patchJumps(loop.continues, this.pc(), stmt);
+        if (stmt.update) {
+            this.visitStmt(t.expressionStatement(stmt.update));
+        }
+
+        this.patchJump(this.emitJump("JMP"), start, stmt);
+        this.patchJumps([...toEnd, ...loop.breaks], this.pc(), stmt);
+    }
+
+    private visitBreakOrContinueStmt(stmt: t.BreakStatement | t.ContinueStatement) {
+        if (stmt.label) {
+            throw new UnimplementedError(stmt.label);
+        }
+
+        const loop = this.func.loops[this.func.loops.length - 1];
+        if (!loop) {
+            throw new TranspileError(stmt, `\`${t.isBreakStatement(stmt) ? "break" : "continue"}' outside of a loop.`);
+        }
+
+        const jump = this.emitJump("JMP");
+        (t.isBreakStatement(stmt) ? loop.breaks : loop.continues).push(jump);
+    }
+
+    private visitReturnStmt(stmt: t.ReturnStatement) {
+        if (stmt.argument) {
+            this.emit("RET", this.visitExpr(stmt.argument));
+        } else {
+            this.emit("RETU");
+        }
+    }
+
+    // Emits jumps taken if the truthiness of `expr` is `when`. Returns the
+    // positions to be patched with the target.
+    private visitCond(expr: t.Node, when: boolean): number[] {
+        if (t.isUnaryExpression(expr) && expr.operator == "!") {
+            return this.visitCond(expr.argument, !when);
+        }
+
+        if (t.isLogicalExpression(expr) && ["&&", "||"].includes(expr.operator)) {
+            // `a && b` is false if either is false; `a || b` is true if either
+            // is true.
+            const shortCircuit = expr.operator == "||";
+            if (when == shortCircuit) {
+                return [...this.visitCond(expr.left, when), ...this.visitCond(expr.right, when)];
+            }
+
+            const skip = this.visitCond(expr.left, !when);
+            const jumps = this.visitCond(expr.right, when);
+            this.patchJumps(skip, this.pc(), expr);
+            return jumps;
+        }
+
+        const mark = this.func.nextReg;
+        const reg = this.visitExpr(expr);
+        this.func.nextReg = mark;
+        return [this.emitJump(when ? "JT" : "JF", reg)];
+    }
+
+    private visitCallExpr(expr: t.CallExpression, dst?: number): number {
+        const callee = expr.callee;
+        if (t.isMemberExpression(callee) && this.typedArrayOf(callee.object)) {
+            const method = callee.property;
+            if (callee.computed || !t.isIdentifier(method) || !TYPED_ARRAY_METHODS.includes(method.name)) {
+                throw new TranspileError(expr, "Unsupported typed array method.");
+            }
+
+            const base = this.visitConsecutive([callee.object, ...expr.arguments], expr);
+            const reg = this.target(dst, expr);
+            this.emit("TACALL", reg, TYPED_ARRAY_METHODS.indexOf(method.name), base, expr.arguments.length);
+            return reg;
+        }
+
+        const site = this.newCallSite(expr);
+        if (t.isMemberExpression(callee) && !callee.computed
+            && t.isIdentifier(callee.property) && ARRAY_METHODS.includes(callee.property.name)) {
+            const base = this.visitConsecutive([callee.object, ...expr.arguments], expr);
+            const reg = this.target(dst, expr);
+            const prop = this.constIndex(callee.property.name, expr);
+            this.emit("MCALL", reg, base, expr.arguments.length, prop, this.newInlineCache(), site);
+            return reg;
+        }
+
+        const base = this.visitConsecutive([callee, ...expr.arguments], expr);
+        const reg = (dst === undefined) ? base : dst;
+        this.emit("CALL", reg, base, expr.arguments.length, site);
+        return reg;
+    }
+
+    private visitArrowFuncExpr(func: t.ArrowFunctionExpression, dst?: number): number {
+        if (func.generator) {
+            throw new TranspileError(func, "Generator is not supported.");
+        }
+
+        if (func.async) {
+            throw new TranspileError(func, "Async function is not supported.");
+        }
+
+        if (!t.isBlockStatement(func.body)) {
+            throw new UnimplementedError(func.body);
+        }
+
+        const index = this.funcs.length;
+        if (index > 0xffff) {
+            throw new TranspileError(func, "Too many functions.");
+        }
+
+        this.funcs.push(null);
+        const scope = createFuncScope(func);
+        const nparams = func.params.length;
+        const outer = this.func;
+        this.func = this.newFuncState(scope, "(anonymous function)");
+        this.funcScopes.push(scope);
+
+        // Boxed parameters are copied into their boxes.
+        for (let i = 0; i < nparams; i++) {
+            if (scope.boxes.includes(scope.vars[i])) {
+                this.emit("SETBOX", scope.boxes.indexOf(scope.vars[i]), i);
+            }
+        }
+
+        for (const stmt of func.body.body) {
+            this.visitStmt(stmt);
+        }
+
+        this.emit("RETU");
+        this.funcs[index] = this.finishFunc(func, nparams, scope.boxes.length,
+                                            scope.captured.length, scope.capturedBoxes.length);
+        this.funcScopes.pop();
+        this.func = outer;
+
+        // Build the closure record from the variables of the enclosing function.
+        const reg = this.target(dst, func);
+        this.emit("CLOSURE", reg, index, scope.captured.length, scope.capturedBoxes.length);
+        for (const name of [...scope.captured, ...scope.capturedBoxes]) {
+            const ref = this.resolveVar(name)!;
+            this.func.code.push(ref.depth == 0 ? FROM_LOCAL : FROM_UPVALUE, ref.index);
+        }
+
+        return reg;
+    }
+
+    private visitNumberLit(expr: t.NumericLiteral, dst?: number): number {
+        const reg = this.target(dst, expr);
+        const value = expr.value;
+        if (Number.isInteger(value) && value >= -2147483648 && value <= 2147483647) {
+            this.emit("LOADI", reg, value);
+        } else {
+            this.emit("LOADK", reg, this.constIndex(value, expr));
+        }
+
+        return reg;
+    }
+
+    private visitStringConst(value: string, node: t.Node, dst?: number): number {
+        const reg = this.target(dst, node);
+        this.emit("LOADK", reg, this.constIndex(value, node));
+        return reg;
+    }
+
+    // Concatenates values at once instead of allocating intermediate strings.
+    private visitConcat(parts: t.Node[], node: t.Node, dst?: number): number {
+        const base = this.visitConsecutive(parts, node);
+        const reg = this.target(dst, node);
+        this.emit("CONCAT", reg, base, parts.length);
+        return reg;
+    }
+
+    private visitTemplateLiteral(expr: t.TemplateLiteral, dst?: number): number {
+        if (expr.expressions.length == 0) {
+            return this.visitStringConst(templateString(expr.quasis[0]), expr, dst);
+        }
+
+        // The leading string is always kept (even if it is empty) so that
+        // the result is a string.
+        const parts: t.Node[] = [t.stringLiteral(templateString(expr.quasis[0]))];
+        for (let i = 0; i < expr.expressions.length; i++) {
+            parts.push(expr.expressions[i]);
+            const frag = templateString(expr.quasis[i + 1]);
+            if (frag.length > 0) {
+                parts.push(t.stringLiteral(frag));
+            }
+        }
+
+        return this.visitConcat(parts, expr, dst);
+    }
+
+    private visitMemberExpr(expr: t.MemberExpression, dst?: number): number {
+        if (this.typedArrayOf(expr.object) && !expr.computed
+            && !(t.isIdentifier(expr.property) && expr.property.name == "length")) {
+            throw new TranspileError(expr, "Unsupported typed array property.");
+        }
+
+        if (expr.computed) {
+            const obj = this.visitOperand(expr.object, [expr.property]);
+            const prop = this.visitOperand(expr.property);
+            const reg = this.target(dst, expr);
+            this.emit("GET", reg, obj, prop);
+            return reg;
+        }
+
+        if (!t.isIdentifier(expr.property)) {
+            throw new Error("expected identifier");
+        }
+
+        // The property name is a constant: cache the lookup at this site.
+        const obj = this.visitOperand(expr.object);
+        const reg = this.target(dst, expr);
+        this.emit("GETK", reg, obj, this.constIndex(expr.property.name, expr), this.newInlineCache());
+        return reg;
+    }
+
+    // `i++` as a statement (`unused`) does not need the old value.
+    private visitUpdateExpr(expr: t.UpdateExpression, dst?: number, unused: boolean = false): number {
+        const SUPPORTED_OPS: string[] = ["++", "--"];
+        if (!SUPPORTED_OPS.includes(expr.operator)) {
+            throw new TranspileError(expr, `\`${expr.operator}' operator is not yet supported.`);
+        }
+
+        if (!t.isIdentifier(expr.argument)) {
+            throw new TranspileError(expr, `\`${expr.operator}' operator on a property is not yet supported.`);
+        }
+
+        const op = (expr.operator == "++") ? "INC" : "DEC";
+        const name = expr.argument.name;
+        const local = this.localReg(name);
+        const value = (local !== null) ? local : this.getVar(name, expr, this.allocReg(expr));
+        const prefix = expr.prefix || unused;
+        let reg = value;
+        if (!prefix) {
+            reg = this.target(dst, expr);
+            this.emit("MOVE", reg, value);
+        }
+
+        this.emit(op, value);
+        if (local === null) {
+            this.setVar(name, expr, value);
+        }
+
+        if (prefix && dst !== undefined && dst != reg) {
+            this.emit("MOVE", dst, reg);
+            reg = dst;
+        }
+
+        return reg;
+    }
+
+    // Evaluates `a && b` and `a || b` into a boolean.
+    private visitLogicalExpr(expr: t.LogicalExpression, dst?: number): number {
+        const SUPPORTED_OPS: string[] = [ "||", "&&" ];
+        if (!SUPPORTED_OPS.includes(expr.operator)) {
+            throw new TranspileError(expr, `\`${expr.operator}' operator is not yet supported.`);
+        }
+
+        const reg = this.target(dst, expr);
+        const toFalse = this.visitCond(expr, false);
+        this.emit("LOADTRUE", reg);
+        const toEnd = this.emitJump("JMP");
+        this.patchJumps(toFalse, this.pc(), expr);
+        this.emit("LOADFALSE", reg);
+        this.patchJump(toEnd, this.pc(), expr);
+        return reg;
+    }
+
+    private visitUnaryExpr(expr: t.UnaryExpression, dst?: number): number {
+        const op = UNARY_OPS[expr.operator];
+        if (!op) {
+            throw new TranspileError(expr, `\`${expr.operator}' operator is not yet supported.`);
+        }
+
+        const arg = this.visitOperand(expr.argument);
+        const reg = this.target(dst, expr);
+        this.emit(op, reg, arg);
+        return reg;
+    }
+
+    private visitBinaryExpr(expr: t.BinaryExpression, dst?: number): number {
+        const op = BINARY_OPS[expr.operator];
+        if (!op) {
+            throw new TranspileError(expr, `\`${expr.operator}' operator is not yet supported.`);
+        }
+
+        if (expr.operator == "+") {
+            const operands = concatOperands(expr);
+            if (operands) {
+                return this.visitConcat(operands, expr, dst);
+            }
+        }
+
+        const left = this.visitOperand(expr.left, [expr.right]);
+        const right = this.visitOperand(expr.right);
+        const reg = this.target(dst, expr);
+        this.emit(op, reg, left, right);
+        return reg;
+    }
+
+    private visitAssignExpr(expr: t.AssignmentExpression, dst?: number): number {
+        if (expr.operator == "=") {
+            if (t.isMemberExpression(expr.left)) {
+                return this.visitMemberAssign(expr.left, expr.right, dst);
+            }
+
+            if (!t.isIdentifier(expr.left)) {
+                throw new TranspileError(expr, "The left-hand side of `=' operator must be an identifier or a property.");
+            }
+
+            return this.assignVar(expr.left.name, expr.right, expr, dst);
+        }
+
+        const op = COMPOUND_ASSIGN_OPS[expr.operator];
+        if (!op) {
+            throw new TranspileError(expr, `\`${expr.operator}' operator is not yet supported.`);
+        }
+
+        if (!t.isIdentifier(expr.left)) {
+            throw new TranspileError(expr, `\`${expr.operator}' operator on a property is not yet supported.`);
+        }
+
+        // `x += y` updates the value in place (e.g. appends to the string).
+        const name = expr.left.name;
+        const local = this.localReg(name);
+        const value = (local !== null) ? local : this.getVar(name, expr, this.allocReg(expr));
+        this.emit(op, value, value, this.visitOperand(expr.right));
+        if (local === null) {
+            this.setVar(name, expr, value);
+        }
+
+        if (dst !== undefined && dst != value) {
+            this.emit("MOVE", dst, value);
+            return dst;
+        }
+
+        return value;
+    }
+
+    private visitMemberAssign(member: t.MemberExpression, value: t.Node, dst?: number): number {
+        const later = member.computed ? [member.property, value] : [value];
+        const obj = this.visitOperand(member.object, later);
+        if (member.computed) {
+            const prop = this.visitOperand(member.property, [value]);
+            const reg = this.visitExpr(value, dst);
+            this.emit("SET", obj, prop, reg);
+            return reg;
+        }
+
+        if (!t.isIdentifier(member.property)) {
+            throw new UnimplementedError(member.property);
+        }
+
+        const reg = this.visitExpr(value, dst);
+        this.emit("SETK", obj, this.constIndex(member.property.name, member), reg);
+        return reg;
+    }
+
+    private visitArrayExpr(expr: t.ArrayExpression, dst?: number): number {
+        const elems = expr.elements.map(elem => {
+            if (elem === null || t.isSpreadElement(elem)) {
+                throw new TranspileError(expr, "Holes and spread elements in an array literal are not supported.");
+            }
+
+            return elem;
+        });
+
+        const base = this.visitConsecutive(elems, expr);
+        const reg = this.target(dst, expr);
+        this.emit("ARRAY", reg, base, elems.length);
+        return reg;
+    }
+
+    private visitNewExpr(expr: t.NewExpression, dst?: number): number {
+        const ctor = newTypedArrayCtor(expr);
+        if (!ctor || expr.arguments.length != 1) {
+            throw new TranspileError(expr, "Only `new Int16Array(length)' and its variants are supported.");
+        }
+
+        const length = this.visitOperand(expr.arguments[0]);
+        const reg = this.target(dst, expr);
+        this.emit("NEWTA", reg, TYPED_ARRAY_KINDS.indexOf(TYPED_ARRAYS[ctor].kind), length);
+        return reg;
+    }
+
+    private visitConditionalExpr(expr: t.ConditionalExpression, dst?: number): number {
+        const reg = this.target(dst, expr);
+        const toElse = this.visitCond(expr.test, false);
+        this.visitExpr(expr.consequent, reg);
+        const toEnd = this.emitJump("JMP");
+        this.patchJumps(toElse, this.pc(), expr);
+        this.visitExpr(expr.alternate, reg);
+        this.patchJump(toEnd, this.pc(), expr);
+        return reg;
+    }
+
+    // Evaluates `expr` into `dst` or, if it is undefined, into any register
+    // (a variable is returned as is) and returns the register.
+    private visitExpr(expr: t.Node, dst?: number): number {
+        if (t.isNumericLiteral(expr)) {
+            return this.visitNumberLit(expr, dst);
+        } else if (t.isBooleanLiteral(expr)) {
+            const reg = this.target(dst, expr);
+            this.emit(expr.value ? "LOADTRUE" : "LOADFALSE", reg);
+            return reg;
+        } else if (t.isStringLiteral(expr)) {
+            return this.visitStringConst(expr.value, expr, dst);
+        } else if (t.isTemplateLiteral(expr)) {
+            return this.visitTemplateLiteral(expr, dst);
+        } else if (t.isIdentifier(expr)) {
+            return this.getVar(expr.name, expr, dst);
+        } else if (t.isMemberExpression(expr)) {
+            return this.visitMemberExpr(expr, dst);
+        } else if (t.isCallExpression(expr)) {
+            return this.visitCallExpr(expr, dst);
+        } else if (t.isArrayExpression(expr)) {
+            return this.visitArrayExpr(expr, dst);
+        } else if (t.isNewExpression(expr)) {
+            return this.visitNewExpr(expr, dst);
+        } else if (t.isUnaryExpression(expr)) {
+            return this.visitUnaryExpr(expr, dst);
+        } else if (t.isBinaryExpression(expr)) {
+            return this.visitBinaryExpr(expr, dst);
+        } else if (t.isLogicalExpression(expr)) {
+            return this.visitLogicalExpr(expr, dst);
+        } else if (t.isUpdateExpression(expr)) {
+            return this.visitUpdateExpr(expr, dst);
+        } else if (t.isAssignmentExpression(expr)) {
+            return this.visitAssignExpr(expr, dst);
+        } else if (t.isArrowFunctionExpression(expr)) {
+            return this.visitArrowFuncExpr(expr, dst);
+        } else if (t.isFunctionExpression(expr)) {
+            // XXX:
+            return this.visitArrowFuncExpr(expr as any as t.ArrowFunctionExpression, dst);
+        } else if (t.isConditionalExpression(expr)) {
+            return this.visitConditionalExpr(expr, dst);
+        } else {
+            throw new UnimplementedError(expr);
+        }
+    }
+
+    private visitTopLevel(node: t.Statement) {
+        // Parse `const apiVarName = require("makestack")`.
+        if (t.isVariableDeclaration(node)) {
+            for (const decl of node.declarations) {
+                if (t.isIdentifier(decl.id) && isRequireCall(decl.init, "makestack")) {
+                    this.apiVarName = decl.id.name;
+                }
+            }
+        }
+
+        // app.onReady(...) => __onReady(...)
+        if (isDeviceContextAPICall(this.apiVarName, node)
+            && t.isCallExpression(node.expression)
+            && t.isMemberExpression(node.expression.callee)) {
+            const call = t.callExpression(
+                t.identifier("__" + node.expression.callee.property.name),
+                node.expression.arguments);
+            call.loc = node.expression.loc;
+            this.visitStmt(t.expressionStatement(call));
+        }
+    }
+}
+
+// Returns a human-readable listing of a bytecode for debugging and tests.
+export function disassemble(blob: Buffer): string {
+    let offset = 0;
+    const u8 = () => blob[offset++];
+    const u16 = () => { offset += 2; return blob.readUInt16LE(offset - 2); };
+    if (blob.toString("latin1", 0, 4) != BYTECODE_MAGIC) {
+        throw new Error("not a bytecode");
+    }
+
+    offset = 5;
+    u8();
+    const numConsts = u16();
+    const numSites = u16();
+    u16();
+    const numFuncs = u16();
+    const consts: string[] = [];
+    for (let i = 0; i < numConsts; i++) {
+        if (u8() == CONST_STRING) {
+            const len = u16();
+            consts.push(JSON.stringify(blob.toString("utf8", offset, offset + len)));
+            offset += len;
+        } else {
+            consts.push(String(blob.readDoubleLE(offset)));
+            offset += 8;
+        }
+    }
+
+    const sites: string[] = [];
+    for (let i = 0; i < numSites; i++) {
+        const name = u16();
+        sites.push(`${consts[name]}:${u16()}`);
+    }
+
+    let text = "";
+    for (let i = 0; i < numFuncs; i++) {
+        const [nparams, nregs, nboxes, nupvals, nupboxes] = [u8(), u8(), u8(), u8(), u8()];
+        const end = u16() + offset;
+        text += `func ${i}: nparams=${nparams} nregs=${nregs} nboxes=${nboxes}`
+            + ` nupvals=${nupvals} nupboxes=${nupboxes}\n`;
+        const start = offset;
+        while (offset < end) {
+            const pc = offset - start;
+            const [name, kinds] = OPCODES[u8()];
+            const operands = [];
+            for (const kind of kinds) {
+                switch (kind) {
+                    case "r": operands.push(`r${u8()}`); break;
+                    case "k": operands.push(consts[u16()]); break;
+                    case "i": operands.push(String(blob.readInt32LE(offset))); offset += 4; break;
+                    case "j": {
+                        const rel = blob.readInt16LE(offset);
+                        offset += 2;
+                        operands.push(`@${offset - start + rel}`);
+                        break;
+                    }
+                    case "s": operands.push(`(${sites[u16()]})`); break;
+                    case "c": operands.push(`c${u16()}`); break;
+                    case "f": operands.push(`f${u16()}`); break;
+                    default: operands.push(String(u8()));
+                }
+            }
+
+            if (name == "CLOSURE") {
+                const ncaptures = Number(operands[2]) + Number(operands[3]);
+                for (let j = 0; j < ncaptures; j++) {
+                    const from = u8();
+                    operands.push(`${from == FROM_LOCAL ? "local" : "upvalue"}:${u8()}`);
+                }
+            }
+
+            text += `  ${pc}: ${[name, ...operands].join(" ")}\n`;
+        }
+    }
+
+    return text;
+}
@@ -1,4 +1,5 @@
 import * as t from "@babel/types";
+import { BytecodeCompiler, disassemble } from "./bytecode";
 import { Transpiler } from "./transpiler";
 
 export class TranspileError extends Error {
@@ -15,4 +16,4 @@ export class UnimplementedError extends TranspileError {
     }
 }
 
-export { Transpiler };
+export { BytecodeCompiler, Transpiler, disassemble };
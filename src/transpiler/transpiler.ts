@@ -4,7 +4,7 @@ import traverse, { NodePath } from "@babel/traverse";
 import * as t from "@babel/types";
 import { TranspileError, UnimplementedError } from ".";
 
-function isRequireCall(node: t.Expression | null, pkg: string) {
+export function isRequireCall(node: t.Expression | null, pkg: string) {
     if (t.isCallExpression(node)
         && t.isIdentifier(node.callee)
         && node.callee.name == "require"
@@ -17,7 +17,263 @@ function isRequireCall(node: t.Expression | null, pkg: string) {
     return false;
 }
 
-function isDeviceContextAPICall(apiVarName: string | null, node: t.Node): node is t.ExpressionStatement {
+export function isFunction(node: t.Node): boolean {
+    return t.isArrowFunctionExpression(node) || t.isFunctionExpression(node);
+}
+
+function childNodes(node: t.Node): t.Node[] {
+    const children: t.Node[] = [];
+    for (const key of t.VISITOR_KEYS[node.type]) {
+        const value = (node as any)[key];
+        if (Array.isArray(value)) {
+            children.push(...value.filter(child => child));
+        } else if (value) {
+            children.push(value);
+        }
+    }
+
+    return children;
+}
+
+// Returns function expressions in `node` excluding ones nested in them.
+function innerFunctions(node: t.Node): t.Node[] {
+    let funcs: t.Node[] = [];
+    for (const child of childNodes(node)) {
+        funcs = funcs.concat(isFunction(child) ? [child] : innerFunctions(child));
+    }
+
+    return funcs;
+}
+
+// Returns true if `node` is or contains a function call.
+function containsCall(node: t.Node): boolean {
+    return t.isCallExpression(node) || childNodes(node).some(containsCall);
+}
+
+// Returns `value` as a C string literal. JSON escapes are valid in C except
+// \uXXXX, which JSON.stringify uses for control characters and lone
+// surrogates: they and non-ASCII characters are written as octal escapes of
+// their UTF-8 bytes instead.
+export function cStringLiteral(value: string): string {
+    return JSON.stringify(value).replace(/\\(u[0-9a-f]{4}|.)|[^\x00-\x7f]+/g, (match, escape) => {
+        if (escape && escape[0] != "u") {
+            return match;
+        }
+
+        const chars = escape ? String.fromCharCode(parseInt(escape.slice(1), 16)) : match;
+        let octal = "";
+        for (const byte of Buffer.from(chars, "utf8")) {
+            octal += "\\" + ("00" + byte.toString(8)).slice(-3);
+        }
+
+        return octal;
+    });
+}
+
+// Returns the string of a template literal fragment with escape sequences
+// interpreted. It is null if the fragment has an invalid escape sequence,
+// which is allowed only in tagged templates.
+export function templateString(quasi: t.TemplateElement): string {
+    const cooked = quasi.value.cooked;
+    if (cooked === null || cooked === undefined) {
+        throw new TranspileError(quasi, "Invalid escape sequence in a template literal.");
+    }
+
+    return cooked;
+}
+
+// Returns the operands of a `+` chain like `a + b + "c" + d` to be
+// concatenated at once, or null if the chain does not build a string from a
+// literal or has only two operands. Operands before the first string are
+// added as in JavaScript: `a + b + "c"` concatenates `a + b` and "c".
+export function concatOperands(expr: t.BinaryExpression): t.Expression[] | null {
+    // The `+` nodes from the innermost one, i.e., `a + b`.
+    const chain: t.BinaryExpression[] = [];
+    for (let e: t.Expression = expr; t.isBinaryExpression(e) && e.operator == "+"; e = e.left) {
+        chain.unshift(e);
+    }
+
+    const operands = [chain[0].left, ...chain.map(e => e.right)];
+    const first = operands.findIndex(e => t.isStringLiteral(e) || t.isTemplateLiteral(e));
+    if (first < 0) {
+        return null;
+    }
+
+    const parts = (first <= 1) ? operands : [chain[first - 2], ...operands.slice(first)];
+    return (parts.length > 2) ? parts : null;
+}
+
+// Returns true if `node` (including inner functions) assigns to the variable
+// `name`.
+export function isAssigned(node: t.Node, name: string): boolean {
+    if ((t.isAssignmentExpression(node) && t.isIdentifier(node.left) && node.left.name == name)
+        || (t.isUpdateExpression(node) && t.isIdentifier(node.argument) && node.argument.name == name)) {
+        return true;
+    }
+
+    return childNodes(node).some(child => isAssigned(child, name));
+}
+
+// Returns the names of variables declared in `node` excluding ones declared
+// in inner functions.
+export function collectDeclaredVars(node: t.Node): string[] {
+    let names: string[] = [];
+    if (t.isVariableDeclarator(node) && t.isIdentifier(node.id)) {
+        names.push(node.id.name);
+    }
+
+    for (const child of childNodes(node)) {
+        if (!isFunction(child)) {
+            names = names.concat(collectDeclaredVars(child));
+        }
+    }
+
+    return names;
+}
+
+// Returns declarators of the variable `name` in `node` excluding ones in inner
+// functions.
+function collectDeclarators(node: t.Node, name: string): t.VariableDeclarator[] {
+    let decls: t.VariableDeclarator[] = [];
+    if (t.isVariableDeclarator(node) && t.isIdentifier(node.id) && node.id.name == name) {
+        decls.push(node);
+    }
+
+    for (const child of childNodes(node)) {
+        if (!isFunction(child)) {
+            decls = decls.concat(collectDeclarators(child, name));
+        }
+    }
+
+    return decls;
+}
+
+// Returns true if the function `func` declares the variable `name`.
+function declares(func: t.ArrowFunctionExpression | t.FunctionExpression, name: string): boolean {
+    return func.params.some(param => t.isIdentifier(param) && param.name == name)
+        || collectDeclaredVars(func.body).includes(name);
+}
+
+// Returns true if `node` refers to the variable `name` declared outside of it.
+// Inner functions which declare their own `name` do not refer to it.
+function refersTo(node: t.Node, name: string): boolean {
+    if ((t.isArrowFunctionExpression(node) || t.isFunctionExpression(node)) && declares(node, name)) {
+        return false;
+    }
+
+    if (t.isIdentifier(node)) {
+        return node.name == name;
+    }
+
+    // Property names are not variables.
+    if (t.isMemberExpression(node) && !node.computed) {
+        return refersTo(node.object, name);
+    }
+
+    if (t.isObjectProperty(node) && !node.computed) {
+        return refersTo(node.value, name);
+    }
+
+    return childNodes(node).some(child => refersTo(child, name));
+}
+
+// Returns variables in `vars` (parameters first) of the function `func` which
+// inner functions capture but cannot copy into their closure records when
+// they are created: ones assigned after the declaration and ones which may not
+// be initialized yet. They are stored in boxes shared with the closures.
+export function collectBoxedVars(func: t.ArrowFunctionExpression, vars: string[], nparams: number): string[] {
+    const inner = innerFunctions(func.body);
+    return vars.filter((name, index) => {
+        const capturing = inner.filter(f => refersTo(f, name));
+        if (capturing.length == 0) {
+            return false;
+        }
+
+        if (isAssigned(func.body, name)) {
+            return true;
+        }
+
+        const decls = collectDeclarators(func.body, name);
+        if (index < nparams) {
+            return decls.length > 0;
+        }
+
+        return decls.length != 1 || capturing.some(f => decls[0].end! > f.start!);
+    });
+}
+
+// Typed array constructors and their element kinds and C types in the VM.
+export const TYPED_ARRAYS: { [ctor: string]: { kind: string, type: string } } = {
+    Int16Array: { kind: "Int16", type: "int16_t" },
+    Int32Array: { kind: "Int32", type: "int32_t" },
+    Uint8Array: { kind: "Uint8", type: "uint8_t" },
+};
+
+export const TYPED_ARRAY_METHODS = ["fill", "subarray", "set"];
+
+// Methods of arrays. Calls of them are dispatched at runtime by VM_MCALL since
+// the receiver may be an object which has the property.
+export const ARRAY_METHODS = ["push", "pop"];
+
+// Returns the constructor name if `node` is `new Int16Array(...)` or so.
+export function newTypedArrayCtor(node: t.Node | null): string | null {
+    if (t.isNewExpression(node) && t.isIdentifier(node.callee) && node.callee.name in TYPED_ARRAYS) {
+        return node.callee.name;
+    }
+
+    return null;
+}
+
+// Returns variables declared in `node` (excluding inner functions) which are
+// always typed arrays: all of their declarations are `const x = new
+// Int16Array(...)` with the same constructor.
+export function collectTypedArrayVars(node: t.Node, params: string[]): Map<string, string> {
+    const ctors: Map<string, string | null> = new Map();
+    function visit(node: t.Node) {
+        if (t.isVariableDeclaration(node)) {
+            for (const decl of node.declarations) {
+                if (t.isIdentifier(decl.id)) {
+                    const ctor = (node.kind == "const") ? newTypedArrayCtor(decl.init) : null;
+                    const prev = ctors.get(decl.id.name);
+                    ctors.set(decl.id.name, (prev === undefined || prev == ctor) ? ctor : null);
+                }
+            }
+        }
+
+        for (const child of childNodes(node)) {
+            if (!isFunction(child)) {
+                visit(child);
+            }
+        }
+    }
+
+    visit(node);
+    const typedArrays: Map<string, string> = new Map();
+    for (const [name, ctor] of ctors) {
+        if (ctor && !params.includes(name)) {
+            typedArrays.set(name, ctor);
+        }
+    }
+
+    return typedArrays;
+}
+
+// The device API (firmware/include/makestack/device_api.h): the native
+// function and its parameter types for each method of the device object.
+type NativeParamType = "int" | "bool" | "string" | "value";
+const DEVICE_API: { [method: string]: { func: string, params: NativeParamType[] } } = {
+    print: { func: "vm_device_print", params: ["string"] },
+    publish: { func: "vm_device_publish", params: ["string", "value"] },
+    delay: { func: "vm_device_delay", params: ["int"] },
+    delaySeconds: { func: "vm_device_delay_seconds", params: ["int"] },
+    delayMinutes: { func: "vm_device_delay_minutes", params: ["int"] },
+    pinMode: { func: "vm_device_pin_mode", params: ["int", "string"] },
+    digitalWrite: { func: "vm_device_digital_write", params: ["int", "bool"] },
+    digitalRead: { func: "vm_device_digital_read", params: ["int"] },
+    analogRead: { func: "vm_device_analog_read", params: ["int"] },
+};
+
+export function isDeviceContextAPICall(apiVarName: string | null, node: t.Node): node is t.ExpressionStatement {
     const deviceContextCallbacks = [
         "onReady",
     ];
@@ -32,11 +288,106 @@ function isDeviceContextAPICall(apiVarName: string | null, node: t.Node): node i
         && deviceContextCallbacks.includes(node.expression.callee.property.name);
     }
 
+// Variables of a function being transpiled. The index in `slots` is the slot
+// index in the scope at runtime: parameters come first, followed by declared
+// variables. Variables in `boxes` are stored in boxes instead (parameters also
+// have a slot to receive the argument).
+//
+// Variables of outer functions the function refers to are copied into its
+// closure record (`captured`) or, if boxed, share the box (`capturedBoxes`)
+// when the function value is created.
+export interface FuncScope {
+    vars: string[];
+    slots: string[];
+    boxes: string[];
+    captured: string[];
+    capturedBoxes: string[];
+    // Variables known to be typed arrays: the variable name to the
+    // constructor name.
+    typedArrays: Map<string, string>;
+}
+
+// A resolved variable: the slot or box `index` in the current scope (`depth`
+// is 0) or in the closure record (`depth` is 1). `owner` declares it.
+export interface VarRef {
+    boxed: boolean;
+    depth: number;
+    index: number;
+    owner: FuncScope;
+}
+
+// Returns the variables of the function `func`.
+export function createFuncScope(func: t.ArrowFunctionExpression): FuncScope {
+    const vars: string[] = [];
+    for (const param of func.params) {
+        if (t.isIdentifier(param)) {
+            vars.push(param.name);
+        } else {
+            throw new UnimplementedError(param);
+        }
+    }
+
+    const nparams = vars.length;
+    for (const name of collectDeclaredVars(func.body)) {
+        if (!vars.includes(name)) {
+            vars.push(name);
+        }
+    }
+
+    const boxes = collectBoxedVars(func, vars, nparams);
+    return {
+        vars,
+        slots: vars.filter((name, index) => index < nparams || !boxes.includes(name)),
+        boxes,
+        captured: [],
+        capturedBoxes: [],
+        typedArrays: collectTypedArrayVars(func.body, vars.slice(0, nparams)),
+    };
+}
+
+// Resolves a variable in the `level`-th function of `funcScopes` (the
+// innermost one last). Returns null if it's not declared in the functions,
+// i.e., it is a global variable registered at runtime. A variable of an outer
+// function is added to the captures of the function and functions in between.
+export function resolveVar(funcScopes: FuncScope[], name: string, level: number): VarRef | null {
+    if (level < 0) {
+        return null;
+    }
+
+    const scope = funcScopes[level];
+    if (scope.vars.includes(name)) {
+        const boxed = scope.boxes.includes(name);
+        const index = boxed ? scope.boxes.indexOf(name) : scope.slots.indexOf(name);
+        return { boxed, depth: 0, index, owner: scope };
+    }
+
+    const outer = resolveVar(funcScopes, name, level - 1);
+    if (!outer) {
+        return null;
+    }
+
+    const captures = outer.boxed ? scope.capturedBoxes : scope.captured;
+    if (!captures.includes(name)) {
+        captures.push(name);
+    }
+
+    return { boxed: outer.boxed, depth: 1, index: captures.indexOf(name), owner: outer.owner };
+}
+
 export class Transpiler {
     private lambda: string = "";
     private setup: string = "";
     private apiVarName: string | null = null;
     private funcNameStack: string[] = ["(top level)"];
+    private constStrings: Map<string, string> = new Map();
+    private numInlineCaches: number = 0;
+    // The functions being transpiled (the innermost one last).
+    private funcScopes: FuncScope[] = [];
+    // The callback passed to onReady and, while transpiling it, its scope if
+    // its first parameter is never reassigned: the parameter is always the
+    // device object.
+    private deviceCallback: t.Node | null = null;
+    private deviceScope: FuncScope | null = null;
 
     public transpile(code: string): string {
         const ast = parser.parse(code);
@@ -50,7 +401,92 @@ export class Transpiler {
             }
         });
 
-        return this.lambda + "\n\nvoid app_setup(Context *__ctx) {\n" + this.setup + "}\n";
+        return this.emitStaticDefs() + this.lambda + "\n\nvoid app_setup(Context *__ctx) {\n" + this.setup + "}\n";
+    }
+
+    // String literals are defined once as never-freed static values so that
+    // evaluating a literal does not allocate.
+    private constString(value: string): string {
+        let name = this.constStrings.get(value);
+        if (!name) {
+            name = `__str_${this.constStrings.size}`;
+            this.constStrings.set(value, name);
+        }
+
+        return `VM_CONST(${name})`;
+    }
+
+    // Allocates an inline cache for a property lookup site.
+    private newInlineCache(): string {
+        return `__ic_${this.numInlineCaches++}`;
+    }
+
+    private emitStaticDefs(): string {
+        let code = "";
+        for (const [value, name] of this.constStrings) {
+            code += `VM_CONST_STR(${name}, ${cStringLiteral(value)});\n`;
+        }
+
+        for (let i = 0; i < this.numInlineCaches; i++) {
+            code += `VM_INLINE_CACHE(__ic_${i});\n`;
+        }
+
+        return code + "\n";
+    }
+
+    private resolveVar(name: string, level: number = this.funcScopes.length - 1): VarRef | null {
+        return resolveVar(this.funcScopes, name, level);
+    }
+
+    // Returns the innermost function which declares `name` without capturing it.
+    private ownerOf(name: string): FuncScope | null {
+        for (let level = this.funcScopes.length - 1; level >= 0; level--) {
+            if (this.funcScopes[level].vars.includes(name)) {
+                return this.funcScopes[level];
+            }
+        }
+
+        return null;
+    }
+
+    // Returns the element kind and type if `expr` is a variable known to be a
+    // typed array.
+    private typedArrayOf(expr: t.Node): { kind: string, type: string } | null {
+        if (!t.isIdentifier(expr)) {
+            return null;
+        }
+
+        const owner = this.ownerOf(expr.name);
+        const ctor = owner ? owner.typedArrays.get(expr.name) : undefined;
+        return ctor ? TYPED_ARRAYS[ctor] : null;
+    }
+
+    // Returns true if `expr` is the device object passed to onReady.
+    private isDeviceObject(expr: t.Node): boolean {
+        if (!t.isIdentifier(expr) || !this.deviceScope) {
+            return false;
+        }
+
+        const owner = this.ownerOf(expr.name);
+        return owner === this.deviceScope && owner.vars.indexOf(expr.name) == 0;
+    }
+
+    private getVar(name: string): string {
+        const ref = this.resolveVar(name);
+        if (!ref) {
+            return `VM_GET("${name}")`;
+        }
+
+        return `${ref.boxed ? "VM_GET_BOX" : "VM_GET_VAR"}(${ref.depth}, ${ref.index})`;
+    }
+
+    private setVar(name: string, value: string): string {
+        const ref = this.resolveVar(name);
+        if (!ref) {
+            return `VM_SET("${name}", ${value})`;
+        }
+
+        return `${ref.boxed ? "VM_SET_BOX" : "VM_SET_VAR"}(${ref.depth}, ${ref.index}, ${value})`;
     }
 
     private getCurrentFuncName(): string {
@@ -90,7 +526,7 @@ export class Transpiler {
         }
 
         const id = this.getNameFromVarDeclId(decl.id);
-        return `VM_SET("${id}", ${init})`;
+        return this.setVar(id, init);
     }
 
     private visitVarDeclStmt(stmt: t.VariableDeclaration): string {
@@ -203,18 +639,71 @@ export class Transpiler {
     }
 
     private visitCallExpr(expr: t.CallExpression): string {
-        const callee = this.visitExpr(expr.callee);
+        if (t.isMemberExpression(expr.callee) && this.typedArrayOf(expr.callee.object)) {
+            const method = expr.callee.property;
+            if (expr.callee.computed || !t.isIdentifier(method) || !TYPED_ARRAY_METHODS.includes(method.name)) {
+                throw new TranspileError(expr, "Unsupported typed array method.");
+            }
+
+            const array = this.visitExpr(expr.callee.object);
+            const args = expr.arguments.map(arg => this.visitExpr(arg));
+            return `VM_TA_CALL(${[method.name, array, args.length, ...args].join(", ")})`;
+        }
+
         const func = this.getCurrentFuncName();
         const line = (expr.loc) ? expr.loc.start.line : -1;
+        const loc = (func == "(anonymous function)") ? `VM_ANON_LOC(${line})` : `VM_APP_LOC("${func}", ${line})`;
+        // Call the device API directly. Arguments must not call functions:
+        // the frame of the native function is recorded before evaluating them.
+        if (t.isMemberExpression(expr.callee) && !expr.callee.computed
+            && t.isIdentifier(expr.callee.property)
+            && DEVICE_API.hasOwnProperty(expr.callee.property.name)
+            && this.isDeviceObject(expr.callee.object)) {
+            const api = DEVICE_API[expr.callee.property.name];
+            if (api.params.length == expr.arguments.length && !expr.arguments.some(containsCall)) {
+                const args = expr.arguments.map((arg, i) => this.visitNativeArg(arg, api.params[i]));
+                return `VM_NATIVE_CALL(${[loc, api.func, ...args].join(", ")})`;
+            }
+        }
+
+        if (t.isMemberExpression(expr.callee) && !expr.callee.computed
+            && t.isIdentifier(expr.callee.property) && ARRAY_METHODS.includes(expr.callee.property.name)) {
+            const obj = this.visitExpr(expr.callee.object);
+            const method = this.constString(expr.callee.property.name);
+            const args = expr.arguments.map(arg => this.visitExpr(arg));
+            return `VM_MCALL(${[loc, obj, method, args.length, ...args].join(", ")})`;
+        }
+
+        const callee = this.visitExpr(expr.callee);
         const args = expr.arguments.map(arg => this.visitExpr(arg));
-        const callArgs = [
-            (func == "(anonymous function)") ? `VM_ANON_LOC(${line})` : `VM_APP_LOC("${func}", ${line})`,
-            callee,
-            args.length,
-            ...args
-        ];
+        return `VM_CALL(${[loc, callee, args.length, ...args].join(", ")})`;
+    }
+
+    // Converts an argument of a native function into the C type. Literals are
+    // converted here.
+    private visitNativeArg(arg: t.Node, type: NativeParamType): string {
+        switch (type) {
+            case "int":
+                if (t.isNumericLiteral(arg) && (arg.value | 0) === arg.value) {
+                    return `${arg.value}`;
+                }
+
+                return `VM_INT_ARG(${this.visitExpr(arg)})`;
+            case "bool":
+                if (t.isBooleanLiteral(arg)) {
+                    return `${arg.value}`;
+                }
+
+                return `VM_BOOL_ARG(${this.visitExpr(arg)})`;
+            case "string":
+                if (t.isStringLiteral(arg)) {
+                    return `VM_STRING_LIT(${cStringLiteral(arg.value)})`;
+                }
 
-        return `VM_CALL(${callArgs.join(", ")})`;
+                return `VM_STRING_ARG(${this.visitExpr(arg)})`;
+            default:
+                return this.visitExpr(arg);
+        }
     }
 
     private lambdaId: number = 0;
@@ -232,43 +721,75 @@ export class Transpiler {
         const closureName = `__closure_${uniqueId}`;
         this.lambdaId++;
 
-        const paramNames = [];
-        for (const param of func.params) {
-            if (t.isIdentifier(param)) {
-                paramNames.push(`"${param.name}"`);
-            } else {
-                throw new UnimplementedError(param);
-            }
-        }
+        const scope = createFuncScope(func);
+        const { vars, boxes } = scope;
+        const nparams = func.params.length;
 
         this.funcNameStack.push("(anonymous function)");
+        this.funcScopes.push(scope);
+        if (func === this.deviceCallback && nparams > 0 && !isAssigned(func.body, vars[0])) {
+            this.deviceScope = scope;
+        }
+
         let body;
         if (t.isBlockStatement(func.body)) {
             body = this.visitFunctionBody(func.body);
         } else {
             throw new UnimplementedError(func.body);
         }
+        this.funcScopes.pop();
         this.funcNameStack.pop();
 
-        let nargs = paramNames.length;
-        if (nargs > 6) {
-            throw new TranspileError(func, "Too many parameters.");
+        // The scope is allocated on the C stack: inner functions never capture
+        // it. Boxed parameters are copied into their boxes.
+        let enterMacro;
+        if (boxes.length > 0) {
+            enterMacro = `VM_BOXED_FUNC_ENTER(${closureName}, ${nparams}, ${scope.slots.length}, ${boxes.length});`;
+            for (let i = 0; i < nparams; i++) {
+                if (boxes.includes(vars[i])) {
+                    enterMacro += `VM_SET_BOX(0, ${boxes.indexOf(vars[i])}, VM_GET_VAR(0, ${i}));`;
+                }
+            }
+        } else {
+            enterMacro = `VM_STACK_FUNC_ENTER(${closureName}, ${nparams}, ${scope.slots.length});`;
         }
 
-        const macroArgs = [closureName, ...paramNames];
-        const enterMacro = `VM_FUNC_ENTER${nargs}(${macroArgs.join(", ")});`;
         body = body.replace(/^[ \t\n]*\{/, enterMacro);
-
         this.lambda += `VM_FUNC_DEF(${lambdaName}, ${closureName}) {\n${body}\n\n`;
-        return `VM_FUNC(${lambdaName}, ${closureName})`;
+
+        // Build the closure record from the variables of the enclosing function.
+        if (scope.captured.length == 0 && scope.capturedBoxes.length == 0) {
+            return `VM_FUNC(${lambdaName}, ${closureName})`;
+        }
+
+        const captures = [];
+        for (const [i, name] of scope.captured.entries()) {
+            const ref = this.resolveVar(name)!;
+            captures.push(`VM_CAPTURE_VAR(${i}, ${ref.depth}, ${ref.index})`);
+        }
+
+        for (const [i, name] of scope.capturedBoxes.entries()) {
+            const ref = this.resolveVar(name)!;
+            captures.push(`VM_CAPTURE_BOX(${i}, ${ref.depth}, ${ref.index})`);
+        }
+
+        return `VM_CLOSURE(${lambdaName}, ${scope.captured.length}, ${scope.capturedBoxes.length}, ${captures.join(", ")})`;
     }
 
     private visitNumberLit(expr: t.NumericLiteral): string {
-        if (!Number.isInteger(expr.value)) {
-            throw new TranspileError(expr, "non-integer number is not yet supported");
+        const value = expr.value;
+        if (Number.isInteger(value) && value >= -2147483648 && value <= 2147483647) {
+            return `VM_INT(${value})`;
+        }
+
+        // String() returns the shortest representation which reads back as
+        // the same double. Make sure that it is a floating-point literal in C++.
+        let literal = String(value);
+        if (!/[.e]/.test(literal)) {
+            literal += ".0";
         }
 
-        return `VM_INT(${expr.value})`;
+        return `VM_DOUBLE(${literal})`;
     }
 
     private visitBooleanLit(expr: t.BooleanLiteral): string {
@@ -276,48 +797,63 @@ export class Transpiler {
     }
 
     private visitStringLit(expr: t.StringLiteral): string {
-        // TODO: escape sequences
-        return `VM_STR("${expr.value}")`;
+        return this.constString(expr.value);
     }
 
     private visitTemplateLiteral(expr: t.TemplateLiteral): string {
-        let tmpl = "";
-        let str = true;
-        let expr_i = 0;
-        let str_i = 0;
-        while (expr.quasis[str_i]) {
-            if (str) {
-                const frag = expr.quasis[str_i++];
-                tmpl += `VM_STR("${frag.value.raw}")`;
-                tmpl += frag.tail ? "" : " + ";
-            } else {
-                const exprStr = this.visitExpr(expr.expressions[expr_i++]);
-                tmpl += `(${exprStr}) + `;
-            }
+        if (expr.expressions.length == 0) {
+            return this.constString(templateString(expr.quasis[0]));
+        }
 
-            str = !str;
+        // The leading string is always kept (even if it is empty) so that
+        // the result is a string.
+        const parts = [this.constString(templateString(expr.quasis[0]))];
+        for (let i = 0; i < expr.expressions.length; i++) {
+            parts.push(this.visitExpr(expr.expressions[i]));
+            const frag = templateString(expr.quasis[i + 1]);
+            if (frag.length > 0) {
+                parts.push(this.constString(frag));
+            }
         }
 
-        return `(${tmpl})`;
+        return this.concat(parts);
+    }
+
+    // Concatenates values at once instead of allocating intermediate strings.
+    private concat(parts: string[]): string {
+        return `VM_CONCAT(${parts.length}, ${parts.join(", ")})`;
     }
 
     private visitIdentExpr(expr: t.Identifier): string {
-        return `VM_GET("${expr.name}")`;
+        return this.getVar(expr.name);
     }
 
     private visitMemberExpr(expr: t.MemberExpression): string {
         const obj = this.visitExpr(expr.object);
-        let prop;
-        if (expr.computed) {
-            prop = this.visitExpr(expr.property);
-        } else {
-            if (!t.isIdentifier(expr.property)) {
-                throw new Error("expected identifier");
+        const typedArray = this.typedArrayOf(expr.object);
+        if (typedArray) {
+            // Access elements directly.
+            if (expr.computed) {
+                return `VM_TA_GET(${typedArray.type}, ${obj}, ${this.visitExpr(expr.property)})`;
+            } else if (t.isIdentifier(expr.property) && expr.property.name == "length") {
+                return `VM_TA_LENGTH(${obj})`;
+            } else {
+                throw new TranspileError(expr, "Unsupported typed array property.");
             }
-            prop = `VM_STR("${expr.property.name}")`;
         }
 
-        return `VM_MGET(${obj}, ${prop})`
+        if (expr.computed) {
+            const prop = this.visitExpr(expr.property);
+            return `VM_MGET(${obj}, ${prop})`
+        }
+
+        if (!t.isIdentifier(expr.property)) {
+            throw new Error("expected identifier");
+        }
+
+        // The property name is a constant: cache the lookup at this site.
+        const prop = this.constString(expr.property.name);
+        return `VM_MGET_IC(${obj}, ${prop}, ${this.newInlineCache()})`
     }
 
     private visitUpdateExpr(expr: t.UpdateExpression): string {
@@ -326,6 +862,10 @@ export class Transpiler {
             throw new TranspileError(expr, `\`${expr.operator}' operator is not yet supported.`);
         }
 
+        if (!t.isIdentifier(expr.argument)) {
+            throw new TranspileError(expr, `\`${expr.operator}' operator on a property is not yet supported.`);
+        }
+
         let arg = this.visitExpr(expr.argument);
         return expr.prefix ? (expr.operator + arg) : (arg + expr.operator);
     }
@@ -360,6 +900,13 @@ export class Transpiler {
             throw new TranspileError(expr, `\`${expr.operator}' operator is not yet supported.`);
         }
 
+        if (expr.operator == "+") {
+            const operands = concatOperands(expr);
+            if (operands) {
+                return this.concat(operands.map(operand => this.visitExpr(operand)));
+            }
+        }
+
         let op: string = expr.operator;
         if (["===", "!=="].includes(op)) {
             // Replace === and !=== with == and != respectively.
@@ -379,16 +926,65 @@ export class Transpiler {
         }
 
         if (expr.operator == "=") {
+            if (t.isMemberExpression(expr.left)) {
+                return this.visitMemberAssign(expr.left, this.visitExpr(expr.right));
+            }
+
             if (!t.isIdentifier(expr.left)) {
-                throw new TranspileError(expr, "The left-hand side of `=' operator must be an identifier.");
+                throw new TranspileError(expr, "The left-hand side of `=' operator must be an identifier or a property.");
             }
 
-            return `VM_SET("${expr.left.name}", ${this.visitExpr(expr.right)})`;
+            return this.setVar(expr.left.name, this.visitExpr(expr.right));
         } else {
+            if (t.isMemberExpression(expr.left)) {
+                throw new TranspileError(expr, `\`${expr.operator}' operator on a property is not yet supported.`);
+            }
+
             return "(" + this.visitExpr(expr.left) + expr.operator + this.visitExpr(expr.right) + ")";
         }
     }
 
+    private visitMemberAssign(member: t.MemberExpression, value: string): string {
+        const obj = this.visitExpr(member.object);
+        const typedArray = this.typedArrayOf(member.object);
+        if (typedArray && member.computed) {
+            return `VM_TA_SET(${typedArray.type}, ${obj}, ${this.visitExpr(member.property)}, ${value})`;
+        }
+
+        let prop;
+        if (member.computed) {
+            prop = this.visitExpr(member.property);
+        } else if (t.isIdentifier(member.property)) {
+            prop = this.constString(member.property.name);
+        } else {
+            throw new UnimplementedError(member.property);
+        }
+
+        return `VM_MSET(${obj}, ${prop}, ${value})`;
+    }
+
+    private visitArrayExpr(expr: t.ArrayExpression): string {
+        const elems = expr.elements.map(elem => {
+            if (elem === null || t.isSpreadElement(elem)) {
+                throw new TranspileError(expr, "Holes and spread elements in an array literal are not supported.");
+            }
+
+            return this.visitExpr(elem);
+        });
+
+        return `VM_ARRAY(${[elems.length, ...elems].join(", ")})`;
+    }
+
+    private visitNewExpr(expr: t.NewExpression): string {
+        const ctor = newTypedArrayCtor(expr);
+        if (!ctor || expr.arguments.length != 1) {
+            throw new TranspileError(expr, "Only `new Int16Array(length)' and its variants are supported.");
+        }
+
+        const length = this.visitExpr(expr.arguments[0]);
+        return `VM_NEW_TYPED_ARRAY(${TYPED_ARRAYS[ctor].kind}, ${length})`;
+    }
+
     private visitConditionalExpr(expr: t.ConditionalExpression): string {
         const test = this.visitExpr(expr.test);
         const trueExpr = this.visitExpr(expr.consequent);
@@ -411,6 +1007,10 @@ export class Transpiler {
             return this.visitMemberExpr(expr);
         } else if (t.isCallExpression(expr)) {
             return this.visitCallExpr(expr);
+        } else if (t.isArrayExpression(expr)) {
+            return this.visitArrayExpr(expr);
+        } else if (t.isNewExpression(expr)) {
+            return this.visitNewExpr(expr);
         } else if (t.isUnaryExpression(expr)) {
             return this.visitUnaryExpr(expr);
         } else if (t.isBinaryExpression(expr)) {
@@ -453,7 +1053,10 @@ export class Transpiler {
             && t.isMemberExpression(node.expression.callee)) {
             // app.onReady(...) => __onReady(...)
             node.expression.callee = t.identifier("__" + node.expression.callee.property.name);
+            this.deviceCallback = node.expression.arguments[0] || null;
             this.setup += this.visitCallExpr(node.expression) + `;`;
+            this.deviceCallback = null;
+            this.deviceScope = null;
         }
     }
 }